@@ -0,0 +1,227 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <string>
+
+#include "log.h"
+#include "image_writer.h"
+#include "opencl_manager.h"
+#include "render_scheduler.h"
+#include "renderer.h"
+#include "timer.h"
+
+// Headless progressive render to an image file.
+// usage: offline [--scene render|demo_cubemap] [--width w] [--height h] [--spp n] [--time seconds] [--noise threshold]
+//                [--seed s] [--adaptive threshold] [--samples-per-launch n] [--denoise] [--aov name,...] [--out file.exr|file.pfm]
+//                [--checkpoint file] [--checkpoint-interval seconds] [--resume]
+// The render stops at whichever budget comes first: --spp samples per pixel (1024 unless
+// --time or --noise is given), --time seconds of wall clock since start, or a mean
+// relative standard error below --noise.
+// With --adaptive, pixels whose relative standard error drops below the threshold stop
+// getting samples, and the render also stops once no pixel is left above it.
+// Every launch traces --samples-per-launch samples per pixel (4 by default) to keep
+// launch overhead out of the way; lower it if a launch trips the display watchdog.
+// --denoise writes the a-trous filtered image as R, G, B and, to .exr, the unfiltered
+// one as noisy.R, noisy.G, noisy.B.
+// --aov adds passes to the .exr: depth, normal, albedo, primitive_id, material_id, direct,
+// indirect, samples and variance. Only the ones asked for are computed on the device.
+// With --checkpoint the accumulation is saved every interval and on SIGTERM/SIGINT,
+// and --resume continues from it, so a preempted job loses at most one interval.
+// Exits with 0 once the image is written, 3 when stopped by a signal, 2 on errors.
+
+using namespace CGRA;
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_signal(int)
+{
+    g_stop = 1;
+}
+
+int main(int argc, char** argv)
+{
+    Renderer::Scene scene = Renderer::SCENE_SPHERES;
+    int width = 640;
+    int height = 480;
+    int spp = 0;
+    double seconds = 0.0;
+    double noise = 0.0;
+    bool seeded = false;
+    uint32_t seed = 0;
+    double adaptive = 0.0;
+    int samplesPerLaunch = 4;
+    bool denoise = false;
+    unsigned aovs = 0;
+    std::string out;
+    std::string checkpoint;
+    double interval = 60.0;
+    bool resume = false;
+
+    for (int i = 1; i < argc; i++) {
+        const bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--scene") == 0 && hasValue) {
+            i++;
+            if (strcmp(argv[i], Renderer::getSceneName(Renderer::SCENE_SPHERES)) == 0) {
+                scene = Renderer::SCENE_SPHERES;
+            }
+            else if (strcmp(argv[i], Renderer::getSceneName(Renderer::SCENE_CUBEMAP)) == 0) {
+                scene = Renderer::SCENE_CUBEMAP;
+            }
+            else {
+                CGRA_LOGE("unknown scene %s", argv[i]);
+                return 2;
+            }
+        }
+        else if (strcmp(argv[i], "--width") == 0 && hasValue) {
+            width = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--height") == 0 && hasValue) {
+            height = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--spp") == 0 && hasValue) {
+            spp = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--time") == 0 && hasValue) {
+            seconds = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--noise") == 0 && hasValue) {
+            noise = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && hasValue) {
+            seeded = true;
+            seed = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--adaptive") == 0 && hasValue) {
+            adaptive = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--samples-per-launch") == 0 && hasValue) {
+            samplesPerLaunch = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--denoise") == 0) {
+            denoise = true;
+        }
+        else if (strcmp(argv[i], "--aov") == 0 && hasValue) {
+            std::string list = argv[++i];
+            size_t begin = 0;
+            while (begin <= list.size()) {
+                size_t end = std::min(list.find(',', begin), list.size());
+                Renderer::Aov aov;
+                if (!Renderer::findAov(list.substr(begin, end - begin).c_str(), aov)) {
+                    CGRA_LOGE("unknown aov %s", list.substr(begin, end - begin).c_str());
+                    return 2;
+                }
+                aovs |= aov;
+                begin = end + 1;
+            }
+        }
+        else if (strcmp(argv[i], "--out") == 0 && hasValue) {
+            out = argv[++i];
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0 && hasValue) {
+            checkpoint = argv[++i];
+        }
+        else if (strcmp(argv[i], "--checkpoint-interval") == 0 && hasValue) {
+            interval = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--resume") == 0) {
+            resume = true;
+        }
+        else {
+            fprintf(stderr, "usage: %s [--scene render|demo_cubemap] [--width w] [--height h] [--spp n] [--time seconds] [--noise threshold] "
+                "[--seed s] [--adaptive threshold] [--samples-per-launch n] [--denoise] [--aov name,...] [--out file.exr|file.pfm] [--checkpoint file] [--checkpoint-interval seconds] [--resume]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    // node time is billed from the start, so the time budget is too
+    RenderScheduler::Budget budget;
+    budget.samples = spp == 0 && seconds <= 0.0 && noise <= 0.0 ? 1024 : spp;
+    budget.seconds = seconds;
+    budget.noise = noise;
+    RenderScheduler scheduler(budget);
+
+    if (width <= 0 || height <= 0 || samplesPerLaunch <= 0 || spp < 0) {
+        CGRA_LOGE("--width, --height and --samples-per-launch must be positive, --spp not negative");
+        return 2;
+    }
+    if (resume && checkpoint.empty()) {
+        CGRA_LOGE("--resume needs --checkpoint");
+        return 2;
+    }
+    if (out.empty()) {
+        out = std::string(PROJECT_ROOT_DIR) + "output/" + Renderer::getSceneName(scene) + ".exr";
+    }
+
+    const std::string kernel = std::string(PROJECT_ROOT_DIR) + "src/OpenCL/test.cl";
+    const std::string skybox = std::string(PROJECT_ROOT_DIR) + "skybox/";
+    // the device and context first, the renderer's buffers and its background build share them
+    OpenclManager::getInstance();
+    Renderer renderer(kernel.c_str(), skybox.c_str(), width, height, aovs);
+    renderer.setScene(scene);
+    if (seeded) {
+        renderer.setSeed(seed);
+    }
+    renderer.setAdaptive((float)adaptive);
+    renderer.setDenoiser(denoise);
+
+    // a checkpoint that does not exist yet just means the first run of the job
+    if (resume && std::filesystem::exists(checkpoint) && !renderer.resume(checkpoint)) {
+        return 2;
+    }
+
+    if (!renderer.waitUntilReady()) {
+        CGRA_LOGE("%s", renderer.getBuildLog().c_str());
+        return 2;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    uint64_t lastCheckpoint = UTILITY::Clock::now();
+    while (!g_stop) {
+        int batch = scheduler.nextBatch(renderer.getSampleCount(), scheduler.needsNoise() ? renderer.estimateNoise() : 0.0);
+        if (batch == 0 || renderer.isConverged()) {
+            break;
+        }
+
+        uint64_t begin = UTILITY::Clock::now();
+        int rendered = 0;
+        while (rendered < batch && !g_stop && !renderer.isConverged()) {
+            const int count = std::min(samplesPerLaunch, batch - rendered);
+            renderer.step(count);
+            renderer.wait();
+            rendered += count;
+        }
+        scheduler.finishBatch(rendered, UTILITY::Clock::now() - begin);
+
+        if (!checkpoint.empty() && (UTILITY::Clock::now() - lastCheckpoint) * 1e-9 >= interval) {
+            if (renderer.saveCheckpoint(checkpoint)) {
+                lastCheckpoint = UTILITY::Clock::now();
+            }
+        }
+    }
+
+    if (!checkpoint.empty()) {
+        renderer.waitForCheckpoint();
+        if (!renderer.saveCheckpoint(checkpoint) || !renderer.waitForCheckpoint()) {
+            return 2;
+        }
+    }
+
+    if (g_stop) {
+        CGRA_LOGD("stopped at %d spp", renderer.getSampleCount());
+        return 3;
+    }
+
+    CGRA_LOGD("%d spp in %.2f s, stopped by the %s", renderer.getSampleCount(), scheduler.getElapsed(),
+        renderer.isConverged() ? "adaptive threshold" : RenderScheduler::getReasonName(scheduler.getReason()));
+
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(out).parent_path(), error);
+    bool written = ImageWriter::getInstance()->save(out, renderer.getImage()).get();
+    return written ? 0 : 2;
+}
@@ -4,6 +4,8 @@
 #include <iostream>
 #include <random>
 #include <algorithm>
+#include <chrono>
+#include <filesystem>
 
 // dear imgui: standalone example application for GLFW + OpenGL 3, using programmable pipeline
 // If you are new to dear imgui, see examples/README.txt and documentation at the top of imgui.cpp.
@@ -14,12 +16,15 @@
 #include "imgui_impl_opengl3.h"
 #include <stdio.h>
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
-
 #include "log.h"
+#include "binary_log.h"
+#include "image_writer.h"
 #include "opencl_manager.h"
-#include "opencl_task.h"
+#include "opencl_profiler.h"
+#include "render_scheduler.h"
+#include "renderer.h"
+#include "timer.h"
+#include "trace.h"
 
 // About Desktop OpenGL function loaders:
 //  Modern desktop OpenGL doesn't have a standard portable header file to load OpenGL function pointers.
@@ -53,201 +58,12 @@ using namespace gl;
 
 using namespace CGRA;
 
-const std::string cubemap_top_path = "/Users/liyiheng/VUW-CGRA/PA/RayTracing/skybox/top.jpg";
-const std::string cubemap_bottom_path = "/Users/liyiheng/VUW-CGRA/PA/RayTracing/skybox/bottom.jpg";
-const std::string cubemap_left_path = "/Users/liyiheng/VUW-CGRA/PA/RayTracing/skybox/left.jpg";
-const std::string cubemap_right_path = "/Users/liyiheng/VUW-CGRA/PA/RayTracing/skybox/right.jpg";
-const std::string cubemap_front_path = "/Users/liyiheng/VUW-CGRA/PA/RayTracing/skybox/front.jpg";
-const std::string cubemap_back_path = "/Users/liyiheng/VUW-CGRA/PA/RayTracing/skybox/back.jpg";
-const std::string cl_file_path = "/Users/liyiheng/VUW-CGRA/PA/RayTracing/src/OpenCL/test.cl";
+const std::string cl_file_path = std::string(PROJECT_ROOT_DIR) + "src/OpenCL/test.cl";
+const std::string skybox_path = std::string(PROJECT_ROOT_DIR) + "skybox/";
+const std::string output_path = std::string(PROJECT_ROOT_DIR) + "output/";
 const int image_width = 640;
 const int image_height = 480;
 
-
-class Renderer : public OpenclTask
-{
-public:
-    Renderer(const char* const fileAddress, int width, int height) : OpenclTask(fileAddress), _width(width), _height(height), times(0)
-    {
-        render_demo_A = false;
-
-        k_render = clCreateKernel(program, "render", NULL);
-        k_cubemap_demo = clCreateKernel(program, "demo_cubemap", NULL);
-        /**Step 8: Initial input,output for the host and create memory objects for the kernel*/
-
-        temp_color = (float*)malloc(3 * _width * _height * sizeof(float));
-        final_color = (float*)malloc(3 * _width * _height * sizeof(float));
-        random_number = (float*)malloc(3 * _width * _height * sizeof(float));
-
-        memset(temp_color, 0, 3 * _width * _height * sizeof(float));
-        memset(final_color, 0, 3 * _width * _height * sizeof(float));
-
-
-        std::mt19937 generator(us_ticker_read());
-        std::uniform_real_distribution<float> distribution(0.0, 1.0);
-
-        for (int i = 0; i < 3 * _width * _height; i++) {
-            random_number[i] = distribution(generator);
-        }
-
-        int cubemap_width, cubemap_height, nrChannels;
-        _cubemap_top = stbi_load(cubemap_top_path.c_str(), &cubemap_width, &cubemap_height, &nrChannels, 0);
-        _cubemap_bottom = stbi_load(cubemap_bottom_path.c_str(), &cubemap_width, &cubemap_height, &nrChannels, 0);
-        _cubemap_left = stbi_load(cubemap_left_path.c_str(), &cubemap_width, &cubemap_height, &nrChannels, 0);
-        _cubemap_right = stbi_load(cubemap_right_path.c_str(), &cubemap_width, &cubemap_height, &nrChannels, 0);
-        _cubemap_front = stbi_load(cubemap_front_path.c_str(), &cubemap_width, &cubemap_height, &nrChannels, 0);
-        _cubemap_back = stbi_load(cubemap_back_path.c_str(), &cubemap_width, &cubemap_height, &nrChannels, 0);
-
-        // CGRA_LOGD("%d %d %d", cubemap_width, cubemap_height, nrChannels);
-
-        _cl_mem_cubemap_top = clCreateBuffer(OpenclManager::getInstance()->getContent(), CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 3 * cubemap_width * cubemap_height * sizeof(uint8_t), (void*)_cubemap_top, NULL);
-        _cl_mem_cubemap_bottom = clCreateBuffer(OpenclManager::getInstance()->getContent(), CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 3 * cubemap_width * cubemap_height * sizeof(uint8_t), (void*)_cubemap_bottom, NULL);
-        _cl_mem_cubemap_left = clCreateBuffer(OpenclManager::getInstance()->getContent(), CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 3 * cubemap_width * cubemap_height * sizeof(uint8_t), (void*)_cubemap_left, NULL);
-        _cl_mem_cubemap_right = clCreateBuffer(OpenclManager::getInstance()->getContent(), CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 3 * cubemap_width * cubemap_height * sizeof(uint8_t), (void*)_cubemap_right, NULL);
-        _cl_mem_cubemap_front = clCreateBuffer(OpenclManager::getInstance()->getContent(), CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 3 * cubemap_width * cubemap_height * sizeof(uint8_t), (void*)_cubemap_front, NULL);
-        _cl_mem_cubemap_back = clCreateBuffer(OpenclManager::getInstance()->getContent(), CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 3 * cubemap_width * cubemap_height * sizeof(uint8_t), (void*)_cubemap_back, NULL);
-    }
-
-    void step()
-    {
-        std::mt19937 generator(us_ticker_read());
-        std::uniform_real_distribution<float> distribution(0.0, 1.0);
-
-        for (int i = 0; i < 3 * _width * _height; i++) {
-            random_number[i] = distribution(generator);
-        }
-
-        _cl_mem_random_number = clCreateBuffer(OpenclManager::getInstance()->getContent(), CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 3 * _width * _height * sizeof(float), (void*)random_number, NULL);
-        _cl_mem_image = clCreateBuffer(OpenclManager::getInstance()->getContent(), CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 3 * _width * _height * sizeof(float), (void*)temp_color, NULL);
-
-        if (render_demo_A) {
-            /**Step 9: Sets Kernel arguments.*/
-            clSetKernelArg(k_render, 0, sizeof(cl_mem), (void*)&_cl_mem_image);
-            clSetKernelArg(k_render, 1, sizeof(int), (void*)&_width);
-            clSetKernelArg(k_render, 2, sizeof(int), (void*)&_height);
-            clSetKernelArg(k_render, 3, sizeof(cl_mem), (void*)&_cl_mem_random_number);
-
-            /**Step 10: Running the kernel.*/
-            size_t global_work_size[1] = {static_cast<size_t>(_width * _height)};
-            _enentPoint = (cl_event*)malloc(1 * sizeof(cl_event));
-
-            clEnqueueNDRangeKernel(OpenclManager::getInstance()->getCommandQueue(), k_render, 1, NULL, global_work_size, NULL, 0, NULL, _enentPoint);
-        }
-        else {
-            /**Step 9: Sets Kernel arguments.*/
-            clSetKernelArg(k_cubemap_demo, 0, sizeof(cl_mem), (void*)&_cl_mem_image);
-            clSetKernelArg(k_cubemap_demo, 1, sizeof(int), (void*)&_width);
-            clSetKernelArg(k_cubemap_demo, 2, sizeof(int), (void*)&_height);
-            clSetKernelArg(k_cubemap_demo, 3, sizeof(cl_mem), (void*)&_cl_mem_random_number);
-            clSetKernelArg(k_cubemap_demo, 4, sizeof(cl_mem), (void*)&_cl_mem_cubemap_top);
-            clSetKernelArg(k_cubemap_demo, 5, sizeof(cl_mem), (void*)&_cl_mem_cubemap_bottom);
-            clSetKernelArg(k_cubemap_demo, 6, sizeof(cl_mem), (void*)&_cl_mem_cubemap_left);
-            clSetKernelArg(k_cubemap_demo, 7, sizeof(cl_mem), (void*)&_cl_mem_cubemap_right);
-            clSetKernelArg(k_cubemap_demo, 8, sizeof(cl_mem), (void*)&_cl_mem_cubemap_front);
-            clSetKernelArg(k_cubemap_demo, 9, sizeof(cl_mem), (void*)&_cl_mem_cubemap_back);
-
-            /**Step 10: Running the kernel.*/
-            size_t global_work_size[1] = {static_cast<size_t>(_width * _height)};
-            _enentPoint = (cl_event*)malloc(1 * sizeof(cl_event));
-
-            clEnqueueNDRangeKernel(OpenclManager::getInstance()->getCommandQueue(), k_cubemap_demo, 1, NULL, global_work_size, NULL, 0, NULL, _enentPoint);
-        }
-
-
-        clEnqueueWaitForEvents(OpenclManager::getInstance()->getCommandQueue(), 1, _enentPoint);
-    }
-
-    void wait()
-    {
-
-        memset(temp_color, 0, 3 * _width * _height * sizeof(float));
-
-        clWaitForEvents(1, _enentPoint);
-        clReleaseEvent(_enentPoint[0]);
-        free(_enentPoint);
-
-        // *Step 11: Read the cout put back to host memory.
-        clEnqueueReadBuffer(OpenclManager::getInstance()->getCommandQueue(), _cl_mem_image, CL_TRUE, 0, 3 * _width * _height * sizeof(float), temp_color, 0, NULL, NULL);
-
-        times++;
-
-        clReleaseMemObject(_cl_mem_random_number);
-        clReleaseMemObject(_cl_mem_image);
-    }
-
-    void change_render_scene()
-    {
-        times = 0;
-        memset(temp_color, 0, 3 * _width * _height * sizeof(float));
-        memset(final_color, 0, 3 * _width * _height * sizeof(float));
-        render_demo_A = !render_demo_A;
-    }
-
-    ~Renderer()
-    {
-        free(temp_color);
-        free(final_color);
-        free(random_number);
-
-        clReleaseKernel(k_render);
-        clReleaseKernel(k_cubemap_demo);
-
-
-
-        stbi_image_free(_cubemap_top);
-        stbi_image_free(_cubemap_bottom);
-        stbi_image_free(_cubemap_left);
-        stbi_image_free(_cubemap_right);
-        stbi_image_free(_cubemap_front);
-        stbi_image_free(_cubemap_back);
-
-        clReleaseMemObject(_cl_mem_cubemap_top);
-        clReleaseMemObject(_cl_mem_cubemap_bottom);
-        clReleaseMemObject(_cl_mem_cubemap_left);
-        clReleaseMemObject(_cl_mem_cubemap_right);
-        clReleaseMemObject(_cl_mem_cubemap_front);
-        clReleaseMemObject(_cl_mem_cubemap_back);
-    }
-
-    bool render_demo_A;
-
-    int _width;
-    int _height;
-
-    cl_kernel k_render;
-    float* temp_color;
-    cl_mem _cl_mem_image;
-
-    uint32_t _size;
-    cl_event* _enentPoint;
-
-    float* final_color;
-    int times;
-
-    float* random_number;
-    cl_mem _cl_mem_random_number;
-
-    // cubemap
-    uint8_t* _cubemap_top;
-    uint8_t* _cubemap_bottom;
-    uint8_t* _cubemap_left;
-    uint8_t* _cubemap_right;
-    uint8_t* _cubemap_front;
-    uint8_t* _cubemap_back;
-
-    cl_kernel k_cubemap_demo;
-
-    cl_mem _cl_mem_cubemap_top;
-    cl_mem _cl_mem_cubemap_bottom;
-    cl_mem _cl_mem_cubemap_left;
-    cl_mem _cl_mem_cubemap_right;
-    cl_mem _cl_mem_cubemap_front;
-    cl_mem _cl_mem_cubemap_back;
-
-};
-
-
-
 const char *vertexShaderSource = "#version 330 core\n"
                                  "layout (location = 0) in vec3 aPos;\n"
                                  "layout (location = 1) in vec2 aTexCoord;\n"
@@ -267,6 +83,61 @@ const char *fragmentShaderSource = "#version 330 core\n"
                                    "	FragColor = texture(texture1, TexCoord);\n"
                                    "}\n\0";
 
+static void draw_profiler_window()
+{
+    OpenclProfiler* profiler = OpenclProfiler::getInstance();
+    profiler->collect();
+
+    ImGui::Begin("OpenCL profiler");
+    ImGui::Columns(5, "stages");
+    ImGui::Text("stage"); ImGui::NextColumn();
+    ImGui::Text("count"); ImGui::NextColumn();
+    ImGui::Text("last ms"); ImGui::NextColumn();
+    ImGui::Text("avg ms"); ImGui::NextColumn();
+    ImGui::Text("avg wait ms"); ImGui::NextColumn();
+    ImGui::Separator();
+    for (const OpenclProfiler::Stage& stage : profiler->getStages()) {
+        ImGui::Text("%s", stage.name.c_str()); ImGui::NextColumn();
+        ImGui::Text("%lu", stage.count); ImGui::NextColumn();
+        ImGui::Text("%.3f", stage.lastExecute * 1e-6); ImGui::NextColumn();
+        ImGui::Text("%.3f", stage.totalExecute * 1e-6 / stage.count); ImGui::NextColumn();
+        ImGui::Text("%.3f", (stage.totalQueued + stage.totalSubmit) * 1e-6 / stage.count); ImGui::NextColumn();
+    }
+    ImGui::Columns(1);
+
+    if (ImGui::Button("reset")) {
+        profiler->reset();
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("dump json")) {
+        std::filesystem::create_directories(LOCAL_LOG_DIR);
+        profiler->dump((std::string(LOCAL_LOG_DIR) + "opencl_profile.json").c_str());
+    }
+
+    Tracer* tracer = Tracer::getInstance();
+    if (!tracer->isEnabled()) {
+        if (ImGui::Button("start trace")) {
+            tracer->start();
+        }
+    }
+    else if (ImGui::Button("stop trace")) {
+        tracer->stop();
+        std::filesystem::create_directories(LOCAL_LOG_DIR);
+        tracer->write((std::string(LOCAL_LOG_DIR) + "trace.json").c_str());
+    }
+
+    bool binary_log = UTILITY::BinaryLog::isEnabled();
+    if (ImGui::Checkbox("binary log", &binary_log)) {
+        if (binary_log) {
+            UTILITY::BinaryLog::start(LOCAL_LOG_DIR);
+        }
+        else {
+            UTILITY::BinaryLog::stop();
+        }
+    }
+    ImGui::End();
+}
+
 static void glfw_error_callback(int error, const char* description)
 {
     fprintf(stderr, "Glfw Error %d: %s\n", error, description);
@@ -274,7 +145,38 @@ static void glfw_error_callback(int error, const char* description)
 
 int main(int, char**)
 {
-
+    uint64_t start_time = UTILITY::Clock::now();
+    bool first_pixel = true;
+
+    // frame to frame and step + read back latency, the mean hides the stalls
+    UTILITY::Histogram frame_times;
+    UTILITY::Histogram render_times;
+    uint64_t last_frame = 0;
+
+    // the accumulation stops at whichever budget comes first, 0 means no limit
+    RenderScheduler::Budget budget;
+    RenderScheduler scheduler(budget);
+    // pixels below this relative standard error stop getting samples, 0 samples every pixel
+    float adaptive_threshold = 0.0f;
+    // traced per frame in one launch, more converges faster at the cost of frame rate
+    int samples_per_frame = 1;
+    bool denoise = false;
+    // W/A/S/D move, Q/E down and up, the arrow keys or dragging with the right mouse button look around
+    float move_speed = 1.0f;  // units per second
+    int preview_stride = 2;   // traced pixel grid while the camera moves
+    bool temporal = false;
+    // the first pass in 1/16, 1/4 and full resolution launches, for a quick first image
+    bool progressive = true;
+    // the instance the position control moves
+    int moved_instance = 0;
+    double last_cursor_x = 0.0;
+    double last_cursor_y = 0.0;
+
+    // start compiling the kernels and decoding the skybox before anything else, they overlap with the GL setup
+    OpenclManager::getInstance();
+    Renderer renderer_task(cl_file_path.c_str(), skybox_path.c_str(), image_width, image_height);
+    renderer_task.enableHotReload();
+    renderer_task.setProgressive(progressive);
 
     // Setup window
     glfwSetErrorCallback(glfw_error_callback);
@@ -404,72 +306,211 @@ int main(int, char**)
     uint8_t* _data = (uint8_t*)malloc(image_height * image_width * 3 * sizeof(uint8_t));
 
 
-    OpenclManager::getInstance();
-    Renderer renderer_task(cl_file_path.c_str(), image_width, image_height);
+    Tracer::getInstance()->setThreadName("main");
 
     // Main loop
     while (!glfwWindowShouldClose(window))
     {
+        CGRA_TRACE_SCOPE("frame");
+        uint64_t frame_begin = UTILITY::Clock::now();
+        // a stall must not turn into a jump
+        float frame_seconds = last_frame == 0 ? 0.0f : std::min((frame_begin - last_frame) * 1e-9f, 0.1f);
+        if (last_frame != 0) {
+            frame_times.record(frame_begin - last_frame);
+        }
+        last_frame = frame_begin;
         glfwPollEvents();
 
         // Start the Dear ImGui frame
-        ImGui_ImplOpenGL3_NewFrame();
-        ImGui_ImplGlfw_NewFrame();
-        ImGui::NewFrame();
+        {
+            CGRA_TRACE_SCOPE("ImGui");
+            ImGui_ImplOpenGL3_NewFrame();
+            ImGui_ImplGlfw_NewFrame();
+            ImGui::NewFrame();
+        }
 
         memset(_data, 0, image_height * image_width * 3 * sizeof(uint8_t));
 
         ImGui::Begin("Hello, world!");
         ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+        ImGui::Text("frame p50 %.3f p99 %.3f max %.3f ms", frame_times.percentile(50) * 1e-6, frame_times.percentile(99) * 1e-6, frame_times.getMax() * 1e-6);
+        ImGui::Text("render p50 %.3f p99 %.3f max %.3f ms", render_times.percentile(50) * 1e-6, render_times.percentile(99) * 1e-6, render_times.getMax() * 1e-6);
+        if (ImGui::Button("reset timings")) {
+            frame_times.reset();
+            render_times.reset();
+        }
         if (ImGui::Button("change scene")) {
-            renderer_task.change_render_scene();
+            renderer_task.changeScene();
+            moved_instance = 0;
+        }
+        // dragging an instance only rebuilds the top-level BVH, its object's tree stays as it is
+        const SceneDescription& description = renderer_task.getSceneDescription();
+        const int instance_count = (int)description.instances.size();
+        if (instance_count > 1) {
+            ImGui::SliderInt("instance", &moved_instance, 0, instance_count - 1);
+        }
+        moved_instance = std::clamp(moved_instance, 0, std::max(0, instance_count - 1));
+        if (instance_count > 0) {
+            SceneDescription::Transform transform = description.instances[moved_instance].transform;
+            float position[3] = {transform.m[0][3], transform.m[1][3], transform.m[2][3]};
+            if (ImGui::DragFloat3("instance position", position, 0.01f)) {
+                for (int k = 0; k < 3; k++) {
+                    transform.m[k][3] = position[k];
+                }
+                renderer_task.setInstanceTransform(moved_instance, transform);
+            }
+        }
+        // linear radiance, written on the image writer thread
+        bool save_exr = ImGui::Button("save exr");
+        ImGui::SameLine();
+        bool save_pfm = ImGui::Button("save pfm");
+        if ((save_exr || save_pfm) && renderer_task.getSampleCount() > 0) {
+            std::filesystem::create_directories(output_path);
+            std::string name = output_path + Renderer::getSceneName(renderer_task.getScene()) + "_" + std::to_string(renderer_task.getSampleCount()) + "spp";
+            ImageWriter::getInstance()->save(name + (save_exr ? ".exr" : ".pfm"), renderer_task.getImage());
+        }
+        bool budget_changed = ImGui::InputInt("stop at spp", &budget.samples);
+        budget_changed |= ImGui::InputDouble("stop after s", &budget.seconds, 0.0, 0.0, "%.1f");
+        budget_changed |= ImGui::InputDouble("stop at noise", &budget.noise, 0.0, 0.0, "%.4f");
+        ImGui::Text("%d spp, %s", renderer_task.getSampleCount(), RenderScheduler::getReasonName(scheduler.getReason()));
+        ImGui::SliderInt("samples per frame", &samples_per_frame, 1, 16);
+        if (ImGui::Checkbox("denoise", &denoise)) {
+            renderer_task.setDenoiser(denoise);
+        }
+        // extra passes in the saved .exr, device ones cost a kernel rebuild and a restart
+        unsigned aovs = renderer_task.getAovs();
+        for (unsigned aov = Renderer::AOV_DEPTH; aov <= Renderer::AOV_VARIANCE; aov <<= 1) {
+            bool enabled = (aovs & aov) != 0;
+            if (ImGui::Checkbox(Renderer::getAovName((Renderer::Aov)aov), &enabled)) {
+                renderer_task.setAovs(enabled ? aovs | aov : aovs & ~aov);
+            }
+        }
+        if (ImGui::InputFloat("adaptive threshold", &adaptive_threshold, 0.0f, 0.0f, "%.4f")) {
+            renderer_task.setAdaptive(adaptive_threshold);
+        }
+        ImGui::Text("%d of %d pixels active%s", renderer_task.getActivePixels(), image_width * image_height, renderer_task.isConverged() ? ", converged" : "");
+        Renderer::Camera camera = renderer_task.getCamera();
+        ImGui::SliderFloat("fov", &camera.fov, 10.0f, 120.0f);
+        ImGui::InputFloat("aperture", &camera.aperture, 0.0f, 0.0f, "%.3f");
+        ImGui::InputFloat("focus distance", &camera.focusDistance, 0.0f, 0.0f, "%.2f");
+        ImGui::SliderFloat("move speed", &move_speed, 0.1f, 10.0f);
+        ImGui::SliderInt("preview stride", &preview_stride, 1, 8);
+        if (ImGui::Checkbox("temporal", &temporal)) {
+            renderer_task.setTemporal(temporal);
+        }
+        if (ImGui::Checkbox("progressive", &progressive)) {
+            renderer_task.setProgressive(progressive);
+        }
+        // Morton-order object BVHs build faster but trace slower
+        bool lbvh = renderer_task.getBvhBuilder() == Bvh::BUILD_LBVH;
+        if (ImGui::Checkbox("fast BVH build", &lbvh)) {
+            renderer_task.setBvhBuilder(lbvh ? Bvh::BUILD_LBVH : Bvh::BUILD_SAH);
         }
         ImGui::End();
 
-        // std::mt19937 generator(us_ticker_read());
-        renderer_task.step();
-        renderer_task.wait();
-
-        for (int row = 0; row < image_height; row++) {
-            for (int col = 0; col < image_width; col++) {
+        // navigation goes in before this frame's step, so a key press shows in the frame it happens
+        auto pressed = [&](int key) { return !io.WantCaptureKeyboard && glfwGetKey(window, key) == GLFW_PRESS; };
+        float forward[3], right[3];
+        Renderer::getCameraAxes(camera, forward, right);
+        const float distance = move_speed * frame_seconds;
+        const float move_forward = distance * ((pressed(GLFW_KEY_W) ? 1 : 0) - (pressed(GLFW_KEY_S) ? 1 : 0));
+        const float move_right = distance * ((pressed(GLFW_KEY_D) ? 1 : 0) - (pressed(GLFW_KEY_A) ? 1 : 0));
+        for (int k = 0; k < 3; k++) {
+            camera.position[k] += move_forward * forward[k] + move_right * right[k];
+        }
+        camera.position[1] += distance * ((pressed(GLFW_KEY_E) ? 1 : 0) - (pressed(GLFW_KEY_Q) ? 1 : 0));
+
+        const float turn = 1.5f * frame_seconds;
+        camera.yaw += turn * ((pressed(GLFW_KEY_RIGHT) ? 1 : 0) - (pressed(GLFW_KEY_LEFT) ? 1 : 0));
+        camera.pitch += turn * ((pressed(GLFW_KEY_UP) ? 1 : 0) - (pressed(GLFW_KEY_DOWN) ? 1 : 0));
+        double cursor_x, cursor_y;
+        glfwGetCursorPos(window, &cursor_x, &cursor_y);
+        if (!io.WantCaptureMouse && glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS) {
+            camera.yaw += 0.005f * (float)(cursor_x - last_cursor_x);
+            camera.pitch -= 0.005f * (float)(cursor_y - last_cursor_y);
+        }
+        last_cursor_x = cursor_x;
+        last_cursor_y = cursor_y;
+        camera.pitch = std::clamp(camera.pitch, -1.55f, 1.55f);
+
+        // while moving every frame restarts, so it traces a sparse grid once and shows that
+        const bool moving = memcmp(&camera, &renderer_task.getCamera(), sizeof(camera)) != 0;
+        renderer_task.setCamera(camera);
+        renderer_task.setPreview(moving ? preview_stride : 1);
+
+        // pick up kernels rebuilt after an edit of the .cl file, the old samples no longer match
+        if (renderer_task.update()) {
+            renderer_task.resetAccumulation();
+        }
 
+        draw_profiler_window();
 
-                renderer_task.final_color[(row * image_width + col)*3 + 0] += renderer_task.temp_color[(row * image_width + col)*3 + 0];
-                renderer_task.final_color[(row * image_width + col)*3 + 1] += renderer_task.temp_color[(row * image_width + col)*3 + 1];
-                renderer_task.final_color[(row * image_width + col)*3 + 2] += renderer_task.temp_color[(row * image_width + col)*3 + 2];
+        std::string build_log = renderer_task.getBuildLog();
+        if (!build_log.empty()) {
+            ImGui::Begin("OpenCL build log");
+            ImGui::TextUnformatted(build_log.c_str());
+            ImGui::End();
+        }
 
-                float r = sqrt(renderer_task.final_color[(row * image_width + col)*3 + 0] / renderer_task.times);
-                float g = sqrt(renderer_task.final_color[(row * image_width + col)*3 + 1] / renderer_task.times);
-                float b = sqrt(renderer_task.final_color[(row * image_width + col)*3 + 2] / renderer_task.times);
+        if (!renderer_task.isReady()) {
+            ImGui::Begin("Hello, world!");
+            ImGui::Text("Loading skybox and building kernels...");
+            ImGui::End();
+        }
+        else {
+            // a fresh accumulation starts a fresh budget
+            if (budget_changed || renderer_task.getSampleCount() == 0) {
+                scheduler = RenderScheduler(budget);
+            }
 
-                r = std::clamp(r, 0.0f, 1.0f);
-                g = std::clamp(g, 0.0f, 1.0f);
-                b = std::clamp(b, 0.0f, 1.0f);
+            // one launch per frame keeps the viewer responsive, the scheduler only decides when to stop
+            int batch = renderer_task.isConverged() ? 0 : scheduler.nextBatch(renderer_task.getSampleCount(), scheduler.needsNoise() ? renderer_task.estimateNoise() : 0.0);
+            if (batch > 0) {
+                UTILITY::ScopedTimer timer(&render_times);
+                uint64_t begin = UTILITY::Clock::now();
+                int count = moving ? 1 : std::min(samples_per_frame, batch);
+                int before = renderer_task.getSampleCount();
+                renderer_task.step(count);
+                renderer_task.wait();
+                // the coarse progressive levels add no whole pass, and would make samples look cheap
+                scheduler.finishBatch(renderer_task.getSampleCount() - before, UTILITY::Clock::now() - begin);
+            }
 
-                _data[(row * image_width + col)*3 + 0] = r * 255;
-                _data[(row * image_width + col)*3 + 1] = g * 255;
-                _data[(row * image_width + col)*3 + 2] = b * 255;
+            if (first_pixel) {
+                first_pixel = false;
+                CGRA_LOGD("time to first pixel %.1f ms", (UTILITY::Clock::now() - start_time) * 1e-6);
             }
+
+            CGRA_BINLOG("frame spp %d scene %d framerate %.2f", renderer_task.getSampleCount(), (int)renderer_task.getScene(), ImGui::GetIO().Framerate);
+
+            CGRA_TRACE_SCOPE("resolve");
+            renderer_task.resolve(_data);
         }
 
         unsigned int texture;
-        glGenTextures(1, &texture);
-        glBindTexture(GL_TEXTURE_2D, texture);
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);	// set texture wrapping to GL_REPEAT (default wrapping method)
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        // load image, create texture and generate mipmaps
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image_width, image_height, 0, GL_RGB, GL_UNSIGNED_BYTE, _data);
-        glGenerateMipmap(GL_TEXTURE_2D);
+        {
+            CGRA_TRACE_SCOPE("texture upload");
+            glGenTextures(1, &texture);
+            glBindTexture(GL_TEXTURE_2D, texture);
+            // set the texture wrapping parameters
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);	// set texture wrapping to GL_REPEAT (default wrapping method)
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            // set texture filtering parameters
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            // load image, create texture and generate mipmaps
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image_width, image_height, 0, GL_RGB, GL_UNSIGNED_BYTE, _data);
+            glGenerateMipmap(GL_TEXTURE_2D);
+        }
 
         // if (show_demo_window)
         //     ImGui::ShowDemoWindow(&show_demo_window);
 
         // Rendering
-        ImGui::Render();
+        {
+            CGRA_TRACE_SCOPE("ImGui");
+            ImGui::Render();
+        }
         int display_w, display_h;
         glfwGetFramebufferSize(window, &display_w, &display_h);
         glViewport(0, 0, display_w, display_h);
@@ -486,14 +527,21 @@ int main(int, char**)
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 
 
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        {
+            CGRA_TRACE_SCOPE("ImGui");
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        }
 
-        glfwSwapBuffers(window);
+        {
+            CGRA_TRACE_SCOPE("swap buffers");
+            glfwSwapBuffers(window);
+        }
 
         glDeleteTextures(1, &texture);
     }
 
     // Cleanup
+    ImageWriter::getInstance()->finish();
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
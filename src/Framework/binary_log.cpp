@@ -0,0 +1,559 @@
+#include "binary_log.h"
+
+#include "ring_buffer.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <vector>
+
+namespace UTILITY {
+
+std::atomic<bool> BinaryLog::g_enabled(false);
+
+static const char kMagic[8] = {'C', 'G', 'R', 'A', 'B', 'L', 'G', '1'};
+
+static const size_t kEventRingSize = 4096;
+
+struct BinaryEvent {
+	uint32_t id;
+	uint64_t time;
+	BinaryLog::Payload payload;
+};
+
+struct BinaryThreadLog {
+	RingBuffer<BinaryEvent, kEventRingSize> events;
+	uint32_t tid;
+	std::atomic<uint32_t> dropped;
+	std::atomic<bool> retired;
+};
+
+struct BinaryThreadLogHolder {
+	BinaryThreadLog* log = nullptr;
+
+	~BinaryThreadLogHolder() {
+		if (log != nullptr) {
+			log->retired.store(true, std::memory_order_release);
+		}
+	}
+};
+
+static thread_local BinaryThreadLogHolder t_binary_log;
+
+struct BinaryFormat {
+	std::string format;
+	std::string file;
+	uint32_t line;
+};
+
+/**Format registry, per-thread rings and the writer thread, never destroyed.*/
+class BinaryLogWriter
+{
+public:
+	static BinaryLogWriter* getInstance() {
+		static BinaryLogWriter* instance = new BinaryLogWriter();
+		return instance;
+	}
+
+	int registerFormat(const char* format, const char* file, int line);
+
+	BinaryThreadLog* getThreadLog();
+
+	bool start(const char* const directory, size_t maxFileBytes, int maxFiles);
+
+	void stop();
+
+private:
+	BinaryLogWriter();
+
+	bool openFile();
+
+	void writeFormats(size_t from);
+
+	void drain();
+
+	void loop();
+
+	std::mutex formatsMutex;
+	std::vector<BinaryFormat> formats;
+
+	std::mutex threadsMutex;
+	std::vector<BinaryThreadLog*> threads;
+
+	std::mutex fileMutex;
+	std::string directory;
+	size_t maxFileBytes;
+	int maxFiles;
+	int fileIndex;
+	FILE* file;
+	size_t fileBytes;
+	size_t formatsWritten;
+
+	std::atomic<bool> running;
+	std::thread thread;
+};
+
+static void stopBinaryLog()
+{
+	BinaryLog::stop();
+}
+
+BinaryLogWriter::BinaryLogWriter()
+	: formatsMutex()
+	, formats()
+	, threadsMutex()
+	, threads()
+	, fileMutex()
+	, directory()
+	, maxFileBytes(0)
+	, maxFiles(0)
+	, fileIndex(0)
+	, file(nullptr)
+	, fileBytes(0)
+	, formatsWritten(0)
+	, running(false)
+	, thread()
+{
+	atexit(stopBinaryLog);
+}
+
+int BinaryLogWriter::registerFormat(const char* format, const char* file, int line)
+{
+	std::lock_guard<std::mutex> lock(formatsMutex);
+	formats.push_back(BinaryFormat{format, file, (uint32_t)line});
+	return (int)formats.size() - 1;
+}
+
+BinaryThreadLog* BinaryLogWriter::getThreadLog()
+{
+	if (t_binary_log.log == nullptr) {
+		BinaryThreadLog* log = new BinaryThreadLog();
+		log->tid = (uint32_t)gettid();
+		log->dropped = 0;
+		log->retired = false;
+
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		threads.push_back(log);
+		t_binary_log.log = log;
+	}
+	return t_binary_log.log;
+}
+
+static void put(FILE* file, size_t& bytes, const void* data, size_t size)
+{
+	fwrite(data, 1, size, file);
+	bytes += size;
+}
+
+static void putString(FILE* file, size_t& bytes, const std::string& value)
+{
+	uint16_t length = (uint16_t)std::min<size_t>(value.size(), 0xFFFF);
+	put(file, bytes, &length, sizeof(length));
+	put(file, bytes, value.data(), length);
+}
+
+bool BinaryLogWriter::openFile()
+{
+	if (file != nullptr) {
+		fclose(file);
+		file = nullptr;
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "binlog_%d_%d.bin", (int)getpid(), fileIndex);
+	std::string path = directory + name;
+
+	if (fileIndex >= maxFiles) {
+		snprintf(name, sizeof(name), "binlog_%d_%d.bin", (int)getpid(), fileIndex - maxFiles);
+		std::remove((directory + name).c_str());
+	}
+	fileIndex++;
+
+	file = fopen(path.c_str(), "wb");
+	if (file == nullptr) {
+		CGRA_LOGE("cannot open %s", path.c_str());
+		return false;
+	}
+	setvbuf(file, nullptr, _IOFBF, 1 << 20);
+
+	const uint64_t wallEpoch = Clock::epochWallTime();
+
+	fileBytes = 0;
+	put(file, fileBytes, kMagic, sizeof(kMagic));
+	put(file, fileBytes, &wallEpoch, sizeof(wallEpoch));
+
+	// every file carries the whole dictionary
+	formatsWritten = 0;
+	writeFormats(0);
+	return true;
+}
+
+void BinaryLogWriter::writeFormats(size_t from)
+{
+	std::lock_guard<std::mutex> lock(formatsMutex);
+	for (size_t i = from; i < formats.size(); i++) {
+		const char type = 'F';
+		const uint32_t id = (uint32_t)i;
+		put(file, fileBytes, &type, 1);
+		put(file, fileBytes, &id, sizeof(id));
+		put(file, fileBytes, &formats[i].line, sizeof(formats[i].line));
+		putString(file, fileBytes, formats[i].file);
+		putString(file, fileBytes, formats[i].format);
+	}
+	formatsWritten = formats.size();
+}
+
+void BinaryLogWriter::drain()
+{
+	std::lock_guard<std::mutex> fileLock(fileMutex);
+	if (file == nullptr) {
+		return;
+	}
+
+	writeFormats(formatsWritten);
+
+	std::vector<BinaryThreadLog*> snapshot;
+	{
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		snapshot = threads;
+	}
+
+	std::vector<BinaryThreadLog*> finished;
+	for (BinaryThreadLog* log : snapshot) {
+		bool retired = log->retired.load(std::memory_order_acquire);
+
+		while (BinaryEvent* event = log->events.front()) {
+			// a format registered after the writeFormats() above, and already used, goes out before its first event
+			if (event->id >= formatsWritten) {
+				writeFormats(formatsWritten);
+			}
+			const char type = 'E';
+			put(file, fileBytes, &type, 1);
+			put(file, fileBytes, &event->id, sizeof(event->id));
+			put(file, fileBytes, &event->time, sizeof(event->time));
+			put(file, fileBytes, &log->tid, sizeof(log->tid));
+			put(file, fileBytes, &event->payload.size, sizeof(event->payload.size));
+			put(file, fileBytes, event->payload.data, event->payload.size);
+			log->events.pop();
+		}
+
+		uint32_t dropped = log->dropped.exchange(0);
+		if (dropped > 0) {
+			const char type = 'D';
+			put(file, fileBytes, &type, 1);
+			put(file, fileBytes, &log->tid, sizeof(log->tid));
+			put(file, fileBytes, &dropped, sizeof(dropped));
+		}
+
+		if (retired) {
+			finished.push_back(log);
+		}
+	}
+
+	if (!finished.empty()) {
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		for (BinaryThreadLog* log : finished) {
+			threads.erase(std::remove(threads.begin(), threads.end(), log), threads.end());
+			delete log;
+		}
+	}
+
+	if (fileBytes >= maxFileBytes) {
+		openFile();
+	}
+}
+
+void BinaryLogWriter::loop()
+{
+	while (running.load(std::memory_order_acquire)) {
+		drain();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+bool BinaryLogWriter::start(const char* const directory, size_t maxFileBytes, int maxFiles)
+{
+	stop();
+
+	{
+		std::lock_guard<std::mutex> lock(fileMutex);
+		this->directory = directory;
+		if (!this->directory.empty() && this->directory.back() != '/') {
+			this->directory += '/';
+		}
+		this->maxFileBytes = maxFileBytes;
+		this->maxFiles = maxFiles < 1 ? 1 : maxFiles;
+		this->fileIndex = 0;
+
+		std::error_code error;
+		std::filesystem::create_directories(this->directory, error);
+		if (!openFile()) {
+			return false;
+		}
+	}
+
+	running = true;
+	thread = std::thread(&BinaryLogWriter::loop, this);
+	return true;
+}
+
+void BinaryLogWriter::stop()
+{
+	if (running.exchange(false)) {
+		thread.join();
+	}
+	drain();
+
+	std::lock_guard<std::mutex> lock(fileMutex);
+	if (file != nullptr) {
+		fclose(file);
+		file = nullptr;
+	}
+}
+
+bool BinaryLog::start(const char* const directory, size_t maxFileBytes, int maxFiles)
+{
+	g_enabled = BinaryLogWriter::getInstance()->start(directory, maxFileBytes, maxFiles);
+	return g_enabled;
+}
+
+void BinaryLog::stop()
+{
+	g_enabled = false;
+	BinaryLogWriter::getInstance()->stop();
+}
+
+int BinaryLog::registerFormat(const char* format, const char* file, int line)
+{
+	return BinaryLogWriter::getInstance()->registerFormat(format, file, line);
+}
+
+void BinaryLog::write(int id, const Payload& payload)
+{
+	BinaryThreadLog* log = BinaryLogWriter::getInstance()->getThreadLog();
+
+	BinaryEvent* event = log->events.claim();
+	if (event == nullptr) {
+		log->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	event->id = (uint32_t)id;
+	event->time = Clock::now();
+	event->payload.size = payload.size;
+	memcpy(event->payload.data, payload.data, payload.size);
+	log->events.commit();
+}
+
+/**Decoding.*/
+
+struct DecodedArgument {
+	char tag;
+	int64_t i;
+	uint64_t u;
+	double d;
+	std::string s;
+};
+
+static bool get(FILE* file, void* data, size_t size)
+{
+	return fread(data, 1, size, file) == size;
+}
+
+static bool getString(FILE* file, std::string& value)
+{
+	uint16_t length = 0;
+	if (!get(file, &length, sizeof(length))) {
+		return false;
+	}
+	value.resize(length);
+	return length == 0 || get(file, &value[0], length);
+}
+
+/**The arguments up to the first one the payload cuts short, whose conversions then print as missing.*/
+static std::vector<DecodedArgument> decodeArguments(const unsigned char* data, size_t size)
+{
+	std::vector<DecodedArgument> args;
+	size_t offset = 0;
+	while (offset < size) {
+		DecodedArgument arg = {(char)data[offset++], 0, 0, 0.0, std::string()};
+		if (arg.tag == 's') {
+			uint16_t length = 0;
+			if (offset + sizeof(length) > size) {
+				break;
+			}
+			memcpy(&length, data + offset, sizeof(length));
+			if (offset + sizeof(length) + length > size) {
+				break;
+			}
+			arg.s.assign((const char*)data + offset + 2, length);
+			offset += 2 + length;
+		}
+		else {
+			if (offset + 8 > size) {
+				break;
+			}
+			memcpy(&arg.u, data + offset, 8);
+			memcpy(&arg.i, data + offset, 8);
+			memcpy(&arg.d, data + offset, 8);
+			offset += 8;
+		}
+		args.push_back(arg);
+	}
+	return args;
+}
+
+/**Re-applies each conversion of format to the recorded arguments, widening the length modifiers to match.*/
+static std::string formatArguments(const std::string& format, const std::vector<DecodedArgument>& args)
+{
+	std::string out;
+	size_t next = 0;
+	char buffer[512];
+
+	for (size_t i = 0; i < format.size(); i++) {
+		if (format[i] != '%') {
+			out += format[i];
+			continue;
+		}
+		if (i + 1 < format.size() && format[i + 1] == '%') {
+			out += '%';
+			i++;
+			continue;
+		}
+
+		std::string spec = "%";
+		size_t j = i + 1;
+		while (j < format.size() && strchr("-+ #0'", format[j]) != nullptr) {
+			spec += format[j++];
+		}
+		while (j < format.size() && (isdigit((unsigned char)format[j]) || format[j] == '.')) {
+			spec += format[j++];
+		}
+		while (j < format.size() && strchr("hlLqjzt", format[j]) != nullptr) {
+			j++;
+		}
+		if (j >= format.size()) {
+			out += format.substr(i);
+			break;
+		}
+
+		const char conversion = format[j];
+		i = j;
+
+		if (next >= args.size()) {
+			out += "<missing>";
+			continue;
+		}
+		const DecodedArgument& arg = args[next++];
+
+		if (strchr("diouxXc", conversion) != nullptr) {
+			if (conversion == 'c') {
+				snprintf(buffer, sizeof(buffer), (spec + "c").c_str(), (int)arg.i);
+			}
+			else if (arg.tag == 'd') {
+				snprintf(buffer, sizeof(buffer), (spec + "ll" + conversion).c_str(), (long long)arg.d);
+			}
+			else {
+				snprintf(buffer, sizeof(buffer), (spec + "ll" + conversion).c_str(), arg.tag == 'i' ? (long long)arg.i : (long long)arg.u);
+			}
+		}
+		else if (strchr("fFeEgGaA", conversion) != nullptr) {
+			double value = arg.tag == 'd' ? arg.d : (arg.tag == 'i' ? (double)arg.i : (double)arg.u);
+			snprintf(buffer, sizeof(buffer), (spec + conversion).c_str(), value);
+		}
+		else if (conversion == 's') {
+			snprintf(buffer, sizeof(buffer), (spec + "s").c_str(), arg.tag == 's' ? arg.s.c_str() : "<?>");
+		}
+		else if (conversion == 'p') {
+			snprintf(buffer, sizeof(buffer), "%p", (void*)(uintptr_t)arg.u);
+		}
+		else {
+			snprintf(buffer, sizeof(buffer), "<%%%c?>", conversion);
+		}
+		out += buffer;
+	}
+	return out;
+}
+
+bool BinaryLog::decode(const char* const path, FILE* out)
+{
+	FILE* file = fopen(path, "rb");
+	if (file == nullptr) {
+		CGRA_LOGE("cannot open %s", path);
+		return false;
+	}
+
+	char magic[8];
+	uint64_t wallEpoch = 0;
+	if (!get(file, magic, sizeof(magic)) || memcmp(magic, kMagic, sizeof(kMagic)) != 0 || !get(file, &wallEpoch, sizeof(wallEpoch))) {
+		CGRA_LOGE("%s is not a binary log", path);
+		fclose(file);
+		return false;
+	}
+
+	std::vector<BinaryFormat> dictionary;
+	char type = 0;
+	while (get(file, &type, 1)) {
+		if (type == 'F') {
+			uint32_t id = 0;
+			BinaryFormat format;
+			if (!get(file, &id, sizeof(id)) || !get(file, &format.line, sizeof(format.line)) || !getString(file, format.file) || !getString(file, format.format)) {
+				break;
+			}
+			if (dictionary.size() <= id) {
+				dictionary.resize(id + 1);
+			}
+			dictionary[id] = format;
+		}
+		else if (type == 'E') {
+			uint32_t id = 0, tid = 0;
+			uint64_t time = 0;
+			uint16_t size = 0;
+			unsigned char data[kMaxPayload];
+			if (!get(file, &id, sizeof(id)) || !get(file, &time, sizeof(time)) || !get(file, &tid, sizeof(tid)) || !get(file, &size, sizeof(size))
+				|| size > kMaxPayload || !get(file, data, size)) {
+				break;
+			}
+
+			const uint64_t wall = wallEpoch + time;
+			const time_t seconds = (time_t)(wall / 1000000000ull);
+			struct tm local;
+#ifdef _WIN32
+			localtime_s(&local, &seconds);
+#else
+			localtime_r(&seconds, &local);
+#endif
+			char stamp[32];
+			strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+
+			if (id >= dictionary.size()) {
+				fprintf(out, "%s.%06llu <%u> unknown format %u\n", stamp, (unsigned long long)(wall % 1000000000ull) / 1000, tid, id);
+				continue;
+			}
+
+			const BinaryFormat& format = dictionary[id];
+			fprintf(out, "%s.%06llu <%u> %s[%u] %s\n", stamp, (unsigned long long)(wall % 1000000000ull) / 1000, tid,
+				format.file.c_str(), format.line, formatArguments(format.format, decodeArguments(data, size)).c_str());
+		}
+		else if (type == 'D') {
+			uint32_t tid = 0, dropped = 0;
+			if (!get(file, &tid, sizeof(tid)) || !get(file, &dropped, sizeof(dropped))) {
+				break;
+			}
+			fprintf(out, "<%u> %u events dropped\n", tid, dropped);
+		}
+		else {
+			CGRA_LOGE("%s: unknown record type %d", path, type);
+			break;
+		}
+	}
+
+	fclose(file);
+	return true;
+}
+
+} // namespace UTILITY
@@ -0,0 +1,113 @@
+#include "file_watcher.h"
+
+#include "log.h"
+
+#include <chrono>
+
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace CGRA {
+
+/**Editors often save in several writes, wait this long for them to settle.*/
+static const int kSettleTimeMs = 50;
+
+static const int kPollIntervalMs = 200;
+
+FileWatcher::FileWatcher(const char* const path, std::function<void()> onChange)
+	: path(path)
+	, onChange(onChange)
+	, running(true)
+	, thread()
+{
+	thread = std::thread(&FileWatcher::loop, this);
+}
+
+FileWatcher::~FileWatcher()
+{
+	running = false;
+	if (thread.joinable()) {
+		thread.join();
+	}
+}
+
+#if defined(__linux__)
+
+void FileWatcher::loop()
+{
+	std::string directory = ".";
+	std::string fileName = path;
+	size_t slash = path.find_last_of('/');
+	if (slash != std::string::npos) {
+		directory = path.substr(0, slash == 0 ? 1 : slash);
+		fileName = path.substr(slash + 1);
+	}
+
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		CGRA_LOGE("inotify_init1 failed");
+		return;
+	}
+
+	if (inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+		CGRA_LOGE("cannot watch %s", directory.c_str());
+		close(fd);
+		return;
+	}
+
+	CGRA_LOGD("watching %s", path.c_str());
+
+	alignas(struct inotify_event) char buffer[4096];
+	bool pending = false;
+
+	while (running) {
+		struct pollfd pfd = {fd, POLLIN, 0};
+		int ready = poll(&pfd, 1, pending ? kSettleTimeMs : kPollIntervalMs);
+
+		if (ready > 0) {
+			ssize_t length = 0;
+			while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+				for (char* ptr = buffer; ptr < buffer + length; ) {
+					const struct inotify_event* event = (const struct inotify_event*)ptr;
+					if (event->len > 0 && fileName == event->name) {
+						pending = true;
+					}
+					ptr += sizeof(struct inotify_event) + event->len;
+				}
+			}
+		}
+		else if (ready == 0 && pending) {
+			pending = false;
+			onChange();
+		}
+	}
+
+	close(fd);
+}
+
+#else
+
+void FileWatcher::loop()
+{
+	struct stat info;
+	time_t lastModified = stat(path.c_str(), &info) == 0 ? info.st_mtime : 0;
+
+	while (running) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(kPollIntervalMs));
+
+		if (stat(path.c_str(), &info) == 0 && info.st_mtime != lastModified) {
+			lastModified = info.st_mtime;
+			std::this_thread::sleep_for(std::chrono::milliseconds(kSettleTimeMs));
+			onChange();
+		}
+	}
+}
+
+#endif
+
+} // namespace CGRA
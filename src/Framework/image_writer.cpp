@@ -0,0 +1,330 @@
+#include "image_writer.h"
+
+#include "log.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+
+namespace CGRA {
+
+void Image::addChannels(const std::vector<std::string>& names, const float* data)
+{
+	const size_t stride = names.size();
+	const size_t pixels = (size_t)width * height;
+	for (size_t c = 0; c < stride; c++) {
+		std::vector<float> plane(pixels);
+		for (size_t i = 0; i < pixels; i++) {
+			plane[i] = data[i * stride + c];
+		}
+		channels.push_back(names[c]);
+		planes.push_back(std::move(plane));
+	}
+}
+
+const float* Image::getChannel(const std::string& name) const
+{
+	for (size_t c = 0; c < channels.size(); c++) {
+		if (channels[c] == name) {
+			return planes[c].data();
+		}
+	}
+	return nullptr;
+}
+
+ImageWriter* ImageWriter::_instance = nullptr;
+
+ImageWriter* ImageWriter::getInstance()
+{
+	static std::once_flag created;
+	std::call_once(created, []() { _instance = new ImageWriter(); });
+	return _instance;
+}
+
+ImageWriter::ImageWriter()
+	: mutex()
+	, wakeup()
+	, idle()
+	, jobs()
+	, busy(false)
+	, thread()
+{
+	thread = std::thread([this]() { loop(); });
+}
+
+ImageWriter::~ImageWriter()
+{
+	finish();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back(std::function<void()>());
+	}
+	wakeup.notify_one();
+	thread.join();
+}
+
+void ImageWriter::loop()
+{
+	Tracer::getInstance()->setThreadName("image writer");
+
+	while (true) {
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wakeup.wait(lock, [this]() { return !jobs.empty(); });
+			job = std::move(jobs.front());
+			jobs.pop_front();
+			if (!job) {
+				// empty job, shutting down
+				return;
+			}
+			busy = true;
+		}
+
+		job();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			busy = false;
+		}
+		idle.notify_all();
+	}
+}
+
+std::future<bool> ImageWriter::save(const std::string& path, Image image, PixelType type)
+{
+	// std::function must be copyable, the task and its image are not
+	auto task = std::make_shared<std::packaged_task<bool()> >([path, image = std::move(image), type]() {
+		CGRA_TRACE_SCOPE("write image");
+		const std::string extension = path.size() >= 4 ? path.substr(path.size() - 4) : "";
+		bool written = false;
+		if (extension == ".exr") {
+			written = writeExr(path, image, type);
+		}
+		else if (extension == ".pfm") {
+			written = writePfm(path, image);
+		}
+		else {
+			CGRA_LOGE("unknown image format %s", path.c_str());
+			return false;
+		}
+
+		if (written) {
+			CGRA_LOGD("wrote %s", path.c_str());
+		}
+		return written;
+	});
+
+	std::future<bool> result = task->get_future();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back([task]() { (*task)(); });
+	}
+	wakeup.notify_one();
+	return result;
+}
+
+void ImageWriter::finish()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	idle.wait(lock, [this]() { return jobs.empty() && !busy; });
+}
+
+uint16_t ImageWriter::toHalf(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	const uint32_t sign = (bits >> 16) & 0x8000;
+	const uint32_t floatExponent = (bits >> 23) & 0xff;
+	uint32_t mantissa = bits & 0x7fffff;
+
+	if (floatExponent == 0xff) {
+		// inf stays inf, nan stays a quiet nan
+		return (uint16_t)(sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0));
+	}
+
+	const int exponent = (int)floatExponent - 127 + 15;
+	if (exponent >= 31) {
+		return (uint16_t)(sign | 0x7c00);
+	}
+
+	if (exponent <= 0) {
+		if (exponent < -10) {
+			return (uint16_t)sign;
+		}
+		// subnormal half, round to nearest even
+		mantissa |= 0x800000;
+		const uint32_t shift = 14 - exponent;
+		uint32_t half = mantissa >> shift;
+		const uint32_t rest = mantissa & ((1u << shift) - 1);
+		const uint32_t halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1))) {
+			half++;
+		}
+		return (uint16_t)(sign | half);
+	}
+
+	// a carry out of the mantissa correctly bumps the exponent, up to inf
+	uint32_t half = sign | ((uint32_t)exponent << 10) | (mantissa >> 13);
+	const uint32_t rest = mantissa & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+		half++;
+	}
+	return (uint16_t)half;
+}
+
+static void putAttribute(std::vector<unsigned char>& header, const char* name, const char* type, const void* value, uint32_t size)
+{
+	header.insert(header.end(), name, name + strlen(name) + 1);
+	header.insert(header.end(), type, type + strlen(type) + 1);
+	const unsigned char* sizeBytes = (const unsigned char*)&size;
+	header.insert(header.end(), sizeBytes, sizeBytes + sizeof(size));
+	const unsigned char* bytes = (const unsigned char*)value;
+	header.insert(header.end(), bytes, bytes + size);
+}
+
+template <typename T>
+static void putValue(std::vector<unsigned char>& buffer, const T& value)
+{
+	const unsigned char* bytes = (const unsigned char*)&value;
+	buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+bool ImageWriter::writeExr(const std::string& path, const Image& image, PixelType type)
+{
+	if (image.channels.empty() || image.width <= 0 || image.height <= 0) {
+		CGRA_LOGE("nothing to write to %s", path.c_str());
+		return false;
+	}
+
+	// readers expect the channel list sorted by name, the pixel data follows that order
+	std::vector<size_t> order(image.channels.size());
+	for (size_t c = 0; c < order.size(); c++) {
+		order[c] = c;
+	}
+	std::sort(order.begin(), order.end(), [&image](size_t a, size_t b) {
+		return image.channels[a] < image.channels[b];
+	});
+
+	std::vector<unsigned char> channelList;
+	for (size_t c : order) {
+		const std::string& name = image.channels[c];
+		channelList.insert(channelList.end(), name.c_str(), name.c_str() + name.size() + 1);
+		putValue(channelList, (int32_t)type);
+		putValue(channelList, (uint32_t)0); // pLinear and reserved
+		putValue(channelList, (int32_t)1);  // x sampling
+		putValue(channelList, (int32_t)1);  // y sampling
+	}
+	channelList.push_back(0);
+
+	const int32_t window[4] = {0, 0, image.width - 1, image.height - 1};
+	const unsigned char compression = 0; // NO_COMPRESSION
+	const unsigned char lineOrder = 0;   // INCREASING_Y
+	const float aspectRatio = 1.0f;
+	const float windowCenter[2] = {0.0f, 0.0f};
+	const float windowWidth = 1.0f;
+
+	std::vector<unsigned char> header;
+	const uint32_t magic = 20000630;
+	const uint32_t version = 2; // single part scanline
+	putValue(header, magic);
+	putValue(header, version);
+	putAttribute(header, "channels", "chlist", channelList.data(), (uint32_t)channelList.size());
+	putAttribute(header, "compression", "compression", &compression, sizeof(compression));
+	putAttribute(header, "dataWindow", "box2i", window, sizeof(window));
+	putAttribute(header, "displayWindow", "box2i", window, sizeof(window));
+	putAttribute(header, "lineOrder", "lineOrder", &lineOrder, sizeof(lineOrder));
+	putAttribute(header, "pixelAspectRatio", "float", &aspectRatio, sizeof(aspectRatio));
+	putAttribute(header, "screenWindowCenter", "v2f", windowCenter, sizeof(windowCenter));
+	putAttribute(header, "screenWindowWidth", "float", &windowWidth, sizeof(windowWidth));
+	header.push_back(0);
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr) {
+		CGRA_LOGE("cannot open %s", path.c_str());
+		return false;
+	}
+
+	// uncompressed scanline blocks hold one line each, so the offsets are known up front
+	const size_t pixelSize = type == PIXEL_HALF ? 2 : 4;
+	const uint32_t lineBytes = (uint32_t)(image.width * pixelSize * order.size());
+	const uint64_t firstLine = header.size() + (uint64_t)image.height * sizeof(uint64_t);
+	std::vector<uint64_t> offsets(image.height);
+	for (int y = 0; y < image.height; y++) {
+		offsets[y] = firstLine + (uint64_t)y * (2 * sizeof(int32_t) + lineBytes);
+	}
+
+	bool written = fwrite(header.data(), 1, header.size(), file) == header.size();
+	written = written && fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), file) == offsets.size();
+
+	std::vector<unsigned char> line;
+	line.reserve(2 * sizeof(int32_t) + lineBytes);
+	for (int y = 0; y < image.height && written; y++) {
+		// EXR lines run top to bottom
+		const size_t row = image.bottomUp ? image.height - 1 - y : y;
+
+		line.clear();
+		putValue(line, (int32_t)y);
+		putValue(line, lineBytes);
+		for (size_t c : order) {
+			const float* plane = image.planes[c].data() + row * image.width;
+			for (int x = 0; x < image.width; x++) {
+				if (type == PIXEL_HALF) {
+					putValue(line, toHalf(plane[x]));
+				}
+				else {
+					putValue(line, plane[x]);
+				}
+			}
+		}
+		written = fwrite(line.data(), 1, line.size(), file) == line.size();
+	}
+
+	written = fclose(file) == 0 && written;
+	if (!written) {
+		CGRA_LOGE("failed to write %s", path.c_str());
+	}
+	return written;
+}
+
+bool ImageWriter::writePfm(const std::string& path, const Image& image)
+{
+	const float* rgb[3] = {image.getChannel("R"), image.getChannel("G"), image.getChannel("B")};
+	if (rgb[0] == nullptr || rgb[1] == nullptr || rgb[2] == nullptr) {
+		CGRA_LOGE("%s needs R, G and B channels", path.c_str());
+		return false;
+	}
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr) {
+		CGRA_LOGE("cannot open %s", path.c_str());
+		return false;
+	}
+
+	// a negative scale marks little endian, lines run bottom to top
+	bool written = fprintf(file, "PF\n%d %d\n-1.0\n", image.width, image.height) > 0;
+
+	std::vector<float> line(3 * image.width);
+	for (int y = 0; y < image.height && written; y++) {
+		const size_t row = image.bottomUp ? y : image.height - 1 - y;
+		for (int x = 0; x < image.width; x++) {
+			for (int c = 0; c < 3; c++) {
+				line[3 * x + c] = rgb[c][row * image.width + x];
+			}
+		}
+		written = fwrite(line.data(), sizeof(float), line.size(), file) == line.size();
+	}
+
+	written = fclose(file) == 0 && written;
+	if (!written) {
+		CGRA_LOGE("failed to write %s", path.c_str());
+	}
+	return written;
+}
+
+} // namespace CGRA
@@ -0,0 +1,133 @@
+#ifndef BINARY_LOG_H
+#define BINARY_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <type_traits>
+
+#include "log.h"
+
+namespace UTILITY {
+
+/**
+ * Binary log with deferred formatting.
+ *
+ * UTILITY_BINLOG registers its format string once and afterwards only copies
+ * the format id, a timestamp and the raw arguments into a per-thread ring.
+ * A writer thread appends them to rotating files under the directory given
+ * to start(); binlog_decode turns those files back into text.
+ *
+ * File layout, little endian:
+ *   header  "CGRABLG1", u64 wall clock of the epoch in ns
+ *   'F'     u32 id, u32 line, u16 length + file, u16 length + format
+ *   'E'     u32 id, u64 time in ns since the epoch, u32 tid, u16 length + arguments
+ *   'D'     u32 tid, u32 dropped events
+ * Every file repeats the header and all formats, so each one decodes on its own.
+ */
+class BinaryLog
+{
+public:
+	static const size_t kMaxPayload = 112;
+
+	/**Encoded arguments of one event, one type tag byte before each value.*/
+	struct Payload {
+		uint16_t size;
+		unsigned char data[kMaxPayload];
+	};
+
+	static bool isEnabled() {
+		return g_enabled.load(std::memory_order_relaxed);
+	}
+
+	/**Starts writing files named binlog_<pid>_<n>.bin into directory, keeping at most maxFiles.*/
+	static bool start(const char* const directory, size_t maxFileBytes = 64 << 20, int maxFiles = 8);
+
+	/**Writes what is queued and closes the current file.*/
+	static void stop();
+
+	static int registerFormat(const char* format, const char* file, int line);
+
+	static void write(int id, const Payload& payload);
+
+	/**Decodes one file as text into out, returns false if it is not a binary log.*/
+	static bool decode(const char* const path, FILE* out);
+
+	template <typename... Args>
+	static void log(int id, const Args&... args) {
+		Payload payload;
+		payload.size = 0;
+		(encode(payload, args), ...);
+		write(id, payload);
+	}
+
+	/**Never called, lets the compiler check the arguments against the format.*/
+	static void check(const char* format, ...) UTILITY_PRINTF_FORMAT(1, 2) {
+		(void)format;
+	}
+
+private:
+	static void append(Payload& payload, char tag, const void* value, size_t size) {
+		if (payload.size + 1 + size > kMaxPayload) {
+			return;
+		}
+		payload.data[payload.size] = (unsigned char)tag;
+		memcpy(payload.data + payload.size + 1, value, size);
+		payload.size += 1 + size;
+	}
+
+	static void encodeString(Payload& payload, const char* value) {
+		if (value == nullptr) {
+			value = "(null)";
+		}
+		size_t room = kMaxPayload - payload.size;
+		if (room < 3) {
+			return;
+		}
+		uint16_t length = (uint16_t)strnlen(value, room - 3);
+		payload.data[payload.size] = 's';
+		memcpy(payload.data + payload.size + 1, &length, sizeof(length));
+		memcpy(payload.data + payload.size + 3, value, length);
+		payload.size += 3 + length;
+	}
+
+	template <typename T>
+	static void encode(Payload& payload, const T& value) {
+		if constexpr (std::is_convertible<T, const char*>::value) {
+			encodeString(payload, value);
+		}
+		else if constexpr (std::is_pointer<T>::value) {
+			uint64_t raw = (uint64_t)(uintptr_t)value;
+			append(payload, 'p', &raw, sizeof(raw));
+		}
+		else if constexpr (std::is_floating_point<T>::value) {
+			double raw = value;
+			append(payload, 'd', &raw, sizeof(raw));
+		}
+		else if constexpr (std::is_unsigned<T>::value) {
+			uint64_t raw = value;
+			append(payload, 'u', &raw, sizeof(raw));
+		}
+		else {
+			static_assert(std::is_integral<T>::value || std::is_enum<T>::value, "unsupported binary log argument");
+			int64_t raw = (int64_t)value;
+			append(payload, 'i', &raw, sizeof(raw));
+		}
+	}
+
+	static std::atomic<bool> g_enabled;
+};
+
+} // namespace UTILITY
+
+#define UTILITY_BINLOG(format, ...) do { \
+		static const int _binlog_id = UTILITY::BinaryLog::registerFormat(format, __UTILITY_FILE_NAME__, __LINE__); \
+		if (false) { UTILITY::BinaryLog::check(format, ##__VA_ARGS__); } \
+		if (UTILITY::BinaryLog::isEnabled()) { UTILITY::BinaryLog::log(_binlog_id, ##__VA_ARGS__); } \
+	} while (0)
+
+#define CGRA_BINLOG(format, ...) UTILITY_BINLOG(format, ##__VA_ARGS__)
+
+#endif // BINARY_LOG_H
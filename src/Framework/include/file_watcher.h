@@ -0,0 +1,43 @@
+#ifndef FILE_WATCHER_H
+#define FILE_WATCHER_H
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace CGRA {
+
+/**
+ * Calls onChange on a background thread whenever the file at path is written.
+ *
+ * On Linux the parent directory is watched with inotify so editors that save
+ * by writing a temporary file and renaming it are caught as well. Other
+ * platforms poll the modification time.
+ */
+class FileWatcher
+{
+public:
+	FileWatcher(const char* const path, std::function<void()> onChange);
+
+	virtual ~FileWatcher();
+
+	const std::string& getPath() {
+		return path;
+	}
+
+private:
+	FileWatcher(const FileWatcher&);
+	FileWatcher& operator = (const FileWatcher&);
+
+	void loop();
+
+	std::string path;
+	std::function<void()> onChange;
+	std::atomic<bool> running;
+	std::thread thread;
+};
+
+} // namespace CGRA
+
+#endif // FILE_WATCHER_H
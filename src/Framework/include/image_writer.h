@@ -0,0 +1,97 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace CGRA {
+
+/**
+ * Linear float image with named channels stored one plane per channel, e.g.
+ * R G B plus AOVs such as albedo.R or depth.Z.
+ */
+struct Image {
+	int width = 0;
+	int height = 0;
+
+	/**Row 0 is the bottom row, as the OpenCL kernels and GL textures lay them out.*/
+	bool bottomUp = true;
+
+	std::vector<std::string> channels;
+	std::vector<std::vector<float> > planes;
+
+	Image() = default;
+
+	Image(int width, int height, bool bottomUp = true)
+		: width(width)
+		, height(height)
+		, bottomUp(bottomUp)
+	{
+
+	}
+
+	/**Adds names.size() channels from data interleaved with that stride, e.g. an RGB buffer.*/
+	void addChannels(const std::vector<std::string>& names, const float* data);
+
+	/**Plane of the channel, nullptr if there is none.*/
+	const float* getChannel(const std::string& name) const;
+};
+
+/**
+ * Writes HDR images without blocking the caller.
+ *
+ * save() moves the image to a single writer thread and returns a future
+ * with the result; the format follows the extension. .exr is OpenEXR 2
+ * scanline, uncompressed, half or float, with every channel of the image.
+ * .pfm is the portable float map of the R, G and B channels.
+ */
+class ImageWriter
+{
+public:
+	enum PixelType {
+		PIXEL_HALF = 1,
+		PIXEL_FLOAT = 2,
+	};
+
+	static ImageWriter* getInstance();
+
+	std::future<bool> save(const std::string& path, Image image, PixelType type = PIXEL_HALF);
+
+	/**Blocks until every queued image is written, call before exit.*/
+	void finish();
+
+	static bool writeExr(const std::string& path, const Image& image, PixelType type);
+
+	static bool writePfm(const std::string& path, const Image& image);
+
+	static uint16_t toHalf(float value);
+
+private:
+	ImageWriter();
+	virtual ~ImageWriter();
+	ImageWriter(const ImageWriter&);
+	ImageWriter& operator = (const ImageWriter&);
+
+	static ImageWriter* _instance;
+
+	void loop();
+
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	std::condition_variable idle;
+	std::deque<std::function<void()> > jobs;
+	bool busy;
+	std::thread thread;
+};
+
+} // namespace CGRA
+
+#endif // IMAGE_WRITER_H
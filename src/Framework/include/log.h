@@ -53,22 +53,87 @@ constexpr const char* fileNameParser(const char* fileName, int ptr) {
 #define __UTILITY_FILE_NAME__
 #endif
 
+/**Microseconds on the process-wide monotonic clock, see UTILITY::Clock.*/
 unsigned long us_ticker_read();
 
-static unsigned long g_init_time = us_ticker_read();
-#define gettime() ((us_ticker_read() - g_init_time) / 1000)
+#define gettime() (us_ticker_read() / 1000)
 
-#define UTILITY_LOG_LEVEL_ERROR     "E"
-#define UTILITY_LOG_LEVEL_WARNING   "W"
-#define UTILITY_LOG_LEVEL_DEBUG     "D"
+#define UTILITY_LOG_LEVEL_PRINT     0
+#define UTILITY_LOG_LEVEL_ERROR     1
+#define UTILITY_LOG_LEVEL_WARNING   2
+#define UTILITY_LOG_LEVEL_DEBUG     3
 
-#define UTILITY_LOG(logLevel, format, ...) printf("%s/[%ld] (%d) <%zu> %s[%d] %s() " format "\n", logLevel, gettime(), getpid(), gettid(), __UTILITY_FILE_NAME__, __LINE__, __func__, ##__VA_ARGS__)
+// levels above this are compiled out, e.g. -DUTILITY_LOG_COMPILED_LEVEL=UTILITY_LOG_LEVEL_WARNING for release builds
+#ifndef UTILITY_LOG_COMPILED_LEVEL
+#define UTILITY_LOG_COMPILED_LEVEL UTILITY_LOG_LEVEL_DEBUG
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define UTILITY_PRINTF_FORMAT(formatIndex, firstArg) __attribute__((format(printf, formatIndex, firstArg)))
+#else
+#define UTILITY_PRINTF_FORMAT(formatIndex, firstArg)
+#endif
+
+#include <atomic>
+
+namespace UTILITY {
+
+/**
+ * Asynchronous logger behind the UTILITY_LOG macros.
+ *
+ * The message is formatted on the calling thread into a per-thread lock-free
+ * ring buffer and written to stdout by a background flusher thread, so the
+ * caller never waits on stdout. When a ring is full the message is dropped
+ * and counted rather than blocking the caller.
+ */
+class Logger
+{
+public:
+    static bool isEnabled(int level) {
+        return level <= g_level.load(std::memory_order_relaxed);
+    }
+
+    /**Runtime filter, messages above level are discarded before formatting.*/
+    static void setLevel(int level) {
+        g_level.store(level, std::memory_order_relaxed);
+    }
+
+    static int getLevel() {
+        return g_level.load(std::memory_order_relaxed);
+    }
+
+    static void write(int level, const char* file, int line, const char* func, const char* format, ...) UTILITY_PRINTF_FORMAT(5, 6);
+
+    /**Blocks until everything logged so far is written.*/
+    static void flush();
 
+private:
+    static std::atomic<int> g_level;
+};
+
+} // namespace UTILITY
+
+#define UTILITY_LOG(logLevel, format, ...) do { if (UTILITY::Logger::isEnabled(logLevel)) { UTILITY::Logger::write(logLevel, __UTILITY_FILE_NAME__, __LINE__, __func__, "" format, ##__VA_ARGS__); } } while (0)
+
+#if UTILITY_LOG_COMPILED_LEVEL >= UTILITY_LOG_LEVEL_ERROR
 #define UTILITY_LOGE(format, ...) UTILITY_LOG(UTILITY_LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#else
+#define UTILITY_LOGE(format, ...) do { } while (0)
+#endif
+
+#if UTILITY_LOG_COMPILED_LEVEL >= UTILITY_LOG_LEVEL_WARNING
 #define UTILITY_LOGW(format, ...) UTILITY_LOG(UTILITY_LOG_LEVEL_WARNING, format, ##__VA_ARGS__)
+#else
+#define UTILITY_LOGW(format, ...) do { } while (0)
+#endif
+
+#if UTILITY_LOG_COMPILED_LEVEL >= UTILITY_LOG_LEVEL_DEBUG
 #define UTILITY_LOGD(format, ...) UTILITY_LOG(UTILITY_LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#else
+#define UTILITY_LOGD(format, ...) do { } while (0)
+#endif
 
-#define UTILITY_LOGP(format, ...) printf(format "\n",##__VA_ARGS__)
+#define UTILITY_LOGP(format, ...) UTILITY::Logger::write(UTILITY_LOG_LEVEL_PRINT, __UTILITY_FILE_NAME__, __LINE__, __func__, "" format "\n", ##__VA_ARGS__)
 
 
 
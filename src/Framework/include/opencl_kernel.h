@@ -0,0 +1,85 @@
+#ifndef OPENCL_KERNEL_H
+#define OPENCL_KERNEL_H
+
+#if defined(__APPLE__) || defined(__MACOSX)
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace CGRA {
+
+/**
+ * A kernel created from an OpenclTask program.
+ *
+ * Arguments are bound through setArg(), which checks the index and size and
+ * remembers the last value set on every index, so re-binding an unchanged
+ * argument before each launch costs a memcmp instead of a clSetKernelArg.
+ */
+class OpenclKernel
+{
+public:
+	OpenclKernel(cl_program program, const char* const name);
+
+	virtual ~OpenclKernel();
+
+	template <typename T>
+	bool setArg(cl_uint index, const T& value) {
+		static_assert(std::is_trivially_copyable<T>::value, "kernel arguments must be trivially copyable");
+		static_assert(!std::is_pointer<T>::value || std::is_same<T, cl_mem>::value, "pass cl_mem by value, not host pointers");
+		return setArg(index, sizeof(T), &value);
+	}
+
+	bool setArg(cl_uint index, size_t size, const void* value);
+
+	/**__local argument of size bytes.*/
+	bool setLocalArg(cl_uint index, size_t size);
+
+	/**Forget every cached argument, the next setArg() on each index is sent to the runtime.*/
+	void invalidate();
+
+	/**Takes ownership of a kernel created from a rebuilt program, all arguments have to be set again.*/
+	void replace(cl_kernel newKernel);
+
+	/**Enqueues a 1D range on the manager's command queue, event is NULL if nothing was enqueued.*/
+	cl_int run(size_t globalWorkSize, cl_event* event);
+
+	bool isValid() {
+		return kernel != nullptr;
+	}
+
+	cl_kernel getKernel() {
+		return kernel;
+	}
+
+	const std::string& getName() {
+		return name;
+	}
+
+	cl_uint getNumArgs() {
+		return numArgs;
+	}
+
+private:
+	OpenclKernel(const OpenclKernel&);
+	OpenclKernel& operator = (const OpenclKernel&);
+
+	struct Argument {
+		bool isSet;
+		bool isLocal;
+		std::vector<unsigned char> value;
+	};
+
+	cl_kernel kernel;
+	std::string name;
+	cl_uint numArgs;
+	std::vector<Argument> args;
+};
+
+} // namespace CGRA
+
+#endif // OPENCL_KERNEL_H
@@ -12,6 +12,7 @@ namespace CGRA {
 class OpenclManager
 {
 public:
+	/**Safe from any thread; the first call picks the device and creates the context and queue.*/
 	static OpenclManager* getInstance();
 
 	cl_context getContent() {
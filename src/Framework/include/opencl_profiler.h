@@ -0,0 +1,102 @@
+#ifndef OPENCL_PROFILER_H
+#define OPENCL_PROFILER_H
+
+#if defined(__APPLE__) || defined(__MACOSX)
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace CGRA {
+
+/**
+ * Collects the CL_PROFILING_COMMAND_* timestamps of the commands enqueued on
+ * the OpenclManager queue, which is created with CL_QUEUE_PROFILING_ENABLE.
+ *
+ * record() takes a reference on the event, collect() reads back every event
+ * that has completed since and folds it into the statistics of its stage.
+ * Past a few hundred held events record() collects by itself, so callers
+ * that never collect(), such as a long headless render, stay bounded.
+ * While the Tracer is capturing, completed commands are also placed on its
+ * device track, shifted onto the host clock using the time of record().
+ */
+class OpenclProfiler
+{
+public:
+	static OpenclProfiler* getInstance();
+
+	struct Record {
+		std::string stage;
+		cl_ulong queued;
+		cl_ulong submit;
+		cl_ulong start;
+		cl_ulong end;
+	};
+
+	struct Stage {
+		std::string name;
+		unsigned long count;
+		cl_ulong totalQueued;   // queued -> submit
+		cl_ulong totalSubmit;   // submit -> start
+		cl_ulong totalExecute;  // start -> end
+		cl_ulong minExecute;
+		cl_ulong maxExecute;
+		cl_ulong lastExecute;
+	};
+
+	void record(const char* const stage, cl_event event);
+
+	/**Reads back the completed events, call once per frame.*/
+	void collect();
+
+	std::vector<Stage> getStages();
+
+	/**Last completed commands, oldest first.*/
+	std::vector<Record> getRecords();
+
+	void reset();
+
+	/**Writes the stage statistics and the recent records as JSON.*/
+	bool dump(const char* const path);
+
+	void setEnabled(bool enabled) {
+		this->enabled = enabled;
+	}
+
+	bool isEnabled() {
+		return enabled;
+	}
+
+private:
+	OpenclProfiler();
+	virtual ~OpenclProfiler();
+	OpenclProfiler(const OpenclProfiler&);
+	OpenclProfiler& operator = (const OpenclProfiler&);
+
+	static OpenclProfiler* _instance;
+
+	/**collect() with mutex held.*/
+	void collectLocked();
+
+	struct Pending {
+		std::string stage;
+		cl_event event;
+		unsigned long long hostTime;
+	};
+
+	std::mutex mutex;
+	bool enabled;
+	std::vector<Pending> pending;
+	std::map<std::string, Stage> stages;
+	std::deque<Record> records;
+};
+
+} // namespace CGRA
+
+#endif // OPENCL_PROFILER_H
@@ -7,21 +7,97 @@
 #include <CL/cl.h>
 #endif
 
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "opencl_kernel.h"
+#include "file_watcher.h"
+
 namespace CGRA {
 
 class OpenclTask
 {
 public:
-	OpenclTask(const char* const fileAddress);
+	/**options are passed to clBuildProgram, e.g. -D defines that specialise the kernels.*/
+	OpenclTask(const char* const fileAddress, const std::string& options = "");
 
 	virtual ~OpenclTask();
 
 	virtual void run();
 
+	/**
+	 * The program is built on a background thread started by the constructor.
+	 * isBuilt() polls it without blocking, waitForBuild() blocks and returns
+	 * whether the build succeeded.
+	 */
+	bool isBuilt();
+
+	bool waitForBuild();
+
+	/**Kernels are created on first use and owned by the task, blocks until the program is built.*/
+	OpenclKernel* getKernel(const char* const name);
+
+	/**Rebuilds the program on a background thread whenever the source file changes.*/
+	void enableHotReload();
+
+	/**
+	 * Rebuilds the program with new build options on a background thread,
+	 * update() swaps it in like a hot reload. Does nothing if options are
+	 * the ones already requested. Never waits for a compile: while one is
+	 * running, it builds again with the latest options once it is done.
+	 */
+	void setBuildOptions(const std::string& options);
+
+	/**Blocks until a rebuild started by setBuildOptions() is done, update() still has to swap it in.*/
+	void waitForRebuild();
+
+	/**Options the live program was built with.*/
+	const std::string& getProgramOptions() const {
+		return programOptions;
+	}
+
+	/**
+	 * Call between frames. Swaps in a program rebuilt by the hot reload, and
+	 * returns true if the kernels were replaced. If the new source fails to
+	 * build, or lacks one of the kernels in use, the old program stays live.
+	 */
+	virtual bool update();
+
+	/**Build log of the last failed build, empty once a build succeeds.*/
+	std::string getBuildLog();
+
+	/**Builds the program from the source file, returns nullptr and fills log on failure.*/
+	static cl_program buildProgram(const char* const fileAddress, const std::string& options, std::string& log);
+
 protected:
+	struct BuildResult {
+		cl_program program;
+		std::string log;
+	};
+
+	/**Rebuilds with the requested options, returns them.*/
+	std::string onSourceChanged();
+
+	void finishBuild();
+
+	std::string sourcePath;
 	cl_program program;
+	std::string programOptions;
+	std::future<BuildResult> startupBuild;
+	std::map<std::string, OpenclKernel*> kernels;
+
+	std::mutex reloadMutex;
+	std::string buildOptions; // what the next build uses
+	cl_program pendingProgram;
+	std::string pendingOptions;
+	std::string buildLog;
+	FileWatcher* watcher;
+	std::future<void> optionsBuild;
+	bool optionsBuilding; // optionsBuild is still building, under reloadMutex
 };
 
 } // namespace CGRA
 
-#endif // OPENCL_TASK_H
\ No newline at end of file
+#endif // OPENCL_TASK_H
@@ -0,0 +1,74 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <atomic>
+#include <stddef.h>
+
+namespace UTILITY {
+
+/**
+ * Fixed-size lock-free queue for exactly one producer and one consumer thread.
+ *
+ * The producer fills the slot returned by claim() in place and publishes it
+ * with commit(); the consumer reads front() and releases it with pop().
+ * Capacity must be a power of two.
+ */
+template <typename T, size_t Capacity>
+class RingBuffer
+{
+	static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+	RingBuffer()
+		: head(0)
+		, tail(0)
+	{
+
+	}
+
+	/**Producer: next free slot, nullptr when the buffer is full.*/
+	T* claim() {
+		const size_t current = tail.load(std::memory_order_relaxed);
+		if (current - head.load(std::memory_order_acquire) >= Capacity) {
+			return nullptr;
+		}
+		return &slots[current & (Capacity - 1)];
+	}
+
+	/**Producer: publish the slot returned by claim().*/
+	void commit() {
+		tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	/**Consumer: oldest published slot, nullptr when the buffer is empty.*/
+	T* front() {
+		const size_t current = head.load(std::memory_order_relaxed);
+		if (current == tail.load(std::memory_order_acquire)) {
+			return nullptr;
+		}
+		return &slots[current & (Capacity - 1)];
+	}
+
+	/**Consumer: release the slot returned by front().*/
+	void pop() {
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	bool empty() {
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+
+private:
+	RingBuffer(const RingBuffer&);
+	RingBuffer& operator = (const RingBuffer&);
+
+	T slots[Capacity];
+
+	// producer and consumer indices on separate cache lines
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) std::atomic<size_t> tail;
+};
+
+} // namespace UTILITY
+
+#endif // RING_BUFFER_H
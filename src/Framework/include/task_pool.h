@@ -0,0 +1,103 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace CGRA {
+
+/**
+ * Work-stealing pool of one worker thread per core but one, for CPU work
+ * that splits into many tasks, such as building a BVH.
+ *
+ * Every worker has its own deque: it pushes and pops the tasks it spawns at
+ * the back, so it keeps working on the newest and cache-warm ones, and when
+ * it runs dry it steals the oldest, usually largest, task from the front of
+ * another's. Threads outside the pool push to a deque of their own that the
+ * workers steal from. wait() runs tasks instead of blocking, so a task may
+ * spawn and wait for tasks of its own, and the caller is the last core.
+ */
+class TaskPool
+{
+public:
+	/**Tasks that are waited for together.*/
+	class Group
+	{
+	public:
+		Group()
+			: pending(0)
+		{
+
+		}
+
+	private:
+		friend class TaskPool;
+		Group(const Group&);
+		Group& operator = (const Group&);
+
+		std::atomic<int> pending;
+	};
+
+	static TaskPool* getInstance();
+
+	/**Queues task as part of group.*/
+	void run(Group& group, std::function<void()> task);
+
+	/**Runs queued tasks, the group's or others, until every task of group is done.*/
+	void wait(Group& group);
+
+	/**
+	 * Calls work(begin, end) on ranges of at least grain items that together
+	 * cover [0, count), on every core when there is enough of it.
+	 */
+	void parallelFor(int count, int grain, const std::function<void(int begin, int end)>& work);
+
+	/**Workers plus the calling thread.*/
+	int getThreadCount() const {
+		return (int)workers.size() + 1;
+	}
+
+private:
+	TaskPool();
+	virtual ~TaskPool();
+	TaskPool(const TaskPool&);
+	TaskPool& operator = (const TaskPool&);
+
+	static TaskPool* _instance;
+
+	struct Task {
+		std::function<void()> work;
+		Group* group;
+	};
+
+	struct alignas(64) Queue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	void loop(int worker);
+
+	/**Pops from queue's back, or steals from another's front; false if every queue is empty.*/
+	bool acquire(int queue, Task& task);
+
+	/**The calling thread's queue, the shared one for threads outside the pool.*/
+	int getQueue() const;
+
+	void execute(Task& task);
+
+	std::vector<Queue> queues; // one per worker, the last for outside threads
+	std::vector<std::thread> workers;
+	std::mutex sleepMutex;
+	std::condition_variable wakeup;
+	std::atomic<int> queued;
+	bool stop;
+};
+
+} // namespace CGRA
+
+#endif // TASK_POOL_H
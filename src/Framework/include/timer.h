@@ -0,0 +1,125 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+#include <string>
+
+namespace UTILITY {
+
+/**
+ * Monotonic time shared by every module of the process.
+ *
+ * now() is CLOCK_MONOTONIC (steady_clock on Windows) in nanoseconds since a
+ * single process-wide epoch, so timestamps taken in different translation
+ * units compare directly. ticks() reads the invariant TSC on x86 when the
+ * CPU has one, for the cheapest possible interval measurement; convert
+ * with ticksToNs(), which calibrates against now() on first use.
+ */
+class Clock
+{
+public:
+	static uint64_t now();
+
+	/**Wall clock at the epoch, in nanoseconds since 1970.*/
+	static uint64_t epochWallTime();
+
+	static bool hasTsc();
+
+	static uint64_t ticks();
+
+	static uint64_t ticksToNs(uint64_t ticks);
+
+private:
+	static uint64_t raw();
+};
+
+/**
+ * Latency histogram with log-linear buckets: 16 sub-buckets per power of two,
+ * so any percentile is within about 6% of the true value. Not thread-safe,
+ * keep one per thread and merge() them.
+ */
+class Histogram
+{
+public:
+	Histogram();
+
+	void record(uint64_t ns);
+
+	void merge(const Histogram& other);
+
+	void reset();
+
+	uint64_t getCount() const {
+		return count;
+	}
+
+	uint64_t getMin() const {
+		return count == 0 ? 0 : min;
+	}
+
+	uint64_t getMax() const {
+		return max;
+	}
+
+	double getMean() const {
+		return count == 0 ? 0.0 : (double)sum / count;
+	}
+
+	/**p in [0, 100].*/
+	uint64_t percentile(double p) const;
+
+	/**"count mean p50 p90 p99 max" in milliseconds.*/
+	std::string summary() const;
+
+private:
+	static const int kSubBits = 4;
+	static const int kSubBuckets = 1 << kSubBits;
+	static const int kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+	static int bucketOf(uint64_t ns);
+
+	static uint64_t valueOf(int bucket);
+
+	uint64_t buckets[kBuckets];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+/**Adds the lifetime of the scope to a histogram and/or a running total.*/
+class ScopedTimer
+{
+public:
+	ScopedTimer(Histogram* histogram, uint64_t* total = nullptr)
+		: histogram(histogram)
+		, total(total)
+		, begin(Clock::now())
+	{
+
+	}
+
+	~ScopedTimer() {
+		uint64_t elapsed = Clock::now() - begin;
+		if (histogram != nullptr) {
+			histogram->record(elapsed);
+		}
+		if (total != nullptr) {
+			*total += elapsed;
+		}
+	}
+
+	uint64_t elapsed() const {
+		return Clock::now() - begin;
+	}
+
+private:
+	Histogram* histogram;
+	uint64_t* total;
+	uint64_t begin;
+};
+
+} // namespace UTILITY
+
+#endif // TIMER_H
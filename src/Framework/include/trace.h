@@ -0,0 +1,110 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace CGRA {
+
+/**
+ * Timeline of host scopes and device commands, written as Chrome trace-event
+ * JSON (load it in chrome://tracing or ui.perfetto.dev).
+ *
+ * Nothing is recorded until start(); a disabled CGRA_TRACE_SCOPE costs one
+ * relaxed atomic load. Building with CGRA_DISABLE_TRACE removes the scopes.
+ */
+class Tracer
+{
+public:
+	static Tracer* getInstance();
+
+	void start();
+
+	void stop();
+
+	bool isEnabled() {
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+	/**Nanoseconds since the tracer was created, on a monotonic clock.*/
+	static unsigned long long now();
+
+	/**name must outlive the tracer, string literals or intern().*/
+	void addHostEvent(const char* const name, unsigned long long begin, unsigned long long duration);
+
+	void addDeviceEvent(const char* const name, unsigned long long begin, unsigned long long duration);
+
+	/**Names the calling thread in the trace.*/
+	void setThreadName(const char* const name);
+
+	const char* intern(const std::string& name);
+
+	/**Writes everything recorded since start().*/
+	bool write(const char* const path);
+
+private:
+	Tracer();
+	virtual ~Tracer();
+	Tracer(const Tracer&);
+	Tracer& operator = (const Tracer&);
+
+	static Tracer* _instance;
+
+	struct Event {
+		const char* name;
+		unsigned long long begin;
+		unsigned long long duration;
+	};
+
+	struct ThreadBuffer {
+		std::mutex mutex;
+		int tid;
+		std::string name;
+		std::vector<Event> events;
+	};
+
+	ThreadBuffer* getThreadBuffer();
+
+	std::atomic<bool> enabled;
+	std::mutex mutex;
+	std::vector<ThreadBuffer*> threads;
+	ThreadBuffer device;
+	std::set<std::string> names;
+};
+
+class TraceScope
+{
+public:
+	TraceScope(const char* const name)
+		: name(name)
+		, begin(Tracer::getInstance()->isEnabled() ? Tracer::now() : 0)
+	{
+
+	}
+
+	~TraceScope() {
+		if (begin != 0 && Tracer::getInstance()->isEnabled()) {
+			Tracer::getInstance()->addHostEvent(name, begin, Tracer::now() - begin);
+		}
+	}
+
+private:
+	const char* name;
+	unsigned long long begin;
+};
+
+} // namespace CGRA
+
+#define CGRA_TRACE_CONCAT_(a, b) a##b
+#define CGRA_TRACE_CONCAT(a, b) CGRA_TRACE_CONCAT_(a, b)
+
+#ifdef CGRA_DISABLE_TRACE
+#define CGRA_TRACE_SCOPE(name)
+#else
+#define CGRA_TRACE_SCOPE(name) CGRA::TraceScope CGRA_TRACE_CONCAT(_trace_scope_, __LINE__)(name)
+#endif
+
+#endif // TRACE_H
@@ -1,45 +1,269 @@
 #include "log.h"
 
-#ifdef _WIN32
-#include <sys/timeb.h>
-#include <time.h>
-#include <windows.h>
-#else
-#include <sys/time.h>
-#endif
+#include "timer.h"
+
+unsigned long us_ticker_read() {
+    return (unsigned long)(UTILITY::Clock::now() / 1000);
+}
+
+
+#include "ring_buffer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
 
 namespace UTILITY {
 
-#ifdef _WIN32
-
-int gettimeofday(struct timeval *tp, void *tzp) {
-    time_t clock;
-    struct tm tm;
-    SYSTEMTIME wtm;
-    GetLocalTime(&wtm);
-    tm.tm_year = wtm.wYear - 1900;
-    tm.tm_mon = wtm.wMonth - 1;
-    tm.tm_mday = wtm.wDay;
-    tm.tm_hour = wtm.wHour;
-    tm.tm_min = wtm.wMinute;
-    tm.tm_sec = wtm.wSecond;
-    tm.tm_isdst = -1;
-    clock = mktime(&tm);
-    tp->tv_sec = clock;
-    tp->tv_usec = wtm.wMilliseconds * 1000;
-    return (0);
-}
-#endif
+std::atomic<int> Logger::g_level(UTILITY_LOG_LEVEL_DEBUG);
 
-} // namespace UTILITY
+/**Messages longer than this are copied to the heap.*/
+static const size_t kLogMessageSize = 200;
 
-unsigned long us_ticker_read() {
-    struct timeval timer;
-#ifdef _WIN32
-    UTILITY::gettimeofday(&(timer), nullptr);
-#else
-    gettimeofday(&(timer), nullptr);
-#endif
-    return timer.tv_sec * 1000000 + timer.tv_usec;
+static const size_t kLogRingSize = 1024;
+
+struct LogRecord {
+    int level;
+    unsigned long long time;
+    unsigned long tid;
+    const char* file;
+    int line;
+    const char* func;
+    char* overflow;
+    char message[kLogMessageSize];
+};
+
+struct ThreadLog {
+    RingBuffer<LogRecord, kLogRingSize> records;
+    unsigned long tid;
+    std::atomic<unsigned long> dropped;
+    std::atomic<bool> retired;
+};
+
+/**Owns the per-thread rings and the flusher thread, never destroyed so late loggers stay safe.*/
+class LogFlusher
+{
+public:
+    static LogFlusher* getInstance() {
+        static LogFlusher* instance = new LogFlusher();
+        return instance;
+    }
+
+    ThreadLog* getThreadLog();
+
+    bool isRunning() {
+        return running.load(std::memory_order_acquire);
+    }
+
+    void drain();
+
+    void stop();
+
+private:
+    LogFlusher();
+
+    void loop();
+
+    std::mutex threadsMutex;
+    std::vector<ThreadLog*> threads;
+
+    std::mutex drainMutex;
+    std::atomic<bool> running;
+    std::thread thread;
+};
+
+struct ThreadLogHolder {
+    ThreadLog* log = nullptr;
+
+    ~ThreadLogHolder() {
+        if (log != nullptr) {
+            log->retired.store(true, std::memory_order_release);
+        }
+    }
+};
+
+static thread_local ThreadLogHolder t_thread_log;
+
+static void stopLogFlusher()
+{
+    LogFlusher::getInstance()->stop();
+}
+
+LogFlusher::LogFlusher()
+    : threadsMutex()
+    , threads()
+    , drainMutex()
+    , running(true)
+    , thread()
+{
+    thread = std::thread(&LogFlusher::loop, this);
+    atexit(stopLogFlusher);
+}
+
+ThreadLog* LogFlusher::getThreadLog()
+{
+    if (t_thread_log.log == nullptr) {
+        ThreadLog* log = new ThreadLog();
+        log->tid = (unsigned long)gettid();
+        log->dropped = 0;
+        log->retired = false;
+
+        std::lock_guard<std::mutex> lock(threadsMutex);
+        threads.push_back(log);
+        t_thread_log.log = log;
+    }
+    return t_thread_log.log;
+}
+
+static void formatRecord(std::string& out, const LogRecord& record)
+{
+    static const char* const kLevelNames[] = {"P", "E", "W", "D"};
+    const char* message = record.overflow != nullptr ? record.overflow : record.message;
+
+    if (record.level == UTILITY_LOG_LEVEL_PRINT) {
+        out += message;
+        return;
+    }
+
+    char prefix[256];
+    snprintf(prefix, sizeof(prefix), "%s/[%llu] (%d) <%lu> %s[%d] %s() ",
+        kLevelNames[record.level], record.time / 1000000, (int)getpid(), record.tid, record.file, record.line, record.func);
+    out += prefix;
+    out += message;
+    out += '\n';
 }
 
+void LogFlusher::drain()
+{
+    std::lock_guard<std::mutex> drainLock(drainMutex);
+
+    std::vector<ThreadLog*> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(threadsMutex);
+        snapshot = threads;
+    }
+
+    // merge the threads by timestamp so interleaved output reads in order
+    std::vector<std::pair<unsigned long long, std::string>> lines;
+    std::vector<ThreadLog*> finished;
+    for (ThreadLog* log : snapshot) {
+        // read retired before draining, a record committed before retiring is then seen below
+        bool retired = log->retired.load(std::memory_order_acquire);
+
+        while (LogRecord* record = log->records.front()) {
+            std::string line;
+            formatRecord(line, *record);
+            lines.emplace_back(record->time, std::move(line));
+            free(record->overflow);
+            log->records.pop();
+        }
+
+        unsigned long dropped = log->dropped.exchange(0);
+        if (dropped > 0) {
+            unsigned long long now = Clock::now();
+            lines.emplace_back(now, "W/ " + std::to_string(dropped) + " log messages dropped on thread " + std::to_string(log->tid) + "\n");
+        }
+
+        if (retired) {
+            finished.push_back(log);
+        }
+    }
+
+    std::stable_sort(lines.begin(), lines.end(), [](const std::pair<unsigned long long, std::string>& a, const std::pair<unsigned long long, std::string>& b) {
+        return a.first < b.first;
+    });
+    for (const auto& line : lines) {
+        fwrite(line.second.data(), 1, line.second.size(), stdout);
+    }
+    if (!lines.empty()) {
+        fflush(stdout);
+    }
+
+    if (!finished.empty()) {
+        std::lock_guard<std::mutex> lock(threadsMutex);
+        for (ThreadLog* log : finished) {
+            threads.erase(std::remove(threads.begin(), threads.end(), log), threads.end());
+            delete log;
+        }
+    }
+}
+
+void LogFlusher::loop()
+{
+    while (running.load(std::memory_order_acquire)) {
+        drain();
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+}
+
+void LogFlusher::stop()
+{
+    if (running.exchange(false)) {
+        thread.join();
+    }
+    drain();
+}
+
+void Logger::write(int level, const char* file, int line, const char* func, const char* format, ...)
+{
+    const unsigned long long time = Clock::now();
+
+    LogFlusher* flusher = LogFlusher::getInstance();
+    ThreadLog* log = flusher->getThreadLog();
+
+    va_list args;
+    va_start(args, format);
+
+    if (!flusher->isRunning()) {
+        // after exit() started, write synchronously
+        LogRecord record = {level, time, log->tid, file, line, func, nullptr, {0}};
+        vsnprintf(record.message, kLogMessageSize, format, args);
+        va_end(args);
+
+        std::string out;
+        formatRecord(out, record);
+        fwrite(out.data(), 1, out.size(), stdout);
+        fflush(stdout);
+        return;
+    }
+
+    LogRecord* record = log->records.claim();
+    if (record == nullptr) {
+        va_end(args);
+        log->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    record->level = level;
+    record->time = time;
+    record->tid = log->tid;
+    record->file = file;
+    record->line = line;
+    record->func = func;
+    record->overflow = nullptr;
+
+    va_list copy;
+    va_copy(copy, args);
+    int length = vsnprintf(record->message, kLogMessageSize, format, args);
+    if (length >= (int)kLogMessageSize) {
+        record->overflow = (char*)malloc(length + 1);
+        vsnprintf(record->overflow, length + 1, format, copy);
+    }
+    va_end(copy);
+    va_end(args);
+
+    log->records.commit();
+}
+
+void Logger::flush()
+{
+    LogFlusher::getInstance()->drain();
+}
+
+} // namespace UTILITY
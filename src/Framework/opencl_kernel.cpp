@@ -0,0 +1,149 @@
+#include "opencl_kernel.h"
+
+#include "opencl_manager.h"
+#include "log.h"
+
+#include <string.h>
+
+namespace CGRA {
+
+OpenclKernel::OpenclKernel(cl_program program, const char* const name)
+	: kernel(nullptr)
+	, name(name)
+	, numArgs(0)
+	, args()
+{
+	cl_int err = CL_SUCCESS;
+	kernel = clCreateKernel(program, name, &err);
+	if (err != CL_SUCCESS) {
+		CGRA_LOGE("clCreateKernel(%s) failed: %d", name, err);
+		kernel = nullptr;
+		return;
+	}
+
+	clGetKernelInfo(kernel, CL_KERNEL_NUM_ARGS, sizeof(cl_uint), &numArgs, NULL);
+	args.resize(numArgs, Argument{false, false, std::vector<unsigned char>()});
+}
+
+OpenclKernel::~OpenclKernel()
+{
+	if (kernel != nullptr) {
+		clReleaseKernel(kernel);
+	}
+}
+
+bool OpenclKernel::setArg(cl_uint index, size_t size, const void* value)
+{
+	if (kernel == nullptr) {
+		return false;
+	}
+
+	if (index >= numArgs) {
+		CGRA_LOGE("%s: argument %u out of range, kernel takes %u", name.c_str(), index, numArgs);
+		return false;
+	}
+
+	Argument& arg = args[index];
+	if (arg.isSet && !arg.isLocal) {
+		if (arg.value.size() != size) {
+			CGRA_LOGE("%s: argument %u was bound with %zu bytes, now %zu", name.c_str(), index, arg.value.size(), size);
+			return false;
+		}
+		if (memcmp(arg.value.data(), value, size) == 0) {
+			return true;
+		}
+	}
+
+	cl_int err = clSetKernelArg(kernel, index, size, value);
+	if (err != CL_SUCCESS) {
+		CGRA_LOGE("%s: clSetKernelArg(%u, %zu) failed: %d", name.c_str(), index, size, err);
+		arg.isSet = false;
+		return false;
+	}
+
+	arg.isSet = true;
+	arg.isLocal = false;
+	arg.value.assign((const unsigned char*)value, (const unsigned char*)value + size);
+	return true;
+}
+
+bool OpenclKernel::setLocalArg(cl_uint index, size_t size)
+{
+	if (kernel == nullptr) {
+		return false;
+	}
+
+	if (index >= numArgs) {
+		CGRA_LOGE("%s: argument %u out of range, kernel takes %u", name.c_str(), index, numArgs);
+		return false;
+	}
+
+	Argument& arg = args[index];
+	if (arg.isSet && arg.isLocal && arg.value.size() == size) {
+		return true;
+	}
+
+	cl_int err = clSetKernelArg(kernel, index, size, NULL);
+	if (err != CL_SUCCESS) {
+		CGRA_LOGE("%s: clSetKernelArg(%u, local %zu) failed: %d", name.c_str(), index, size, err);
+		arg.isSet = false;
+		return false;
+	}
+
+	arg.isSet = true;
+	arg.isLocal = true;
+	arg.value.assign(size, 0);
+	return true;
+}
+
+void OpenclKernel::invalidate()
+{
+	for (Argument& arg : args) {
+		arg.isSet = false;
+		arg.isLocal = false;
+		arg.value.clear();
+	}
+}
+
+void OpenclKernel::replace(cl_kernel newKernel)
+{
+	if (kernel != nullptr) {
+		clReleaseKernel(kernel);
+	}
+
+	kernel = newKernel;
+	numArgs = 0;
+	if (kernel != nullptr) {
+		clGetKernelInfo(kernel, CL_KERNEL_NUM_ARGS, sizeof(cl_uint), &numArgs, NULL);
+	}
+
+	args.clear();
+	args.resize(numArgs, Argument{false, false, std::vector<unsigned char>()});
+}
+
+cl_int OpenclKernel::run(size_t globalWorkSize, cl_event* event)
+{
+	if (event != nullptr) {
+		*event = NULL;
+	}
+
+	if (kernel == nullptr) {
+		return CL_INVALID_VALUE;
+	}
+
+	for (cl_uint i = 0; i < numArgs; i++) {
+		if (!args[i].isSet) {
+			CGRA_LOGE("%s: argument %u is not set", name.c_str(), i);
+			return CL_INVALID_VALUE;
+		}
+	}
+
+	size_t global_work_size[1] = {globalWorkSize};
+	cl_int err = clEnqueueNDRangeKernel(OpenclManager::getInstance()->getCommandQueue(), kernel, 1, NULL, global_work_size, NULL, 0, NULL, event);
+	if (err != CL_SUCCESS) {
+		CGRA_LOGE("%s: clEnqueueNDRangeKernel failed: %d", name.c_str(), err);
+	}
+	return err;
+}
+
+} // namespace CGRA
@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <mutex>
+
 #include "log.h"
 
 namespace CGRA {
@@ -11,10 +13,9 @@ OpenclManager* OpenclManager::_instance = nullptr;
 
 OpenclManager* OpenclManager::getInstance()
 {
-	if (_instance == nullptr) {
-		_instance = new OpenclManager();
-	}
-
+	// the startup build asks for it on its own thread while the owner creates its buffers
+	static std::once_flag created;
+	std::call_once(created, []() { _instance = new OpenclManager(); });
 	return _instance;
 }
 
@@ -28,7 +29,7 @@ OpenclManager::OpenclManager()
 	cl_uint numPlatforms = 0;
 	if (clGetPlatformIDs(0, NULL, &numPlatforms) != CL_SUCCESS)
 	{
-		CGRA_LOGE();
+		CGRA_LOGE("clGetPlatformIDs failed");
 	}
 
 	/**For clarity, choose the first available platform. */
@@ -53,8 +54,8 @@ OpenclManager::OpenclManager()
 	/**Step 3: Create context.*/
 	context = clCreateContext(NULL, 1, devices, NULL, NULL, NULL);
 
-	/**Step 4: Creating command queue associate with the context.*/
-	commandQueue = clCreateCommandQueue(context, devices[0], 0, NULL);
+	/**Step 4: Creating command queue associate with the context, with timestamps for OpenclProfiler.*/
+	commandQueue = clCreateCommandQueue(context, devices[0], CL_QUEUE_PROFILING_ENABLE, NULL);
 
 }
 
@@ -0,0 +1,184 @@
+#include "opencl_profiler.h"
+
+#include "log.h"
+#include "trace.h"
+
+#include <stdio.h>
+
+namespace CGRA {
+
+/**How many raw records are kept for getRecords() and dump().*/
+static const size_t kMaxRecords = 1024;
+
+/**Events record() holds before it reads back the completed ones itself, for callers that never collect().*/
+static const size_t kMaxPending = 256;
+
+OpenclProfiler* OpenclProfiler::_instance = nullptr;
+
+OpenclProfiler* OpenclProfiler::getInstance()
+{
+	if (_instance == nullptr) {
+		_instance = new OpenclProfiler();
+	}
+
+	return _instance;
+}
+
+OpenclProfiler::OpenclProfiler()
+	: mutex()
+	, enabled(true)
+	, pending()
+	, stages()
+	, records()
+{
+
+}
+
+OpenclProfiler::~OpenclProfiler()
+{
+	for (Pending& it : pending) {
+		clReleaseEvent(it.event);
+	}
+}
+
+void OpenclProfiler::record(const char* const stage, cl_event event)
+{
+	if (!enabled || event == NULL) {
+		return;
+	}
+
+	clRetainEvent(event);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	pending.push_back(Pending{stage, event, Tracer::now()});
+	if (pending.size() <= kMaxPending) {
+		return;
+	}
+
+	collectLocked();
+	if (pending.size() > kMaxPending) {
+		// a queue this far behind loses the timings of its oldest commands rather than growing without bound
+		const size_t dropped = pending.size() - kMaxPending;
+		for (size_t i = 0; i < dropped; i++) {
+			clReleaseEvent(pending[i].event);
+		}
+		pending.erase(pending.begin(), pending.begin() + dropped);
+	}
+}
+
+void OpenclProfiler::collect()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	collectLocked();
+}
+
+void OpenclProfiler::collectLocked()
+{
+	size_t kept = 0;
+	for (size_t i = 0; i < pending.size(); i++) {
+		cl_int status = CL_COMPLETE;
+		clGetEventInfo(pending[i].event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL);
+		if (status > CL_COMPLETE) {
+			// still queued, submitted or running
+			pending[kept++] = pending[i];
+			continue;
+		}
+
+		Record record = {pending[i].stage, 0, 0, 0, 0};
+		cl_int err = clGetEventProfilingInfo(pending[i].event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &record.queued, NULL);
+		err |= clGetEventProfilingInfo(pending[i].event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &record.submit, NULL);
+		err |= clGetEventProfilingInfo(pending[i].event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &record.start, NULL);
+		err |= clGetEventProfilingInfo(pending[i].event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &record.end, NULL);
+		clReleaseEvent(pending[i].event);
+
+		if (err != CL_SUCCESS || status < 0) {
+			// failed command, or a queue created without CL_QUEUE_PROFILING_ENABLE
+			continue;
+		}
+
+		auto it = stages.find(record.stage);
+		if (it == stages.end()) {
+			it = stages.insert({record.stage, Stage{record.stage, 0, 0, 0, 0, (cl_ulong)-1, 0, 0}}).first;
+		}
+
+		Stage& stage = it->second;
+		cl_ulong execute = record.end - record.start;
+		stage.count++;
+		stage.totalQueued += record.submit - record.queued;
+		stage.totalSubmit += record.start - record.submit;
+		stage.totalExecute += execute;
+		stage.minExecute = execute < stage.minExecute ? execute : stage.minExecute;
+		stage.maxExecute = execute > stage.maxExecute ? execute : stage.maxExecute;
+		stage.lastExecute = execute;
+
+		Tracer* tracer = Tracer::getInstance();
+		if (tracer->isEnabled()) {
+			tracer->addDeviceEvent(tracer->intern(record.stage), pending[i].hostTime + (record.start - record.queued), execute);
+		}
+
+		records.push_back(record);
+		if (records.size() > kMaxRecords) {
+			records.pop_front();
+		}
+	}
+	pending.resize(kept);
+}
+
+std::vector<OpenclProfiler::Stage> OpenclProfiler::getStages()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::vector<Stage> result;
+	for (auto& it : stages) {
+		result.push_back(it.second);
+	}
+	return result;
+}
+
+std::vector<OpenclProfiler::Record> OpenclProfiler::getRecords()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return std::vector<Record>(records.begin(), records.end());
+}
+
+void OpenclProfiler::reset()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	stages.clear();
+	records.clear();
+}
+
+bool OpenclProfiler::dump(const char* const path)
+{
+	std::vector<Stage> stageList = getStages();
+	std::vector<Record> recordList = getRecords();
+
+	FILE* file = fopen(path, "w");
+	if (file == nullptr) {
+		CGRA_LOGE("cannot open %s", path);
+		return false;
+	}
+
+	fprintf(file, "{\n  \"unit\": \"ns\",\n  \"stages\": [");
+	for (size_t i = 0; i < stageList.size(); i++) {
+		const Stage& stage = stageList[i];
+		fprintf(file, "%s\n    {\"name\": \"%s\", \"count\": %lu, \"queued\": %llu, \"submit\": %llu, \"execute\": %llu, \"min\": %llu, \"max\": %llu}",
+			i == 0 ? "" : ",", stage.name.c_str(), stage.count,
+			(unsigned long long)stage.totalQueued, (unsigned long long)stage.totalSubmit, (unsigned long long)stage.totalExecute,
+			(unsigned long long)stage.minExecute, (unsigned long long)stage.maxExecute);
+	}
+	fprintf(file, "\n  ],\n  \"records\": [");
+	for (size_t i = 0; i < recordList.size(); i++) {
+		const Record& record = recordList[i];
+		fprintf(file, "%s\n    {\"stage\": \"%s\", \"queued\": %llu, \"submit\": %llu, \"start\": %llu, \"end\": %llu}",
+			i == 0 ? "" : ",", record.stage.c_str(),
+			(unsigned long long)record.queued, (unsigned long long)record.submit, (unsigned long long)record.start, (unsigned long long)record.end);
+	}
+	fprintf(file, "\n  ]\n}\n");
+
+	fclose(file);
+	CGRA_LOGD("profile written to %s", path);
+	return true;
+}
+
+} // namespace CGRA
@@ -3,62 +3,284 @@
 #include "opencl_manager.h"
 #include "log.h"
 
+#include <chrono>
 #include <string>
+#include <vector>
 #include <iostream>
 
 namespace CGRA {
 
-OpenclTask::OpenclTask(const char* const fileAddress)
-	: program()
+OpenclTask::OpenclTask(const char* const fileAddress, const std::string& options)
+	: sourcePath(fileAddress)
+	, program(nullptr)
+	, programOptions(options)
+	, startupBuild()
+	, kernels()
+	, reloadMutex()
+	, buildOptions(options)
+	, pendingProgram(nullptr)
+	, pendingOptions()
+	, buildLog()
+	, watcher(nullptr)
+	, optionsBuild()
+	, optionsBuilding(false)
 {
-	/**Step 5: Create program object */
-	std::string fileContent = "";
+	std::string path = sourcePath;
+	startupBuild = std::async(std::launch::async, [path, options]() {
+		unsigned long start = us_ticker_read();
+
+		BuildResult result;
+		result.program = buildProgram(path.c_str(), options, result.log);
+
+		CGRA_LOGD("built %s in %lu ms", path.c_str(), (us_ticker_read() - start) / 1000);
+		return result;
+	});
+}
 
-	int size = 1;
+void OpenclTask::finishBuild()
+{
+	BuildResult result = startupBuild.get();
+	program = result.program;
 
+	std::lock_guard<std::mutex> lock(reloadMutex);
+	buildLog = result.log;
+}
+
+bool OpenclTask::isBuilt()
+{
+	if (startupBuild.valid() && startupBuild.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+		finishBuild();
+	}
+
+	return !startupBuild.valid();
+}
+
+bool OpenclTask::waitForBuild()
+{
+	if (startupBuild.valid()) {
+		finishBuild();
+	}
+
+	return program != nullptr;
+}
+
+cl_program OpenclTask::buildProgram(const char* const fileAddress, const std::string& options, std::string& log)
+{
+	/**Step 5: Create program object */
 	FILE* file = fopen(fileAddress, "r");
-    if (file == nullptr) {
-        CGRA_LOGE("file == nullptr");
-    }
-    else {
-        CGRA_LOGD("path: %s", fileAddress);
-        fseek(file, 0L, SEEK_END);
-        size = ftell(file);
-        fseek(file, 0L, SEEK_SET);
-    }
-
-    char* _data = (char*)malloc((size + 1) * sizeof(uint8_t));
-    _data[size] = '\0';
-    fread(_data, sizeof(uint8_t), size, file);
-
-	const char *source = _data;
-	size_t sourceSize[] = {(size_t)fileContent.size()};
-	program = clCreateProgramWithSource(OpenclManager::getInstance()->getContent(), 1, &source, sourceSize, NULL);
+	if (file == nullptr) {
+		CGRA_LOGE("file == nullptr");
+		log = std::string("cannot open ") + fileAddress;
+		return nullptr;
+	}
+
+	CGRA_LOGD("path: %s", fileAddress);
+	fseek(file, 0L, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0L, SEEK_SET);
+
+	std::string fileContent(size, '\0');
+	size = fread(&fileContent[0], sizeof(uint8_t), size, file);
+	fileContent.resize(size);
+	fclose(file);
+
+	const char *source = fileContent.c_str();
+	size_t sourceSize[] = {fileContent.size()};
+	cl_program newProgram = clCreateProgramWithSource(OpenclManager::getInstance()->getContent(), 1, &source, sourceSize, NULL);
 
 	/**Step 6: Build program. */
-	uint32_t err = clBuildProgram(program, 1, OpenclManager::getInstance()->getDevices(), NULL, NULL, NULL);
-	if (err != 0) {
+	cl_int err = clBuildProgram(newProgram, 1, OpenclManager::getInstance()->getDevices(), options.c_str(), NULL, NULL);
+	if (err != CL_SUCCESS) {
 		size_t logSize;
 
-		clGetProgramBuildInfo(program, *OpenclManager::getInstance()->getDevices(), CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
-		char* log = nullptr;
-		log = (char*)malloc((logSize+1)*sizeof(char));
-		log[logSize] = '\0';
-		clGetProgramBuildInfo(program, *OpenclManager::getInstance()->getDevices(), CL_PROGRAM_BUILD_LOG, logSize, log, NULL);
+		clGetProgramBuildInfo(newProgram, *OpenclManager::getInstance()->getDevices(), CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+		log.assign(logSize, '\0');
+		clGetProgramBuildInfo(newProgram, *OpenclManager::getInstance()->getDevices(), CL_PROGRAM_BUILD_LOG, logSize, &log[0], NULL);
 
-		CGRA_LOGE("LOG:\n%s\n\n", log);
-		free(log);
+		CGRA_LOGE("LOG:\n%s\n\n", log.c_str());
+		clReleaseProgram(newProgram);
+		return nullptr;
 	}
+
+	log.clear();
+	return newProgram;
 }
 
 void OpenclTask::run() {
 
 }
 
+OpenclKernel* OpenclTask::getKernel(const char* const name)
+{
+	waitForBuild();
+
+	auto it = kernels.find(name);
+	if (it != kernels.end()) {
+		return it->second;
+	}
+
+	OpenclKernel* kernel = new OpenclKernel(program, name);
+	kernels[name] = kernel;
+	return kernel;
+}
+
+void OpenclTask::enableHotReload()
+{
+	if (watcher == nullptr) {
+		watcher = new FileWatcher(sourcePath.c_str(), [this]() { onSourceChanged(); });
+	}
+}
+
+std::string OpenclTask::onSourceChanged()
+{
+	std::string options;
+	{
+		std::lock_guard<std::mutex> lock(reloadMutex);
+		options = buildOptions;
+	}
+	CGRA_LOGD("rebuilding %s %s", sourcePath.c_str(), options.c_str());
+
+	std::string log;
+	cl_program newProgram = buildProgram(sourcePath.c_str(), options, log);
+
+	std::lock_guard<std::mutex> lock(reloadMutex);
+	if (newProgram == nullptr) {
+		buildLog = log;
+		return options;
+	}
+
+	if (pendingProgram != nullptr) {
+		clReleaseProgram(pendingProgram);
+	}
+	pendingProgram = newProgram;
+	pendingOptions = options;
+	return options;
+}
+
+void OpenclTask::setBuildOptions(const std::string& options)
+{
+	{
+		std::lock_guard<std::mutex> lock(reloadMutex);
+		if (options == buildOptions) {
+			return;
+		}
+		buildOptions = options;
+
+		// a rebuild still running builds again with these once it is done, the caller never waits for a compile
+		if (optionsBuilding) {
+			return;
+		}
+		optionsBuilding = true;
+	}
+
+	// the last rebuild has cleared optionsBuilding, so at most it is just returning
+	waitForRebuild();
+	optionsBuild = std::async(std::launch::async, [this]() {
+		while (true) {
+			const std::string built = onSourceChanged();
+			std::lock_guard<std::mutex> lock(reloadMutex);
+			if (built == buildOptions) {
+				optionsBuilding = false;
+				return;
+			}
+		}
+	});
+}
+
+void OpenclTask::waitForRebuild()
+{
+	if (optionsBuild.valid()) {
+		optionsBuild.get();
+	}
+}
+
+bool OpenclTask::update()
+{
+	if (!isBuilt()) {
+		return false;
+	}
+
+	cl_program newProgram = nullptr;
+	std::string newOptions;
+	{
+		std::lock_guard<std::mutex> lock(reloadMutex);
+		newProgram = pendingProgram;
+		newOptions = pendingOptions;
+		pendingProgram = nullptr;
+	}
+
+	if (newProgram == nullptr) {
+		return false;
+	}
+
+	/**Create every kernel in use first, so a missing one leaves the old program untouched.*/
+	std::vector<cl_kernel> newKernels;
+	for (auto& it : kernels) {
+		cl_int err = CL_SUCCESS;
+		cl_kernel kernel = clCreateKernel(newProgram, it.first.c_str(), &err);
+		if (err != CL_SUCCESS) {
+			CGRA_LOGE("reloaded program has no kernel %s: %d", it.first.c_str(), err);
+			for (cl_kernel created : newKernels) {
+				clReleaseKernel(created);
+			}
+			clReleaseProgram(newProgram);
+
+			std::lock_guard<std::mutex> lock(reloadMutex);
+			buildLog = "missing kernel " + it.first;
+			return false;
+		}
+		newKernels.push_back(kernel);
+	}
+
+	size_t i = 0;
+	for (auto& it : kernels) {
+		it.second->replace(newKernels[i++]);
+	}
+
+	if (program != nullptr) {
+		clReleaseProgram(program);
+	}
+	program = newProgram;
+	programOptions = newOptions;
+
+	{
+		std::lock_guard<std::mutex> lock(reloadMutex);
+		buildLog.clear();
+	}
+
+	CGRA_LOGD("reloaded %s", sourcePath.c_str());
+	return true;
+}
+
+std::string OpenclTask::getBuildLog()
+{
+	std::lock_guard<std::mutex> lock(reloadMutex);
+	return buildLog;
+}
+
 OpenclTask::~OpenclTask()
 {
-	clReleaseProgram(program);
+	/**Stop the watcher and the startup build first, they may still be building.*/
+	delete watcher;
+	watcher = nullptr;
+	waitForRebuild();
+
+	if (startupBuild.valid()) {
+		finishBuild();
+	}
+
+	for (auto& it : kernels) {
+		delete it.second;
+	}
+	kernels.clear();
+
+	if (pendingProgram != nullptr) {
+		clReleaseProgram(pendingProgram);
+	}
+
+	if (program != nullptr) {
+		clReleaseProgram(program);
+	}
 }
 
 } // namespace CGRA
-
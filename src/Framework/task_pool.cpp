@@ -0,0 +1,153 @@
+#include "task_pool.h"
+
+#include "trace.h"
+
+#include <algorithm>
+#include <string>
+
+namespace CGRA {
+
+/**Index of the worker the thread is, -1 outside the pool.*/
+static thread_local int tWorker = -1;
+
+TaskPool* TaskPool::_instance = nullptr;
+
+TaskPool* TaskPool::getInstance()
+{
+	static std::once_flag created;
+	std::call_once(created, []() { _instance = new TaskPool(); });
+	return _instance;
+}
+
+TaskPool::TaskPool()
+	: queues(std::max(1u, std::thread::hardware_concurrency()))
+	, workers()
+	, sleepMutex()
+	, wakeup()
+	, queued(0)
+	, stop(false)
+{
+	for (size_t i = 0; i + 1 < queues.size(); i++) {
+		workers.emplace_back([this, i]() { loop((int)i); });
+	}
+}
+
+TaskPool::~TaskPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stop = true;
+	}
+	wakeup.notify_all();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+}
+
+void TaskPool::loop(int worker)
+{
+	tWorker = worker;
+	Tracer::getInstance()->setThreadName(("task pool " + std::to_string(worker)).c_str());
+
+	while (true) {
+		Task task;
+		if (acquire(worker, task)) {
+			execute(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		wakeup.wait(lock, [this]() { return stop || queued.load() > 0; });
+		if (stop) {
+			return;
+		}
+	}
+}
+
+int TaskPool::getQueue() const
+{
+	return tWorker >= 0 ? tWorker : (int)queues.size() - 1;
+}
+
+void TaskPool::run(Group& group, std::function<void()> task)
+{
+	group.pending.fetch_add(1);
+	Queue& queue = queues[getQueue()];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.push_back({std::move(task), &group});
+	}
+	queued.fetch_add(1);
+
+	// a worker checks queued under sleepMutex before it sleeps, so it cannot miss this
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+	}
+	wakeup.notify_one();
+}
+
+bool TaskPool::acquire(int own, Task& task)
+{
+	{
+		Queue& queue = queues[own];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty()) {
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+			queued.fetch_sub(1);
+			return true;
+		}
+	}
+
+	for (size_t i = 1; i < queues.size(); i++) {
+		Queue& queue = queues[(own + i) % queues.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty()) {
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+			queued.fetch_sub(1);
+			return true;
+		}
+	}
+	return false;
+}
+
+void TaskPool::execute(Task& task)
+{
+	task.work();
+	task.group->pending.fetch_sub(1, std::memory_order_release);
+}
+
+void TaskPool::wait(Group& group)
+{
+	while (group.pending.load(std::memory_order_acquire) > 0) {
+		Task task;
+		if (acquire(getQueue(), task)) {
+			execute(task);
+		}
+		else {
+			std::this_thread::yield();
+		}
+	}
+}
+
+void TaskPool::parallelFor(int count, int grain, const std::function<void(int begin, int end)>& work)
+{
+	// a few ranges per thread, so the stealing evens out uneven ones
+	const int ranges = std::min(4 * getThreadCount(), count / std::max(1, grain));
+	if (ranges <= 1) {
+		work(0, count);
+		return;
+	}
+
+	Group group;
+	for (int i = 1; i < ranges; i++) {
+		const int begin = (int)((int64_t)count * i / ranges);
+		const int end = (int)((int64_t)count * (i + 1) / ranges);
+		run(group, [&work, begin, end]() { work(begin, end); });
+	}
+	work(0, (int)((int64_t)count / ranges));
+	wait(group);
+}
+
+} // namespace CGRA
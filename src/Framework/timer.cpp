@@ -0,0 +1,210 @@
+#include "timer.h"
+
+#include <chrono>
+#include <string.h>
+#include <stdio.h>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define UTILITY_HAS_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#endif
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+namespace UTILITY {
+
+uint64_t Clock::raw()
+{
+#ifdef _WIN32
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+struct ClockEpoch {
+	uint64_t monotonic;
+	uint64_t wall;
+};
+
+/**Function-local so it is initialised on first use, whatever the static initialisation order.*/
+static const ClockEpoch& epoch(uint64_t (*raw)())
+{
+	static const ClockEpoch value = {
+		raw(),
+		(uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count()
+	};
+	return value;
+}
+
+uint64_t Clock::now()
+{
+	// the epoch first, on the very first call it is taken now
+	const uint64_t start = epoch(raw).monotonic;
+	return raw() - start;
+}
+
+uint64_t Clock::epochWallTime()
+{
+	return epoch(raw).wall;
+}
+
+bool Clock::hasTsc()
+{
+#ifdef UTILITY_HAS_X86
+	static const bool invariant = []() {
+#if defined(_MSC_VER)
+		int info[4] = {0};
+		__cpuid(info, 0x80000000);
+		if ((unsigned)info[0] < 0x80000007u) {
+			return false;
+		}
+		__cpuid(info, 0x80000007);
+		return (info[3] & (1 << 8)) != 0;
+#else
+		unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+		if (__get_cpuid_max(0x80000000, nullptr) < 0x80000007u) {
+			return false;
+		}
+		__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+		return (edx & (1 << 8)) != 0;
+#endif
+	}();
+	return invariant;
+#else
+	return false;
+#endif
+}
+
+uint64_t Clock::ticks()
+{
+#ifdef UTILITY_HAS_X86
+	if (hasTsc()) {
+		return __rdtsc();
+	}
+#endif
+	return now();
+}
+
+uint64_t Clock::ticksToNs(uint64_t ticks)
+{
+	if (!hasTsc()) {
+		return ticks;
+	}
+
+	// measure the TSC rate against the monotonic clock once
+	static const double nsPerTick = []() {
+		const uint64_t ns0 = now();
+		const uint64_t tick0 = Clock::ticks();
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		const uint64_t ns1 = now();
+		const uint64_t tick1 = Clock::ticks();
+		return (double)(ns1 - ns0) / (double)(tick1 - tick0);
+	}();
+	return (uint64_t)(ticks * nsPerTick);
+}
+
+Histogram::Histogram()
+{
+	reset();
+}
+
+void Histogram::reset()
+{
+	memset(buckets, 0, sizeof(buckets));
+	count = 0;
+	sum = 0;
+	min = UINT64_MAX;
+	max = 0;
+}
+
+int Histogram::bucketOf(uint64_t ns)
+{
+	if (ns < (uint64_t)kSubBuckets) {
+		return (int)ns;
+	}
+
+	// position of the highest bit selects the power of two, the next kSubBits bits the sub-bucket
+#if defined(_MSC_VER)
+	int high = 63;
+	while ((ns >> high) == 0) {
+		high--;
+	}
+#else
+	int high = 63 - __builtin_clzll(ns);
+#endif
+	int shift = high - kSubBits;
+	int sub = (int)((ns >> shift) & (kSubBuckets - 1));
+	return (shift + 1) * kSubBuckets + sub;
+}
+
+uint64_t Histogram::valueOf(int bucket)
+{
+	if (bucket < kSubBuckets) {
+		return bucket;
+	}
+
+	int shift = bucket / kSubBuckets - 1;
+	int sub = bucket % kSubBuckets;
+	// middle of the bucket
+	uint64_t low = ((uint64_t)(kSubBuckets + sub)) << shift;
+	return low + ((1ull << shift) >> 1);
+}
+
+void Histogram::record(uint64_t ns)
+{
+	buckets[bucketOf(ns)]++;
+	count++;
+	sum += ns;
+	min = ns < min ? ns : min;
+	max = ns > max ? ns : max;
+}
+
+void Histogram::merge(const Histogram& other)
+{
+	for (int i = 0; i < kBuckets; i++) {
+		buckets[i] += other.buckets[i];
+	}
+	count += other.count;
+	sum += other.sum;
+	min = other.min < min ? other.min : min;
+	max = other.max > max ? other.max : max;
+}
+
+uint64_t Histogram::percentile(double p) const
+{
+	if (count == 0) {
+		return 0;
+	}
+
+	uint64_t rank = (uint64_t)(p / 100.0 * (count - 1) + 0.5) + 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < kBuckets; i++) {
+		seen += buckets[i];
+		if (seen >= rank) {
+			uint64_t value = valueOf(i);
+			return value < min ? min : (value > max ? max : value);
+		}
+	}
+	return max;
+}
+
+std::string Histogram::summary() const
+{
+	char text[160];
+	snprintf(text, sizeof(text), "n %llu mean %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f ms",
+		(unsigned long long)count, getMean() * 1e-6, percentile(50) * 1e-6, percentile(90) * 1e-6, percentile(99) * 1e-6, getMax() * 1e-6);
+	return text;
+}
+
+} // namespace UTILITY
@@ -0,0 +1,158 @@
+#include "trace.h"
+
+#include "log.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+namespace CGRA {
+
+/**Created during static initialisation, before any thread can race on getInstance().*/
+Tracer* Tracer::_instance = Tracer::getInstance();
+
+Tracer* Tracer::getInstance()
+{
+	if (_instance == nullptr) {
+		_instance = new Tracer();
+	}
+
+	return _instance;
+}
+
+Tracer::Tracer()
+	: enabled(false)
+	, mutex()
+	, threads()
+	, device()
+	, names()
+{
+	device.tid = 0;
+	device.name = "OpenCL device";
+}
+
+Tracer::~Tracer()
+{
+	for (ThreadBuffer* buffer : threads) {
+		delete buffer;
+	}
+}
+
+unsigned long long Tracer::now()
+{
+	return UTILITY::Clock::now();
+}
+
+void Tracer::start()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for (ThreadBuffer* buffer : threads) {
+		std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+		buffer->events.clear();
+	}
+	{
+		std::lock_guard<std::mutex> bufferLock(device.mutex);
+		device.events.clear();
+	}
+	enabled = true;
+}
+
+void Tracer::stop()
+{
+	enabled = false;
+}
+
+Tracer::ThreadBuffer* Tracer::getThreadBuffer()
+{
+	thread_local ThreadBuffer* buffer = nullptr;
+	if (buffer == nullptr) {
+		std::lock_guard<std::mutex> lock(mutex);
+		buffer = new ThreadBuffer();
+		buffer->tid = threads.size() + 1;
+		buffer->name = "thread " + std::to_string(buffer->tid);
+		threads.push_back(buffer);
+	}
+	return buffer;
+}
+
+void Tracer::addHostEvent(const char* const name, unsigned long long begin, unsigned long long duration)
+{
+	ThreadBuffer* buffer = getThreadBuffer();
+	std::lock_guard<std::mutex> lock(buffer->mutex);
+	buffer->events.push_back(Event{name, begin, duration});
+}
+
+void Tracer::addDeviceEvent(const char* const name, unsigned long long begin, unsigned long long duration)
+{
+	std::lock_guard<std::mutex> lock(device.mutex);
+	device.events.push_back(Event{name, begin, duration});
+}
+
+void Tracer::setThreadName(const char* const name)
+{
+	ThreadBuffer* buffer = getThreadBuffer();
+	std::lock_guard<std::mutex> lock(buffer->mutex);
+	buffer->name = name;
+}
+
+const char* Tracer::intern(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return names.insert(name).first->c_str();
+}
+
+static void writeThread(FILE* file, int pid, int tid, const std::string& threadName, bool& first)
+{
+	fprintf(file, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+		first ? "" : ",", pid, tid, threadName.c_str());
+	first = false;
+}
+
+static void writeEvent(FILE* file, int pid, int tid, const char* category, const char* name, unsigned long long begin, unsigned long long duration)
+{
+	// trace-event timestamps are microseconds, keep the nanoseconds as decimals
+	fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %llu.%03llu, \"dur\": %llu.%03llu}",
+		name, category, pid, tid, begin / 1000, begin % 1000, duration / 1000, duration % 1000);
+}
+
+bool Tracer::write(const char* const path)
+{
+	FILE* file = fopen(path, "w");
+	if (file == nullptr) {
+		CGRA_LOGE("cannot open %s", path);
+		return false;
+	}
+
+	const int pid = getpid();
+	bool first = true;
+	size_t count = 0;
+
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (ThreadBuffer* buffer : threads) {
+		std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+		writeThread(file, pid, buffer->tid, buffer->name, first);
+		for (const Event& event : buffer->events) {
+			writeEvent(file, pid, buffer->tid, "host", event.name, event.begin, event.duration);
+		}
+		count += buffer->events.size();
+	}
+
+	{
+		std::lock_guard<std::mutex> bufferLock(device.mutex);
+		writeThread(file, pid, device.tid, device.name, first);
+		for (const Event& event : device.events) {
+			writeEvent(file, pid, device.tid, "device", event.name, event.begin, event.duration);
+		}
+		count += device.events.size();
+	}
+
+	fprintf(file, "\n]}\n");
+	fclose(file);
+
+	CGRA_LOGD("%zu trace events written to %s", count, path);
+	return true;
+}
+
+} // namespace CGRA
@@ -14,93 +14,392 @@ struct HitRecord {
     float3 pos;
     float3 normal;
     float t;
+    int material; // into the materials of the scene
 };
 
-struct Sphere{
-    float radius;
-    float3 pos;
+// Depth of a primary ray that leaves the scene, as far as the hit tests look.
+__constant float kFarDepth = 9999.0f;
+
+// Spheres are stored as structure-of-arrays blocks of four, one float4 per
+// coordinate, so the hit test runs on a block at a time and the hot loop
+// loads nothing but geometry. A lane with radius 0 is padding. Every BVH
+// leaf is one block. Shading data lives apart in Material, indexed by the
+// sphere's index in the scene, and is only read for the closest hit.
+#define SPHERE_BLOCK 4
+
+struct SphereBlock {
+    float4 x;
+    float4 y;
+    float4 z;
+    float4 radius;
+};
+
+// material types, also the ids in AOV_MATERIAL_ID, -1 for a miss
+#define MATERIAL_DIFFUSE 0
+#define MATERIAL_MIRROR 1
+#define MATERIAL_LIGHT 2
+
+struct Material {
     float3 color;
-    bool is_light;
+    int type;
+};
+
+// Four-wide BVH node, one 64-byte cache line, built by the host (Bvh::Node).
+// Both levels use it: in a bottom-level tree a leaf is a SphereBlock, in the
+// top-level one BVH_WIDTH instances.
+// The children's boxes are quantised to 8 bits per plane: a child spans
+// origin + lo * step to origin + hi * step on every axis, with step a power
+// of two stored as a float's biased exponent. A child of -1 or below is the
+// leaf ~child, BVH_EMPTY an unused slot.
+#define BVH_EMPTY (-2147483647 - 1)
+#define BVH_WIDTH 4
+
+struct BvhNode {
+    int4 child;
+    float origin_x;
+    float origin_y;
+    float origin_z;
+    uchar4 exponent;
+    uchar4 lo_x;
+    uchar4 lo_y;
+    uchar4 lo_z;
+    uchar4 hi_x;
+    uchar4 hi_y;
+    uchar4 hi_z;
+    int2 padding;
 };
 
+// Renderer::kBvhStackSize, which the host checks every scene against: a walk
+// needs 3 entries per level and one more, for the top level and the deepest
+// object together. A fuller stack would drop nodes.
+#define BVH_STACK_SIZE 64
+
+// An object placed in the world, built by the host (Renderer::InstanceData).
+// Rays are moved into the object's space with world_to_object; their
+// direction is not renormalised, so distances along them stay the world's
+// and hits of different instances compare directly.
+struct Instance {
+    float4 world_to_object[3];
+    int root;             // of the object's tree, -1 for an unused lane of a leaf
+    int first_sphere;     // the object's, in the numbering of sphere ids
+    int primitive_offset; // the primitive_id of the instance's first sphere
+    int padding;
+};
+
+// Set by the host, Renderer::CameraData has the same layout. right and up
+// are unit vectors; the image spans tan_half_fov vertically either side of
+// forward. With an aperture above 0 the rays start on a lens of that
+// diameter and meet again at focus_distance along forward.
 struct Camera {
     float3 pos;
-    float3 look_at;
-    float left_botton_corner;
+    float3 forward;
+    float3 right;
+    float3 up;
+    float tan_half_fov;
+    float aperture;
+    float focus_distance;
 };
 
-struct Ray getRay(struct Camera camera, int width, int height, __global float* random_buffer)
+// The three random numbers of a sample, drawn from a PCG hash chain seeded
+// per pixel from the launch's host seed, so a launch costs the host one
+// number however many pixels it traces.
+uint pcg_hash(uint v)
 {
-    const int index = get_global_id(0);
-    const float3 _UP_RIGHT_  = (float3)(0.0, 1.0, 0.0);
-    float random_x = random_buffer[3 * get_global_id(0) + 0];
-    float random_y = random_buffer[3 * get_global_id(0) + 1];
+    uint state = v * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
 
-    int x = index % width;
-    int y = index / width;
-    float fx = (float)x + (random_x - 0.5);
-    float fy = (float)y + (random_y - 0.5);
+float random_float(uint* state)
+{
+    *state = pcg_hash(*state);
+    return (float)(*state >> 8) * (1.0f / 16777216.0f);
+}
+
+uint seed_pixel(const uint seed, const int pixel)
+{
+    return pcg_hash(seed ^ pcg_hash((uint)pixel));
+}
+
+float3 next_random(uint* state)
+{
+    float3 random;
+    random.x = random_float(state);
+    random.y = random_float(state);
+    random.z = random_float(state);
+    return random;
+}
+
+// Direction through the image point (fx, fy) in pixels, the centre of pixel
+// (x, y) is at (x, y).
+float3 camera_direction(const struct Camera camera, float fx, float fy, int width, int height)
+{
     fx = fx / (float)width;
     fy = fy / (float)height;
 
-    
-
     float aspect_ratio = (float)(width) / (float)(height);
     fx = (fx - 0.5f) * aspect_ratio;
     fy = fy - 0.5f;
 
-    float3 front = normalize(camera.look_at - camera.pos);
-    float3 left = cross(_UP_RIGHT_, front);
-    float3 top = cross(front, left);
+    return normalize(camera.forward + 2 * camera.tan_half_fov * (fx * camera.right + fy * camera.up));
+}
+
+// The inverse of camera_direction(): where world lands on the image, false
+// behind the camera.
+bool camera_project(const struct Camera camera, const float3 world, int width, int height, float2* pixel)
+{
+    const float3 offset = world - camera.pos;
+    const float z = dot(offset, camera.forward);
+    if (z <= 1e-4f) {
+        return false;
+    }
+
+    // on the image plane one unit in front, where camera_direction() puts it
+    const float3 plane = offset / z;
+    float aspect_ratio = (float)(width) / (float)(height);
+    const float fx = dot(plane, camera.right) / (2 * camera.tan_half_fov) / aspect_ratio + 0.5f;
+    const float fy = dot(plane, camera.up) / (2 * camera.tan_half_fov) + 0.5f;
+    *pixel = (float2)(fx * width, fy * height);
+    return true;
+}
+
+// A pinhole camera uses no random numbers beyond the pixel jitter, so it
+// renders what it did before the lens; the lens draws two more from state.
+struct Ray getRay(const struct Camera camera, const int index, int width, int height, const float3 random, uint* state)
+{
+    float random_x = random.x;
+    float random_y = random.y;
+
+    int x = index % width;
+    int y = index / width;
+    float fx = (float)x + (random_x - 0.5);
+    float fy = (float)y + (random_y - 0.5);
 
-    // float3 pixel_pos = (float3)(2 * fx + camera.look_at.x, 2 * fy + camera.look_at.y, camera.look_at.z);
-    float3 pixel_pos = camera.pos + front + 2 * fx * left + 2 * fy * top;
     struct Ray ray;
     ray.origin = camera.pos;
-    ray.dir = normalize(pixel_pos - camera.pos);
+    ray.dir = camera_direction(camera, fx, fy, width, height);
     ray.weight = (float3)(1.0,1.0,1.0);
-    // ray.weight = (float3)(0.0,0.0,0.0);
+
+    if (camera.aperture > 0.0f) {
+        // thin lens: every ray through the pixel meets at its point on the focal plane
+        const float3 focus = camera.pos + ray.dir * (camera.focus_distance / dot(ray.dir, camera.forward));
+        const float radius = 0.5f * camera.aperture * sqrt(random_float(state));
+        const float angle = 2.0f * M_PI_F * random_float(state);
+        ray.origin = camera.pos + radius * (cos(angle) * camera.right + sin(angle) * camera.up);
+        ray.dir = normalize(focus - ray.origin);
+    }
     return ray;
 }
 
 
 
-bool hit_sphere(const struct Ray r, const struct Sphere sphere, const float t_min, const float t_max, struct HitRecord* record)
+float lane(const float4 v, const int i)
 {
-    float3 oc = r.origin - sphere.pos;
-    float a = dot(r.dir, r.dir);
-    float b = 2.0 * dot(oc, r.dir);
-    float c = dot(oc, oc) - sphere.radius * sphere.radius;
-    float discriminant = b*b - 4*a*c;
-    if (discriminant > 0) {
-        float root = sqrt(discriminant);
-		float temp = (- b - root) / (2 * a);
-		if (temp < t_max && temp > t_min) {
-            record->pos = RayAt(r, temp);
-            record->t = temp;
-            record->normal = normalize(record->pos - sphere.pos);
-            return true;
+    return i == 0 ? v.x : i == 1 ? v.y : i == 2 ? v.z : v.w;
+}
+
+int lane_int(const int4 v, const int i)
+{
+    return i == 0 ? v.x : i == 1 ? v.y : i == 2 ? v.z : v.w;
+}
+
+// Nearest hit of r in (t_min, t_max) with the four spheres of block, the
+// near root if it is in range and the far one otherwise, as one float4 per
+// step. Returns the lane, -1 for none; ties go to the lower lane.
+int hit_sphere_block(const struct Ray r, __global const struct SphereBlock* block, const float t_min, const float t_max, float* t)
+{
+    const float4 ocx = r.origin.x - block->x;
+    const float4 ocy = r.origin.y - block->y;
+    const float4 ocz = r.origin.z - block->z;
+    const float a = dot(r.dir, r.dir);
+    const float4 b = 2.0f * (ocx * r.dir.x + ocy * r.dir.y + ocz * r.dir.z);
+    const float4 c = ocx * ocx + ocy * ocy + ocz * ocz - block->radius * block->radius;
+    const float4 discriminant = b * b - 4 * a * c;
+
+    const float4 root = sqrt(max(discriminant, 0.0f));
+    const float4 t_near = (-b - root) / (2 * a);
+    const float4 t_far = (-b + root) / (2 * a);
+    const float4 hit = select(t_far, t_near, t_near < t_max && t_near > t_min);
+    const int4 valid = discriminant > 0.0f && block->radius > 0.0f && hit < t_max && hit > t_min;
+    const float4 candidate = select((float4)(INFINITY), hit, valid);
+
+    int nearest = -1;
+    float closest = t_max;
+    for (int i = 0; i < SPHERE_BLOCK; i++) {
+        if (lane(candidate, i) < closest) {
+            closest = lane(candidate, i);
+            nearest = i;
         }
-        temp = (- b + root) / (2 * a);
-        if (temp < t_max && temp > t_min) {
-            record->pos = RayAt(r, temp);
-			record->t = temp;
-            record->normal = normalize(record->pos - sphere.pos);
-            return true;
+    }
+    *t = closest;
+    return nearest;
+}
+
+// Distances along r to where it enters and leaves the four child boxes of
+// node, clipped to (t_min, t_max); a child is hit where enter <= leave.
+void hit_bvh_children(const struct Ray r, const float3 inv_dir, __global const struct BvhNode* node, const float t_min, const float t_max, float4* enter, float4* leave)
+{
+    const float step_x = as_float((uint)node->exponent.x << 23);
+    const float step_y = as_float((uint)node->exponent.y << 23);
+    const float step_z = as_float((uint)node->exponent.z << 23);
+    const float4 x0 = (node->origin_x + convert_float4(node->lo_x) * step_x - r.origin.x) * inv_dir.x;
+    const float4 x1 = (node->origin_x + convert_float4(node->hi_x) * step_x - r.origin.x) * inv_dir.x;
+    const float4 y0 = (node->origin_y + convert_float4(node->lo_y) * step_y - r.origin.y) * inv_dir.y;
+    const float4 y1 = (node->origin_y + convert_float4(node->hi_y) * step_y - r.origin.y) * inv_dir.y;
+    const float4 z0 = (node->origin_z + convert_float4(node->lo_z) * step_z - r.origin.z) * inv_dir.z;
+    const float4 z1 = (node->origin_z + convert_float4(node->hi_z) * step_z - r.origin.z) * inv_dir.z;
+    *enter = fmax(fmax(fmin(x0, x1), fmin(y0, y1)), fmax(fmin(z0, z1), t_min));
+    *leave = fmin(fmin(fmax(x0, x1), fmax(y0, y1)), fmin(fmax(z0, z1), t_max));
+}
+
+// Pushes the inner children of a node that a ray hits, far to near so the
+// nearest is popped first.
+void push_inner(const int4 child, const int4 hit, const float4 enter, int* stack, int* top)
+{
+    int inner[BVH_WIDTH];
+    float inner_enter[BVH_WIDTH];
+    int count = 0;
+    for (int i = 0; i < BVH_WIDTH; i++) {
+        if (!lane_int(hit, i) || lane_int(child, i) < 0) {
+            continue;
         }
+        const float t = lane(enter, i);
+        int j = count++;
+        while (j > 0 && inner_enter[j - 1] < t) {
+            inner[j] = inner[j - 1];
+            inner_enter[j] = inner_enter[j - 1];
+            j--;
+        }
+        inner[j] = lane_int(child, i);
+        inner_enter[j] = t;
+    }
+    for (int i = 0; i < count && *top < BVH_STACK_SIZE; i++) {
+        stack[(*top)++] = inner[i];
     }
-    return false;
+}
+
+// Closest sphere of the object whose tree starts at root along r, in object
+// space, beyond t_min and before *closest, which it then moves to the hit.
+// Returns the sphere's slot in spheres, -1 for none. Leaves are tested as
+// soon as their box is hit and inner nodes visited nearest first, so an
+// early close hit culls the rest. The walk uses stack above base, the
+// caller's top-level walk keeps its entries below.
+int hit_object(const struct Ray r, const int root, __global const struct BvhNode* nodes, __global const struct SphereBlock* spheres, const float t_min, float* closest,
+               int* stack, const int base)
+{
+    const float3 inv_dir = 1.0f / r.dir;
+    int slot = -1;
+
+    if (base >= BVH_STACK_SIZE) {
+        return -1;
+    }
+    int top = base;
+    stack[top++] = root;
+    while (top > base) {
+        __global const struct BvhNode* node = &nodes[stack[--top]];
+        float4 enter;
+        float4 leave;
+        hit_bvh_children(r, inv_dir, node, t_min, *closest, &enter, &leave);
+        const int4 hit = node->child != BVH_EMPTY && enter <= leave;
+
+        for (int i = 0; i < BVH_WIDTH; i++) {
+            const int child = lane_int(node->child, i);
+            if (!lane_int(hit, i) || child >= 0) {
+                continue;
+            }
+            float t;
+            const int hit_lane = hit_sphere_block(r, &spheres[~child], t_min, *closest, &t);
+            if (hit_lane >= 0) {
+                *closest = t;
+                slot = ~child * SPHERE_BLOCK + hit_lane;
+            }
+        }
+        push_inner(node->child, hit, enter, stack, &top);
+    }
+    return slot;
+}
+
+struct Ray to_object(const struct Ray r, __global const struct Instance* instance)
+{
+    struct Ray local;
+    local.origin = (float3)(dot(instance->world_to_object[0], (float4)(r.origin, 1.0f)),
+                            dot(instance->world_to_object[1], (float4)(r.origin, 1.0f)),
+                            dot(instance->world_to_object[2], (float4)(r.origin, 1.0f)));
+    local.dir = (float3)(dot(instance->world_to_object[0].xyz, r.dir),
+                         dot(instance->world_to_object[1].xyz, r.dir),
+                         dot(instance->world_to_object[2].xyz, r.dir));
+    local.weight = r.weight;
+    return local;
+}
+
+// Closest sphere of the scene along r beyond t_min, its primitive id or -1.
+// The top-level tree over the instances is walked like an object's; at a
+// leaf the ray moves into each instance's space and walks its object on
+// the same stack, so the two levels share one array of private memory.
+int hit_spheres(const struct Ray r, __global const struct BvhNode* tlas, __global const struct Instance* instances,
+                __global const struct BvhNode* nodes, __global const struct SphereBlock* spheres, __global const int* sphere_ids,
+                const float t_min, struct HitRecord* record)
+{
+    const float3 inv_dir = 1.0f / r.dir;
+    float closest = kFarDepth;
+    int slot = -1;
+    int instance_index = -1;
+
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        __global const struct BvhNode* node = &tlas[stack[--top]];
+        float4 enter;
+        float4 leave;
+        hit_bvh_children(r, inv_dir, node, t_min, closest, &enter, &leave);
+        const int4 hit = node->child != BVH_EMPTY && enter <= leave;
+
+        for (int i = 0; i < BVH_WIDTH; i++) {
+            const int child = lane_int(node->child, i);
+            if (!lane_int(hit, i) || child >= 0) {
+                continue;
+            }
+            for (int k = 0; k < BVH_WIDTH; k++) {
+                __global const struct Instance* instance = &instances[~child * BVH_WIDTH + k];
+                if (instance->root < 0) {
+                    continue;
+                }
+                const int hit_slot = hit_object(to_object(r, instance), instance->root, nodes, spheres, t_min, &closest, stack, top);
+                if (hit_slot >= 0) {
+                    slot = hit_slot;
+                    instance_index = ~child * BVH_WIDTH + k;
+                }
+            }
+        }
+        push_inner(node->child, hit, enter, stack, &top);
+    }
+
+    if (slot < 0) {
+        return -1;
+    }
+    __global const struct Instance* instance = &instances[instance_index];
+    __global const struct SphereBlock* block = &spheres[slot / SPHERE_BLOCK];
+    const int i = slot % SPHERE_BLOCK;
+    const float3 center = (float3)(lane(block->x, i), lane(block->y, i), lane(block->z, i));
+    const float3 normal = RayAt(to_object(r, instance), closest) - center;
+
+    // normals go to the world with the transpose of world_to_object
+    record->pos = RayAt(r, closest);
+    record->t = closest;
+    record->normal = normalize(normal.x * instance->world_to_object[0].xyz + normal.y * instance->world_to_object[1].xyz + normal.z * instance->world_to_object[2].xyz);
+    record->material = sphere_ids[slot];
+    return instance->primitive_offset + sphere_ids[slot] - instance->first_sphere;
 }
 
 float3 reflect(const float3 v, const float3 n) {
 	return normalize(v - 2 * dot(v, n) * n);
 }
 
-float3 diffuse(const float3 n,  __global float* random_buffer) {
-    const int index = get_global_id(0);
-    float x = random_buffer[3 * index + 0] - 0.5;
-    float y = random_buffer[3 * index + 1] - 0.5;
-    float z = random_buffer[3 * index + 2] - 0.5;
+float3 diffuse(const float3 n, const float3 random) {
+    float x = random.x - 0.5;
+    float y = random.y - 0.5;
+    float z = random.z - 0.5;
 
     float3 ret = normalize((float3)(x,y,z));
     if (dot(n, ret) > 0) {
@@ -111,24 +410,15 @@ float3 diffuse(const float3 n,  __global float* random_buffer) {
     }
 }
 
-bool ray_hit_scene(const struct Sphere* sphere, const struct Ray ray, struct HitRecord* record, struct Ray* new_ray,  __global float* random_buffer, float3* out_color)
+bool ray_hit_scene(const struct Ray ray, struct HitRecord* record, struct Ray* new_ray, const float3 random, float3* out_color, int* out_index,
+                   __global const struct BvhNode* tlas, __global const struct Instance* instances, __global const struct BvhNode* nodes,
+                   __global const struct SphereBlock* spheres, __global const int* sphere_ids, __global const struct Material* materials)
 {
-    struct HitRecord temp_record;
-    bool hit_anything = false;
-    float closest = 9999;
-    int sphere_index;
-    for (int i = 0; i < 9; i++) {
-        if (hit_sphere(ray, sphere[i], 0.001, closest, &temp_record)) {
-            hit_anything = true;
-            closest = temp_record.t;
-            (*record) = temp_record;
-            sphere_index = i;
-        }
-    }
+    const int sphere_index = hit_spheres(ray, tlas, instances, nodes, spheres, sphere_ids, 0.001f, record);
+    const bool hit_anything = sphere_index >= 0;
 
     if (hit_anything) {
-        const int index = get_global_id(0);
-        float random_number = random_buffer[3 *index];
+        float random_number = random.x;
         const float P_RR = 0.9;
         if (random_number > P_RR) {
             new_ray->weight = (float3)(0.0, 0.0, 0.0);
@@ -138,126 +428,188 @@ bool ray_hit_scene(const struct Sphere* sphere, const struct Ray ray, struct Hit
             (*out_color) = (float3)(0.0, 0.0, 0.0);
         }
         else {
-            if (sphere[sphere_index].is_light) {
+            const struct Material material = materials[record->material];
+            if (material.type == MATERIAL_LIGHT) {
                 // BRDF of light
                 
                 new_ray->origin = ray.origin;
                 new_ray->dir = ray.dir;
-                new_ray->weight = (float3)(0.0, 0.0, 0.0);//ray.weight * sphere[sphere_index].color * dot(record->normal, new_ray->dir) * 2.0f * 3.14159f / P_RR;
+                new_ray->weight = (float3)(0.0, 0.0, 0.0);//ray.weight * material.color * dot(record->normal, new_ray->dir) * 2.0f * 3.14159f / P_RR;
 
-                (*out_color) += ray.weight * sphere[sphere_index].color / P_RR;
+                (*out_color) += ray.weight * material.color / P_RR;
                 
             }
             else {
             // BRDF of other
-            if (sphere_index == 1) {
+            if (material.type == MATERIAL_MIRROR) {
                 new_ray->origin = record->pos;
                 new_ray->dir = reflect(ray.dir, record->normal);
                 new_ray->weight = ray.weight * dot(record->normal, new_ray->dir) / P_RR; // BRDF * cos(theta) / PDF(1) / P_RR
             }
             else {
                     new_ray->origin = record->pos;
-                    new_ray->dir = diffuse(record->normal, random_buffer);
-                    new_ray->weight = ray.weight * sphere[sphere_index].color * dot(record->normal, new_ray->dir) / P_RR * (2.0f * 3.14159f); // BRDF (color) * cos(theta) / PDF (1/(2PI)) / P_RR
+                    new_ray->dir = diffuse(record->normal, random);
+                    new_ray->weight = ray.weight * material.color * dot(record->normal, new_ray->dir) / P_RR * (2.0f * 3.14159f); // BRDF (color) * cos(theta) / PDF (1/(2PI)) / P_RR
                 }
             }
         }
 
         
     }
+    (*out_index) = sphere_index;
     return hit_anything;
 }
 
-__kernel void render(__global float *image, int width, int height, __global float *random_buffer)
+float luminance(const float3 color)
 {
-    // camera setting
-    struct Camera camera;
-    camera.pos = (float3)(-1.5, 0.0, -1.0);
-    camera.look_at = (float3)(-1.5, 0.0, 0.0);
-
-    // spheres
-    struct Sphere sphere[9];
-    sphere[0].pos = (float3)(-1.4, 1.5, 0.2);
-    sphere[0].radius = 0.5;
-    sphere[0].color = (float3)(1.0, 1.0, 1.0);
-    sphere[0].is_light = true;
-
-    sphere[1].pos = (float3)(-1.3, 0.0, 0.2);
-    sphere[1].radius = 0.5;
-    sphere[1].color = (float3)(1.0, 1.0, 1.0);
-    sphere[1].is_light = false;
-
-    sphere[2].pos = (float3)(0.0, -10002.0, 0.0);
-    sphere[2].radius = 10000;
-    sphere[2].color = (float3)(0.9, 0.9, 0.9);
-    sphere[2].is_light = false;
-
-    sphere[3].pos = (float3)(-10002.0, 0.0, 0.0);
-    sphere[3].radius = 10000;
-    sphere[3].color = (float3)(1.0, 0.0, 0.0);
-    sphere[3].is_light = false;
-
-    sphere[4].pos = (float3)(10002.0, 0.0, 0.0);
-    sphere[4].radius = 10000;
-    sphere[4].color = (float3)(0.0, 0.0, 1.0);
-    sphere[4].is_light = false;
+    return dot(color, (float3)(0.2126f, 0.7152f, 0.0722f));
+}
 
-    sphere[5].pos = (float3)(0.0, 10002.0, 0.0);
-    sphere[5].radius = 10000;
-    sphere[5].color = (float3)(0.9, 0.9, 0.9);
-    sphere[5].is_light = false;
+// Adds the samples a work-item traced for pixel to the device-side
+// accumulation, in one read-modify-write. Every pixel is at most once in the
+// active list, so no two work-items touch the same sums.
+void accumulate(const int pixel, const float3 sum, const float sum_sq, const int n, __global float* accum, __global float* accum_sq, __global int* counts)
+{
+    accum[3 * pixel + 0] += sum.x;
+    accum[3 * pixel + 1] += sum.y;
+    accum[3 * pixel + 2] += sum.z;
+    accum_sq[pixel] += sum_sq;
+    counts[pixel] += n;
+}
 
-    sphere[6].pos = (float3)(0.0, 0.0, -10002.0);
-    sphere[6].radius = 10000;
-    sphere[6].color = (float3)(1.0, 1.0, 0.0);
-    sphere[6].is_light = false;
+// Arbitrary output variables. Only the ones the host asks for are compiled
+// in: it builds the program with -DAOV_STRIDE=<floats per pixel> and
+// -DAOV_<NAME>=<offset> for each, and aovs holds AOV_STRIDE floats per pixel.
+// Without any, no AOV code is left in the kernels.
+#ifndef AOV_STRIDE
+#define AOV_STRIDE 0
+#endif
+
+// Per work-item AOV values, summed over its samples like the colour so the
+// jittered samples average into anti-aliased edges; the ids do not average
+// and keep the last sample's. A primary ray that misses gets the reversed
+// view direction as its normal, kFarDepth as its depth and what it sees as
+// its albedo. direct is light that reached the camera after at most one
+// bounce, indirect the rest, so the two add up to the colour.
+struct Aovs {
+    float3 normal;
+    float3 albedo;
+    float depth;
+    float primitive_id;
+    float material_id;
+    float3 direct;
+    float3 indirect;
+};
 
-    sphere[7].pos = (float3)(0.0, 0.0, 10002.0);
-    sphere[7].radius = 10000;
-    sphere[7].color = (float3)(0.0, 1.0, 0.0);
-    sphere[7].is_light = false;
+void record_first_hit(struct Aovs* aov, const bool hit, const struct HitRecord* record, const struct Ray ray, const float3 albedo, const int primitive, const int material)
+{
+    aov->normal += hit ? record->normal : -ray.dir;
+    aov->albedo += albedo;
+    aov->depth += hit ? record->t : kFarDepth;
+    aov->primitive_id = hit ? primitive : -1;
+    aov->material_id = hit ? material : -1;
+}
 
-    sphere[8].pos = (float3)(0, 0.0, 1.5);
-    sphere[8].radius = 0.5;
-    sphere[8].color = (float3)(0.0, 1.0, 1.0);
-    sphere[8].is_light = false;
+// Books what one bounce added to the colour as direct or indirect light. A
+// path cut by the roulette has its colour zeroed, and so its split.
+void split_light(const int bounce, const float3 before, const float3 after, float3* direct, float3* indirect)
+{
+    if (bounce <= 1) {
+        *direct += after - before;
+    }
+    else {
+        *indirect += after - before;
+    }
+    if (all(after == (float3)(0, 0, 0))) {
+        *direct = (float3)(0, 0, 0);
+        *indirect = (float3)(0, 0, 0);
+    }
+}
 
+void accumulate_aovs(const int pixel, const struct Aovs sum, __global float* aovs)
+{
+#if AOV_STRIDE > 0
+    __global float* out = aovs + pixel * AOV_STRIDE;
+#ifdef AOV_DEPTH
+    out[AOV_DEPTH] += sum.depth;
+#endif
+#ifdef AOV_NORMAL
+    vstore3(vload3(0, out + AOV_NORMAL) + sum.normal, 0, out + AOV_NORMAL);
+#endif
+#ifdef AOV_ALBEDO
+    vstore3(vload3(0, out + AOV_ALBEDO) + sum.albedo, 0, out + AOV_ALBEDO);
+#endif
+#ifdef AOV_PRIMITIVE_ID
+    out[AOV_PRIMITIVE_ID] = sum.primitive_id;
+#endif
+#ifdef AOV_MATERIAL_ID
+    out[AOV_MATERIAL_ID] = sum.material_id;
+#endif
+#ifdef AOV_DIRECT
+    vstore3(vload3(0, out + AOV_DIRECT) + sum.direct, 0, out + AOV_DIRECT);
+#endif
+#ifdef AOV_INDIRECT
+    vstore3(vload3(0, out + AOV_INDIRECT) + sum.indirect, 0, out + AOV_INDIRECT);
+#endif
+#endif
+}
 
+// spp samples for every pixel in active_pixels, the random numbers are seeded
+// by pixel so a pixel sees the same stream whatever its place in the list.
+__kernel void render(__global float* accum, __global float* accum_sq, __global int* counts, __global float* aovs, __global const int* active_pixels,
+                     int width, int height, int spp, uint seed, const struct Camera camera,
+                     __global const struct BvhNode* tlas, __global const struct Instance* instances, __global const struct BvhNode* nodes,
+                     __global const struct SphereBlock* spheres, __global const int* sphere_ids, __global const struct Material* materials)
+{
     // cl thread
-    const int index = get_global_id(0);
-    struct Ray ray = getRay(camera, width, height, random_buffer);
-
-
-    bool hit_anything = false;
-    float3 color = (float3)(0,0,0);
-    for (int i = 0; i < 40; i++) {
-        struct HitRecord record;
-        struct Ray new_ray;
-        bool hit_scene = ray_hit_scene(sphere, ray, &record, &new_ray, random_buffer, &color);
-        if (hit_scene) {
-            hit_anything = true;
-            ray = new_ray;
+    const int index = active_pixels[get_global_id(0)];
+    uint state = seed_pixel(seed, index);
+
+    float3 sum = (float3)(0,0,0);
+    float sum_sq = 0;
+    struct Aovs aov = {(float3)(0,0,0), (float3)(0,0,0), 0, -1, -1, (float3)(0,0,0), (float3)(0,0,0)};
+    for (int sample = 0; sample < spp; sample++) {
+        const float3 random = next_random(&state);
+        struct Ray ray = getRay(camera, index, width, height, random, &state);
+
+        bool hit_anything = false;
+        float3 color = (float3)(0,0,0);
+        float3 direct = (float3)(0,0,0);
+        float3 indirect = (float3)(0,0,0);
+        for (int i = 0; i < 40; i++) {
+            struct HitRecord record;
+            struct Ray new_ray;
+            int hit_index;
+            const float3 before = color;
+            bool hit_scene = ray_hit_scene(ray, &record, &new_ray, random, &color, &hit_index, tlas, instances, nodes, spheres, sphere_ids, materials);
+#if AOV_STRIDE > 0
+            if (i == 0) {
+                const int material = hit_scene ? materials[record.material].type : -1;
+                record_first_hit(&aov, hit_scene, &record, ray, hit_scene ? materials[record.material].color : (float3)(0,0,0), hit_index, material);
+            }
+            split_light(i, before, color, &direct, &indirect);
+#endif
+            if (hit_scene) {
+                hit_anything = true;
+                ray = new_ray;
+            }
         }
-    }
 
-    // to image
-    if (hit_anything) {
-        image[3 * index + 0] = color.x;
-        image[3 * index + 1] = color.y;
-        image[3 * index + 2] = color.z;
-    }
-    else {
-        image[3 * index + 0] = 0.0;
-        image[3 * index + 1] = 0.0;
-        image[3 * index + 2] = 0.0;
+        // to image
+        if (!hit_anything) {
+            color = (float3)(0.0, 0.0, 0.0);
+        }
+        sum += color;
+        aov.direct += direct;
+        aov.indirect += indirect;
+        sum_sq += luminance(color) * luminance(color);
     }
-
+    accumulate(index, sum, sum_sq, spp, accum, accum_sq, counts);
+    accumulate_aovs(index, aov, aovs);
 }
 
 void get_cubemap_light(float3* result, const struct Ray ray, __global uchar* top, __global uchar* bottom, __global uchar* left, __global uchar* right, __global uchar* front, __global uchar* back)
 {
-    const int index = get_global_id(0);
-
     const float _PI_ = 3.1415926;
     const float _PI_2_ = _PI_ / 2;
     const float _PI_4_ = _PI_ / 4;
@@ -355,12 +707,17 @@ void get_cubemap_light(float3* result, const struct Ray ray, __global uchar* top
     }
 }
 
-void ray_hit_scene_2(const struct Sphere* sphere,
-                     const struct Ray ray, 
+void ray_hit_scene_2(const struct Ray ray, 
                      struct HitRecord* record, 
                      struct Ray* new_ray, 
-                     __global float* random_buffer, 
+                     const float3 random,
                      float3* out_color,
+                     int* out_index,
+                     __global const struct BvhNode* tlas,
+                     __global const struct Instance* instances,
+                     __global const struct BvhNode* nodes,
+                     __global const struct SphereBlock* spheres,
+                     __global const int* sphere_ids,
                      __global uchar* top, 
                      __global uchar* bottom, 
                      __global uchar* left,
@@ -368,22 +725,11 @@ void ray_hit_scene_2(const struct Sphere* sphere,
                      __global uchar* front, 
                      __global uchar* back)
 {
-    struct HitRecord temp_record;
-    bool hit_anything = false;
-    float closest = 9999;
-    int sphere_index;
-    for (int i = 0; i < 2; i++) {
-        if (hit_sphere(ray, sphere[i], 0.001, closest, &temp_record)) {
-            hit_anything = true;
-            closest = temp_record.t;
-            (*record) = temp_record;
-            sphere_index = i;
-        }
-    }
+    const int sphere_index = hit_spheres(ray, tlas, instances, nodes, spheres, sphere_ids, 0.001f, record);
+    const bool hit_anything = sphere_index >= 0;
 
     if (hit_anything) {
-        const int index = get_global_id(0);
-        float random_number = random_buffer[3 *index];
+        float random_number = random.x;
         const float P_RR = 0.9;
         if (random_number > P_RR) {
             new_ray->weight = (float3)(0.0, 0.0, 0.0);
@@ -407,40 +753,316 @@ void ray_hit_scene_2(const struct Sphere* sphere,
         get_cubemap_light(&out_background, ray, top, bottom, left, right, front, back);
         (*out_color) += ray.weight * out_background;
     }
+    (*out_index) = sphere_index;
 }
 
-__kernel void demo_cubemap(__global float *image, int width, int height, __global float *random_buffer, __global uchar* top, __global uchar* bottom, __global uchar* left, __global uchar* right, __global uchar* front, __global uchar* back)
+__kernel void demo_cubemap(__global float* accum, __global float* accum_sq, __global int* counts, __global float* aovs, __global const int* active_pixels,
+                           int width, int height, int spp, uint seed, const struct Camera camera,
+                           __global const struct BvhNode* tlas, __global const struct Instance* instances, __global const struct BvhNode* nodes,
+                           __global const struct SphereBlock* spheres, __global const int* sphere_ids, __global const struct Material* materials,
+                           __global uchar* top, __global uchar* bottom, __global uchar* left, __global uchar* right, __global uchar* front, __global uchar* back)
 {
-    struct Camera camera;
-    camera.pos = (float3)(0.0, 0.0, 0.0);
-    camera.look_at = (float3)(0.0, 0.0, 1);
 
-    const int index = get_global_id(0);
-    struct Ray ray = getRay(camera, width, height, random_buffer);
+    const int index = active_pixels[get_global_id(0)];
+    uint state = seed_pixel(seed, index);
+
+
+    float3 sum = (float3)(0,0,0);
+    float sum_sq = 0;
+    struct Aovs aov = {(float3)(0,0,0), (float3)(0,0,0), 0, -1, -1, (float3)(0,0,0), (float3)(0,0,0)};
+    for (int sample = 0; sample < spp; sample++) {
+        const float3 random = next_random(&state);
+        struct Ray ray = getRay(camera, index, width, height, random, &state);
+
+        float3 color = (float3)(0,0,0);
+        float3 direct = (float3)(0,0,0);
+        float3 indirect = (float3)(0,0,0);
+        for (int i = 0; i < 40; i++) {
+            struct HitRecord record;
+            struct Ray new_ray;
+            int hit_index;
+            const float3 before = color;
+            ray_hit_scene_2(ray, &record, &new_ray, random, &color, &hit_index, tlas, instances, nodes, spheres, sphere_ids, top, bottom, left, right, front, back);
+#if AOV_STRIDE > 0
+            if (i == 0) {
+                // a miss on the first bounce has only added the background to color
+                const bool hit_scene = hit_index >= 0;
+                record_first_hit(&aov, hit_scene, &record, ray, hit_scene ? materials[record.material].color : color, hit_index, hit_scene ? materials[record.material].type : -1);
+            }
+            split_light(i, before, color, &direct, &indirect);
+#endif
+            ray = new_ray;
+        }
+        sum += color;
+        aov.direct += direct;
+        aov.indirect += indirect;
+        sum_sq += luminance(color) * luminance(color);
+    }
+    accumulate(index, sum, sum_sq, spp, accum, accum_sq, counts);
+    accumulate_aovs(index, aov, aovs);
+}
 
-    struct Sphere sphere[2];
-    sphere[0].pos = (float3)(0.0, 0.0, 2);
-    sphere[0].radius = 0.5;
-    sphere[0].color = (float3)(1.0, 1.0, 1.0);
-    sphere[0].is_light = false;
+// Adds the accumulation of the frame before a camera move to the one after
+// it, which holds the first launch from the new camera. Every pixel's mean
+// first-hit depth gives its world position, which is projected into the old
+// camera; the history at the nearest old pixel is taken if it saw the same
+// surface there, and dropped as disoccluded otherwise. The history is capped
+// at max_history samples so the old view fades out as new samples come in,
+// which also bounds how long view-dependent shading (the mirror sphere, the
+// skybox through it) lags behind. Ids are the new frame's. Without the depth
+// AOV compiled in there is nothing to reproject with and the history is
+// dropped. A history rendered as a preview only has every history_stride-th
+// pixel of every history_stride-th row, the lookup goes to the nearest of
+// those, as Renderer::resolve() shows it.
+__kernel void reproject_history(__global float* accum, __global float* accum_sq, __global int* counts, __global float* aovs,
+                                __global const float* history_accum, __global const float* history_sq, __global const int* history_counts, __global const float* history_aovs,
+                                int width, int height, const struct Camera camera, const struct Camera history, int history_stride, int max_history)
+{
+    const int pixel = get_global_id(0);
+    if (pixel >= width * height || counts[pixel] < 1) {
+        return;
+    }
 
-    sphere[1].pos = (float3)(-1.5, 0.0, 2);
-    sphere[1].radius = 0.5;
-    sphere[1].color = (float3)(1.0, 1.0, 1.0);
-    sphere[1].is_light = false;
+#ifdef AOV_DEPTH
+    __global float* aov = aovs + pixel * AOV_STRIDE;
+    const float depth = aov[AOV_DEPTH] / counts[pixel];
+    const float3 world = camera.pos + depth * camera_direction(camera, pixel % width, pixel / width, width, height);
 
+    float2 position;
+    if (!camera_project(history, world, width, height, &position)) {
+        return;
+    }
+    int x = (int)floor(position.x + 0.5f);
+    int y = (int)floor(position.y + 0.5f);
+    if (x < 0 || x >= width || y < 0 || y >= height) {
+        return;
+    }
+    x = min((x + history_stride / 2) / history_stride, (width - 1) / history_stride) * history_stride;
+    y = min((y + history_stride / 2) / history_stride, (height - 1) / history_stride) * history_stride;
+
+    // the same surface if the old pixel's depth puts it close to world
+    const int old = y * width + x;
+    const int n = history_counts[old];
+    if (n < 1) {
+        return;
+    }
+    __global const float* old_aov = history_aovs + old * AOV_STRIDE;
+    const float3 old_world = history.pos + old_aov[AOV_DEPTH] / n * camera_direction(history, x, y, width, height);
+    if (distance(world, old_world) > 0.05f * depth + 1e-3f) {
+        return;
+    }
+#ifdef AOV_NORMAL
+    const float3 normal = vload3(0, aov + AOV_NORMAL);
+    const float3 old_normal = vload3(0, old_aov + AOV_NORMAL);
+    if (dot(normal, old_normal) < 0.9f * length(normal) * length(old_normal)) {
+        return;
+    }
+#endif
+
+    const int kept = min(n, max_history);
+    const float scale = (float)kept / n;
+    vstore3(vload3(pixel, accum) + scale * vload3(old, history_accum), pixel, accum);
+    accum_sq[pixel] += scale * history_sq[old];
+    counts[pixel] += kept;
+
+    aov[AOV_DEPTH] += scale * old_aov[AOV_DEPTH];
+#ifdef AOV_NORMAL
+    vstore3(vload3(0, aov + AOV_NORMAL) + scale * vload3(0, old_aov + AOV_NORMAL), 0, aov + AOV_NORMAL);
+#endif
+#ifdef AOV_ALBEDO
+    vstore3(vload3(0, aov + AOV_ALBEDO) + scale * vload3(0, old_aov + AOV_ALBEDO), 0, aov + AOV_ALBEDO);
+#endif
+#ifdef AOV_DIRECT
+    vstore3(vload3(0, aov + AOV_DIRECT) + scale * vload3(0, old_aov + AOV_DIRECT), 0, aov + AOV_DIRECT);
+#endif
+#ifdef AOV_INDIRECT
+    vstore3(vload3(0, aov + AOV_INDIRECT) + scale * vload3(0, old_aov + AOV_INDIRECT), 0, aov + AOV_INDIRECT);
+#endif
+#endif
+}
 
-    float3 color = (float3)(0,0,0);
-    for (int i = 0; i < 40; i++) {
-        struct HitRecord record;
-        struct Ray new_ray;
-        ray_hit_scene_2(sphere, ray, &record, &new_ray, random_buffer, &color, top, bottom, left, right, front, back);
-        ray = new_ray;
+// Relative standard error of the mean luminance of pixel, the same measure
+// Renderer::estimateNoise() averages over the image.
+float pixel_error(const int pixel, __global const float* accum, __global const float* accum_sq, __global const int* counts)
+{
+    const float n = (float)counts[pixel];
+    if (n < 2.0f) {
+        return INFINITY;
     }
 
+    float mean = luminance(vload3(pixel, accum)) / n;
+    float variance = max(0.0f, (accum_sq[pixel] / n - mean * mean) * n / (n - 1.0f));
+    return sqrt(variance / n) / (mean + 1e-2f);
+}
+
+// Writes every pixel that still needs samples to active_pixels and their
+// number to active_count, which has to be zero before the launch. A pixel
+// stays active while it or one of its 8 neighbours is above the threshold,
+// since a single pixel's variance estimate is itself noisy at low counts.
+// Slots are handed out per work-group first, so there is one global atomic
+// per group instead of one per pixel.
+__kernel void compact_active(__global const float* accum, __global const float* accum_sq, __global const int* counts,
+                             int width, int height, float threshold, int min_samples,
+                             __global int* active_pixels, volatile __global int* active_count)
+{
+    __local int group_count;
+    __local int group_base;
 
-    image[3 * index + 0] = color.x;
-    image[3 * index + 1] = color.y;
-    image[3 * index + 2] = color.z;
+    const int pixel = get_global_id(0);
+    if (get_local_id(0) == 0) {
+        group_count = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    bool active = false;
+    if (pixel < width * height) {
+        active = counts[pixel] < min_samples;
+        const int x = pixel % width;
+        const int y = pixel / width;
+        for (int dy = -1; dy <= 1 && !active; dy++) {
+            for (int dx = -1; dx <= 1 && !active; dx++) {
+                const int nx = clamp(x + dx, 0, width - 1);
+                const int ny = clamp(y + dy, 0, height - 1);
+                active = pixel_error(ny * width + nx, accum, accum_sq, counts) > threshold;
+            }
+        }
+    }
+
+    int slot = active ? atomic_inc((volatile __local int*)&group_count) : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (get_local_id(0) == 0) {
+        group_base = atomic_add(active_count, group_count);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (active) {
+        active_pixels[group_base + slot] = pixel;
+    }
+}
+
+
+// Edge-avoiding a-trous wavelet denoiser (Dammertz et al. 2010, with the
+// variance-guided colour weight of SVGF). denoise_prepare divides the albedo
+// out of the averaged colour, so texture and colour edges are not blurred,
+// and packs the guides; denoise_atrous runs once per level with step 1, 2,
+// 4, ...; denoise_finish multiplies the albedo back in.
+
+// Keeps the division by a black albedo finite, prepare and finish must agree on it.
+__constant float kAlbedoEpsilon = 1e-3f;
+
+// 1/16 (1 4 6 4 1), the B3 spline the a-trous levels dilate.
+__constant float kAtrousWeights[3] = {3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+
+// color: demodulated mean colour and the variance of its luminance mean.
+// guide: mean first-hit normal and depth. albedo: mean first-hit albedo.
+// Without the depth, normal and albedo AOVs compiled in, the guides are flat
+// and only the colour weight stops at edges.
+__kernel void denoise_prepare(__global const float* accum, __global const float* accum_sq, __global const int* counts, __global const float* aovs,
+                              int width, int height, __global float4* color, __global float4* guide, __global float4* albedo)
+{
+    const int pixel = get_global_id(0);
+    if (pixel >= width * height) {
+        return;
+    }
+
+    const float n = (float)counts[pixel];
+    if (n < 1.0f) {
+        color[pixel] = (float4)(0, 0, 0, 0);
+        guide[pixel] = (float4)(0, 0, 0, kFarDepth);
+        albedo[pixel] = (float4)(0, 0, 0, 0);
+        return;
+    }
+
+#if AOV_STRIDE > 0
+    __global const float* aov = aovs + pixel * AOV_STRIDE;
+#endif
+#ifdef AOV_ALBEDO
+    const float3 mean_albedo = vload3(0, aov + AOV_ALBEDO) / n;
+#else
+    const float3 mean_albedo = (float3)(1, 1, 1);
+#endif
+#ifdef AOV_NORMAL
+    const float3 normal = vload3(0, aov + AOV_NORMAL);
+#else
+    const float3 normal = (float3)(0, 0, 1);
+#endif
+#ifdef AOV_DEPTH
+    const float depth = aov[AOV_DEPTH] / n;
+#else
+    const float depth = 1.0f;
+#endif
+
+    const float3 mean = vload3(pixel, accum) / n;
+    const float mean_luminance = luminance(mean);
+    const float variance = n < 2.0f ? 0.0f : max(0.0f, (accum_sq[pixel] / n - mean_luminance * mean_luminance) / (n - 1.0f));
+    const float scale = 1.0f / (luminance(mean_albedo) + kAlbedoEpsilon);
+
+    color[pixel] = (float4)(mean / (mean_albedo + kAlbedoEpsilon), variance * scale * scale);
+    guide[pixel] = (float4)(length(normal) > 0.0f ? normalize(normal) : normal, depth);
+    albedo[pixel] = (float4)(mean_albedo, 0);
+}
+
+// One level: a 5x5 B3 kernel with taps step pixels apart. A tap's weight falls
+// off with the angle between the normals (sigma_normal is the cosine power),
+// the relative depth difference, and the luminance difference measured in
+// standard deviations of the centre; the variance is filtered with the
+// squared weights so the next level sees how much noise is left.
+__kernel void denoise_atrous(__global const float4* color_in, __global const float4* guide, int width, int height, int step,
+                             float sigma_color, float sigma_normal, float sigma_depth, __global float4* color_out)
+{
+    const int pixel = get_global_id(0);
+    if (pixel >= width * height) {
+        return;
+    }
+
+    const int x = pixel % width;
+    const int y = pixel / width;
+    const float4 center = color_in[pixel];
+    const float4 center_guide = guide[pixel];
+    const float center_luminance = luminance(center.xyz);
+    const float color_scale = sigma_color * sqrt(max(center.w, 0.0f)) + 1e-4f;
+    const float depth_scale = sigma_depth * step * center_guide.w + 1e-4f;
+
+    float3 sum = (float3)(0, 0, 0);
+    float variance = 0.0f;
+    float weight_sum = 0.0f;
+    for (int dy = -2; dy <= 2; dy++) {
+        const int ny = y + dy * step;
+        if (ny < 0 || ny >= height) {
+            continue;
+        }
+        for (int dx = -2; dx <= 2; dx++) {
+            const int nx = x + dx * step;
+            if (nx < 0 || nx >= width) {
+                continue;
+            }
+
+            const int tap = ny * width + nx;
+            const float4 sample = color_in[tap];
+            const float4 sample_guide = guide[tap];
+            float weight = kAtrousWeights[abs(dx)] * kAtrousWeights[abs(dy)];
+            if (tap != pixel) {
+                weight *= pow(max(0.0f, dot(center_guide.xyz, sample_guide.xyz)), sigma_normal);
+                weight *= exp(-fabs(center_guide.w - sample_guide.w) / depth_scale);
+                weight *= exp(-fabs(center_luminance - luminance(sample.xyz)) / color_scale);
+            }
+
+            sum += weight * sample.xyz;
+            variance += weight * weight * sample.w;
+            weight_sum += weight;
+        }
+    }
+
+    // the centre tap always counts, so weight_sum is never 0
+    color_out[pixel] = (float4)(sum / weight_sum, variance / (weight_sum * weight_sum));
+}
+
+__kernel void denoise_finish(__global const float4* color, __global const float4* albedo, int width, int height, __global float* rgb)
+{
+    const int pixel = get_global_id(0);
+    if (pixel >= width * height) {
+        return;
+    }
 
+    vstore3(color[pixel].xyz * (albedo[pixel].xyz + kAlbedoEpsilon), pixel, rgb);
 }
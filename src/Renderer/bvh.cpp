@@ -0,0 +1,517 @@
+#include "bvh.h"
+
+#include "task_pool.h"
+#include "trace.h"
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <mutex>
+
+namespace CGRA {
+
+/**Centroid bins per axis the SAH split is chosen from.*/
+static const int kBins = 16;
+
+/**Primitives or nodes below which work is not worth splitting over the cores.*/
+static const int kParallelGrain = 4096;
+
+/**Node of the binary tree build() collapses, a leaf if count > 0.*/
+struct Bvh::BuildNode {
+	Box box;
+	int left;
+	int right;
+	int first; // into the primitive order
+	int count;
+};
+
+/**
+ * The binary nodes of one build, allocated up front for the at most
+ * 2n - 1 nodes of n primitives; the tasks of a parallel build claim them
+ * with one atomic add and no allocation.
+ */
+struct Bvh::BuildArena {
+	std::vector<BuildNode> nodes;
+	std::atomic<int> used;
+
+	BuildArena(size_t primitives)
+		: nodes(std::max<size_t>(1, 2 * primitives - 1))
+		, used(0)
+	{
+
+	}
+
+	int allocate(int first, int count) {
+		const int index = used.fetch_add(1);
+		nodes[index] = {Box::empty(), -1, -1, first, count};
+		return index;
+	}
+};
+
+Bvh::Box Bvh::Box::empty()
+{
+	return {{FLT_MAX, FLT_MAX, FLT_MAX}, {-FLT_MAX, -FLT_MAX, -FLT_MAX}};
+}
+
+void Bvh::Box::grow(const Box& box)
+{
+	for (int axis = 0; axis < 3; axis++) {
+		min[axis] = std::min(min[axis], box.min[axis]);
+		max[axis] = std::max(max[axis], box.max[axis]);
+	}
+}
+
+float Bvh::Box::getArea() const
+{
+	const float x = std::max(0.0f, max[0] - min[0]);
+	const float y = std::max(0.0f, max[1] - min[1]);
+	const float z = std::max(0.0f, max[2] - min[2]);
+	return 2.0f * (x * y + y * z + z * x);
+}
+
+static float getCentroid(const Bvh::Box& box, int axis)
+{
+	return 0.5f * (box.min[axis] + box.max[axis]);
+}
+
+/**The box of the centroids and the box of the boxes of order[first, first + count), on every core for large ranges.*/
+static void getRangeBounds(const std::vector<Bvh::Box>& bounds, const std::vector<int>& order, int first, int count, Bvh::Box& centroids, Bvh::Box& box)
+{
+	std::mutex mutex;
+	centroids = Bvh::Box::empty();
+	box = Bvh::Box::empty();
+	TaskPool::getInstance()->parallelFor(count, kParallelGrain, [&](int begin, int end) {
+		Bvh::Box rangeCentroids = Bvh::Box::empty();
+		Bvh::Box rangeBox = Bvh::Box::empty();
+		for (int i = first + begin; i < first + end; i++) {
+			const Bvh::Box& primitive = bounds[order[i]];
+			rangeBox.grow(primitive);
+			for (int axis = 0; axis < 3; axis++) {
+				const float centroid = getCentroid(primitive, axis);
+				rangeCentroids.min[axis] = std::min(rangeCentroids.min[axis], centroid);
+				rangeCentroids.max[axis] = std::max(rangeCentroids.max[axis], centroid);
+			}
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		centroids.grow(rangeCentroids);
+		box.grow(rangeBox);
+	});
+}
+
+int Bvh::split(const std::vector<Box>& bounds, std::vector<int>& order, int first, int count, BuildArena& arena)
+{
+	const int index = arena.allocate(first, count);
+	Box centroids;
+	getRangeBounds(bounds, order, first, count, centroids, arena.nodes[index].box);
+	if (count <= kWidth) {
+		return index;
+	}
+
+	// all three axes binned in one pass, every range into bins of its own that are merged after
+	Box boxes[3][kBins];
+	int counts[3][kBins] = {};
+	for (int axis = 0; axis < 3; axis++) {
+		for (int i = 0; i < kBins; i++) {
+			boxes[axis][i] = Box::empty();
+		}
+	}
+	float scales[3];
+	for (int axis = 0; axis < 3; axis++) {
+		const float extent = centroids.max[axis] - centroids.min[axis];
+		scales[axis] = extent > 0.0f ? kBins / extent : 0.0f;
+	}
+	auto getBin = [&](const Box& primitive, int axis) {
+		return std::min(kBins - 1, (int)((getCentroid(primitive, axis) - centroids.min[axis]) * scales[axis]));
+	};
+	std::mutex mutex;
+	TaskPool::getInstance()->parallelFor(count, kParallelGrain, [&](int begin, int end) {
+		Box rangeBoxes[3][kBins];
+		int rangeCounts[3][kBins] = {};
+		for (int axis = 0; axis < 3; axis++) {
+			for (int i = 0; i < kBins; i++) {
+				rangeBoxes[axis][i] = Box::empty();
+			}
+		}
+		for (int i = first + begin; i < first + end; i++) {
+			const Box& primitive = bounds[order[i]];
+			for (int axis = 0; axis < 3; axis++) {
+				const int bin = getBin(primitive, axis);
+				rangeBoxes[axis][bin].grow(primitive);
+				rangeCounts[axis][bin]++;
+			}
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int axis = 0; axis < 3; axis++) {
+			for (int i = 0; i < kBins; i++) {
+				boxes[axis][i].grow(rangeBoxes[axis][i]);
+				counts[axis][i] += rangeCounts[axis][i];
+			}
+		}
+	});
+
+	// a leaf holds at most kWidth, so larger sets split even where SAH would rather not
+	int bestAxis = -1;
+	int bestBin = 0;
+	float bestCost = FLT_MAX;
+	for (int axis = 0; axis < 3; axis++) {
+		if (scales[axis] <= 0.0f) {
+			continue;
+		}
+
+		// SAH cost of splitting after every bin, from a sweep in each direction
+		float rightArea[kBins];
+		int rightCount[kBins];
+		Box right = Box::empty();
+		int rightTotal = 0;
+		for (int i = kBins - 1; i > 0; i--) {
+			right.grow(boxes[axis][i]);
+			rightTotal += counts[axis][i];
+			rightArea[i] = right.getArea();
+			rightCount[i] = rightTotal;
+		}
+		Box left = Box::empty();
+		int leftTotal = 0;
+		for (int i = 0; i < kBins - 1; i++) {
+			left.grow(boxes[axis][i]);
+			leftTotal += counts[axis][i];
+			if (leftTotal == 0 || rightCount[i + 1] == 0) {
+				continue;
+			}
+			const float cost = leftTotal * left.getArea() + rightCount[i + 1] * rightArea[i + 1];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = i;
+			}
+		}
+	}
+
+	int middle = first + count / 2;
+	if (bestAxis >= 0) {
+		middle = (int)(std::partition(order.begin() + first, order.begin() + first + count, [&](int primitive) {
+			return getBin(bounds[primitive], bestAxis) <= bestBin;
+		}) - order.begin());
+	}
+
+	// the halves are disjoint ranges of order, a large one goes to another core
+	arena.nodes[index].count = 0;
+	int left = -1;
+	int right = -1;
+	if (count >= kParallelGrain) {
+		TaskPool::Group group;
+		TaskPool::getInstance()->run(group, [&]() { left = split(bounds, order, first, middle - first, arena); });
+		right = split(bounds, order, middle, first + count - middle, arena);
+		TaskPool::getInstance()->wait(group);
+	}
+	else {
+		left = split(bounds, order, first, middle - first, arena);
+		right = split(bounds, order, middle, first + count - middle, arena);
+	}
+	arena.nodes[index].left = left;
+	arena.nodes[index].right = right;
+	return index;
+}
+
+/**Spreads the low 10 bits of v out to every third bit.*/
+static uint32_t expandBits(uint32_t v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+int Bvh::splitMorton(const std::vector<Box>& bounds, const std::vector<uint32_t>& codes, const std::vector<int>& order, int first, int count, BuildArena& arena)
+{
+	const int index = arena.allocate(first, count);
+	if (count <= kWidth) {
+		for (int i = first; i < first + count; i++) {
+			arena.nodes[index].box.grow(bounds[order[i]]);
+		}
+		return index;
+	}
+
+	// the codes are sorted, so the highest bit that differs between the ends splits the range in two
+	int middle = first + count / 2;
+	const uint32_t different = codes[first] ^ codes[first + count - 1];
+	if (different != 0) {
+		uint32_t bit = 1u << 31;
+		while ((different & bit) == 0) {
+			bit >>= 1;
+		}
+		middle = (int)(std::partition_point(codes.begin() + first, codes.begin() + first + count, [bit](uint32_t code) {
+			return (code & bit) == 0;
+		}) - codes.begin());
+	}
+
+	arena.nodes[index].count = 0;
+	int left = -1;
+	int right = -1;
+	if (count >= kParallelGrain) {
+		TaskPool::Group group;
+		TaskPool::getInstance()->run(group, [&]() { left = splitMorton(bounds, codes, order, first, middle - first, arena); });
+		right = splitMorton(bounds, codes, order, middle, first + count - middle, arena);
+		TaskPool::getInstance()->wait(group);
+	}
+	else {
+		left = splitMorton(bounds, codes, order, first, middle - first, arena);
+		right = splitMorton(bounds, codes, order, middle, first + count - middle, arena);
+	}
+	BuildNode& node = arena.nodes[index];
+	node.left = left;
+	node.right = right;
+	node.box.grow(arena.nodes[left].box);
+	node.box.grow(arena.nodes[right].box);
+	return index;
+}
+
+/**Sorts order by the Morton code of each primitive's centroid, codes ends up sorted alongside.*/
+static void sortMorton(const std::vector<Bvh::Box>& bounds, std::vector<int>& order, std::vector<uint32_t>& codes)
+{
+	const int count = (int)bounds.size();
+	Bvh::Box centroids;
+	Bvh::Box box;
+	getRangeBounds(bounds, order, 0, count, centroids, box);
+
+	// 10 bits per axis over the centroids' box
+	float scales[3];
+	for (int axis = 0; axis < 3; axis++) {
+		const float extent = centroids.max[axis] - centroids.min[axis];
+		scales[axis] = extent > 0.0f ? 1023.0f / extent : 0.0f;
+	}
+	codes.resize(count);
+	TaskPool::getInstance()->parallelFor(count, kParallelGrain, [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			uint32_t code = 0;
+			for (int axis = 0; axis < 3; axis++) {
+				const uint32_t cell = (uint32_t)((getCentroid(bounds[i], axis) - centroids.min[axis]) * scales[axis]);
+				code |= expandBits(std::min(cell, 1023u)) << (2 - axis);
+			}
+			codes[i] = code;
+		}
+	});
+
+	// least significant digit radix sort, three passes of 10 bits
+	std::vector<uint32_t> sortedCodes(count);
+	std::vector<int> sortedOrder(count);
+	for (int shift = 0; shift < 30; shift += 10) {
+		std::vector<int> offsets(1025, 0);
+		for (int i = 0; i < count; i++) {
+			offsets[((codes[i] >> shift) & 1023) + 1]++;
+		}
+		for (int i = 1; i < 1025; i++) {
+			offsets[i] += offsets[i - 1];
+		}
+		for (int i = 0; i < count; i++) {
+			const int slot = offsets[(codes[i] >> shift) & 1023]++;
+			sortedCodes[slot] = codes[i];
+			sortedOrder[slot] = order[i];
+		}
+		codes.swap(sortedCodes);
+		order.swap(sortedOrder);
+	}
+}
+
+int Bvh::collapse(const std::vector<BuildNode>& binary, const std::vector<int>& order, int source, int depth)
+{
+	const int index = (int)nodes.size();
+	nodes.emplace_back();
+	nodeBounds.push_back(binary[source].box);
+	if ((int)levels.size() <= depth) {
+		levels.resize(depth + 1);
+	}
+	levels[depth].push_back(index);
+
+	int children[kWidth] = {source};
+	int count = 1;
+	if (binary[source].count == 0) {
+		children[0] = binary[source].left;
+		children[1] = binary[source].right;
+		count = 2;
+	}
+	while (count < kWidth) {
+		int largest = -1;
+		for (int i = 0; i < count; i++) {
+			if (binary[children[i]].count == 0 && (largest < 0 || binary[children[i]].box.getArea() > binary[children[largest]].box.getArea())) {
+				largest = i;
+			}
+		}
+		if (largest < 0) {
+			break;
+		}
+		const BuildNode& node = binary[children[largest]];
+		children[largest] = node.left;
+		children[count++] = node.right;
+	}
+
+	Box boxes[kWidth];
+	int32_t references[kWidth];
+	for (int i = 0; i < kWidth; i++) {
+		references[i] = kEmpty;
+	}
+	for (int i = 0; i < count; i++) {
+		const BuildNode& child = binary[children[i]];
+		boxes[i] = child.box;
+		if (child.count > 0) {
+			references[i] = ~(int32_t)leafBounds.size();
+			leafBounds.push_back(child.box);
+			for (int k = 0; k < kWidth; k++) {
+				leaves.push_back(k < child.count ? order[child.first + k] : -1);
+			}
+		}
+		else {
+			references[i] = collapse(binary, order, children[i], depth + 1);
+		}
+	}
+
+	// the recursion grows nodes, so the node is only filled in now
+	Node& node = nodes[index];
+	memcpy(node.child, references, sizeof(references));
+	setChildBounds(node, boxes, count);
+	return index;
+}
+
+Bvh Bvh::build(const std::vector<Box>& bounds, Builder builder)
+{
+	CGRA_TRACE_SCOPE("BVH build");
+	Bvh bvh;
+	if (bounds.empty()) {
+		bvh.nodes.emplace_back();
+		bvh.nodeBounds.push_back(Box::empty());
+		bvh.levels.push_back({0});
+		Node& root = bvh.nodes[0];
+		std::fill(root.child, root.child + kWidth, kEmpty);
+		setChildBounds(root, nullptr, 0);
+		return bvh;
+	}
+
+	std::vector<int> order(bounds.size());
+	for (size_t i = 0; i < order.size(); i++) {
+		order[i] = (int)i;
+	}
+	BuildArena arena(bounds.size());
+	if (builder == BUILD_LBVH) {
+		std::vector<uint32_t> codes;
+		sortMorton(bounds, order, codes);
+		splitMorton(bounds, codes, order, 0, (int)order.size(), arena);
+	}
+	else {
+		split(bounds, order, 0, (int)order.size(), arena);
+	}
+
+	// every wide node takes the place of at least one binary inner node
+	bvh.nodes.reserve(arena.used);
+	bvh.nodeBounds.reserve(arena.used);
+	bvh.collapse(arena.nodes, order, 0, 0);
+	bvh.buildCost = bvh.getSahCost();
+	return bvh;
+}
+
+void Bvh::refit(const std::vector<Box>& bounds)
+{
+	TaskPool::getInstance()->parallelFor(getLeafCount(), kParallelGrain, [&](int begin, int end) {
+		for (int leaf = begin; leaf < end; leaf++) {
+			Box box = Box::empty();
+			for (int k = 0; k < kWidth; k++) {
+				const int32_t primitive = leaves[leaf * kWidth + k];
+				if (primitive >= 0) {
+					box.grow(bounds[primitive]);
+				}
+			}
+			leafBounds[leaf] = box;
+		}
+	});
+
+	// a node's children are all one level below it, so a level only waits for the one under it
+	for (int depth = (int)levels.size() - 1; depth >= 0; depth--) {
+		const std::vector<int>& level = levels[depth];
+		TaskPool::getInstance()->parallelFor((int)level.size(), kParallelGrain, [&](int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				refitNode(level[i]);
+			}
+		});
+	}
+}
+
+void Bvh::refitNode(int index)
+{
+	Node& node = nodes[index];
+	Box boxes[kWidth];
+	int count = 0;
+	Box box = Box::empty();
+	for (int i = 0; i < kWidth && node.child[i] != kEmpty; i++) {
+		boxes[count] = node.child[i] >= 0 ? nodeBounds[node.child[i]] : leafBounds[~node.child[i]];
+		box.grow(boxes[count++]);
+	}
+	nodeBounds[index] = box;
+	setChildBounds(node, boxes, count);
+}
+
+float Bvh::getSahCost() const
+{
+	const float rootArea = nodeBounds[0].getArea();
+	if (rootArea <= 0.0f) {
+		return 0.0f;
+	}
+
+	double area = 0.0;
+	for (const Box& box : nodeBounds) {
+		area += box.getArea();
+	}
+	for (const Box& box : leafBounds) {
+		area += box.getArea();
+	}
+	return (float)(area / rootArea);
+}
+
+void Bvh::setChildBounds(Node& node, const Box* boxes, int count)
+{
+	Box parent = Box::empty();
+	for (int i = 0; i < count; i++) {
+		parent.grow(boxes[i]);
+	}
+	if (count == 0) {
+		parent = {{0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}};
+	}
+
+	node.exponent[3] = 0;
+	node.padding[0] = 0;
+	node.padding[1] = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		node.origin[axis] = parent.min[axis];
+
+		// the smallest power of two that spans the box in 255 steps
+		const float extent = parent.max[axis] - parent.min[axis];
+		int exponent = extent > 0.0f ? (int)ceilf(log2f(extent / 255.0f)) : -126;
+		exponent = std::clamp(exponent, -126, 127);
+		while (exponent < 127 && node.origin[axis] + 255.0f * ldexpf(1.0f, exponent) < parent.max[axis]) {
+			exponent++;
+		}
+		node.exponent[axis] = (uint8_t)(exponent + 127);
+		const float step = ldexpf(1.0f, exponent);
+
+		// rounded outwards, checked with the arithmetic the kernels decode with
+		for (int i = 0; i < kWidth; i++) {
+			if (i >= count) {
+				node.lo[axis][i] = 0;
+				node.hi[axis][i] = 0;
+				continue;
+			}
+			int lo = std::clamp((int)floorf((boxes[i].min[axis] - node.origin[axis]) / step), 0, 255);
+			while (lo > 0 && node.origin[axis] + lo * step > boxes[i].min[axis]) {
+				lo--;
+			}
+			int hi = std::clamp((int)ceilf((boxes[i].max[axis] - node.origin[axis]) / step), 0, 255);
+			while (hi < 255 && node.origin[axis] + hi * step < boxes[i].max[axis]) {
+				hi++;
+			}
+			node.lo[axis][i] = (uint8_t)lo;
+			node.hi[axis][i] = (uint8_t)hi;
+		}
+	}
+}
+
+} // namespace CGRA
@@ -0,0 +1,188 @@
+#include "checkpoint.h"
+
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <filesystem>
+
+namespace CGRA {
+
+static const char kMagic[8] = {'C', 'G', 'R', 'A', 'C', 'K', 'P', '4'};
+
+static uint32_t fnv1a(uint32_t hash, const void* data, size_t size)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
+}
+
+bool Checkpoint::write(const std::string& path, const Checkpoint& checkpoint)
+{
+	const std::string temporary = path + ".tmp";
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if (file == nullptr) {
+		CGRA_LOGE("cannot open %s", temporary.c_str());
+		return false;
+	}
+
+	const int32_t header[4] = {checkpoint.width, checkpoint.height, checkpoint.scene, checkpoint.samples};
+	const uint32_t generatorLength = (uint32_t)checkpoint.generator.size();
+	const uint64_t count = checkpoint.accumulation.size();
+	const uint64_t squareCount = checkpoint.squares.size();
+	const uint64_t sampleCount = checkpoint.counts.size();
+
+	uint32_t hash = 2166136261u;
+	bool written = true;
+	auto put = [&](const void* data, size_t size) {
+		hash = fnv1a(hash, data, size);
+		written = written && fwrite(data, 1, size, file) == size;
+	};
+	put(kMagic, sizeof(kMagic));
+	put(header, sizeof(header));
+	put(&generatorLength, sizeof(generatorLength));
+	put(checkpoint.generator.data(), generatorLength);
+	put(&count, sizeof(count));
+	put(checkpoint.accumulation.data(), count * sizeof(float));
+	put(&squareCount, sizeof(squareCount));
+	put(checkpoint.squares.data(), squareCount * sizeof(float));
+	put(&sampleCount, sizeof(sampleCount));
+	put(checkpoint.counts.data(), sampleCount * sizeof(int32_t));
+	const uint32_t featureCount = (uint32_t)checkpoint.features.size();
+	put(&featureCount, sizeof(featureCount));
+	for (const auto& feature : checkpoint.features) {
+		const uint32_t nameLength = (uint32_t)feature.first.size();
+		const uint64_t count = feature.second.size();
+		put(&nameLength, sizeof(nameLength));
+		put(feature.first.data(), nameLength);
+		put(&count, sizeof(count));
+		put(feature.second.data(), count * sizeof(float));
+	}
+	written = written && fwrite(&hash, sizeof(hash), 1, file) == 1;
+
+	// the data has to be on disk before the rename makes it the checkpoint
+	written = written && fflush(file) == 0;
+#ifndef _WIN32
+	written = written && fsync(fileno(file)) == 0;
+#endif
+	written = fclose(file) == 0 && written;
+
+	std::error_code error;
+	if (written) {
+		std::filesystem::rename(temporary, path, error);
+		written = !error;
+	}
+	if (!written) {
+		CGRA_LOGE("failed to write %s", path.c_str());
+		std::filesystem::remove(temporary, error);
+	}
+	return written;
+}
+
+bool Checkpoint::read(const std::string& path, Checkpoint& checkpoint)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == nullptr) {
+		CGRA_LOGE("cannot open %s", path.c_str());
+		return false;
+	}
+
+	uint32_t hash = 2166136261u;
+	bool valid = true;
+	auto get = [&](void* data, size_t size) {
+		valid = valid && fread(data, 1, size, file) == size;
+		if (valid) {
+			hash = fnv1a(hash, data, size);
+		}
+	};
+
+	char magic[8];
+	int32_t header[4];
+	uint32_t generatorLength = 0;
+	uint64_t count = 0;
+	uint64_t squareCount = 0;
+	uint64_t sampleCount = 0;
+	get(magic, sizeof(magic));
+	// the version is the last byte of the magic
+	valid = valid && memcmp(magic, kMagic, sizeof(magic) - 1) == 0 && magic[7] >= '2' && magic[7] <= '4';
+	const bool hasCounts = valid && magic[7] >= '3';
+	const bool hasFeatures = valid && magic[7] >= '4';
+	get(header, sizeof(header));
+	get(&generatorLength, sizeof(generatorLength));
+	// an mt19937 state is about 7 KB of text, anything far beyond that is garbage
+	valid = valid && generatorLength < (1 << 16);
+	if (valid) {
+		checkpoint.generator.resize(generatorLength);
+		get(&checkpoint.generator[0], generatorLength);
+	}
+	get(&count, sizeof(count));
+	valid = valid && header[0] > 0 && header[1] > 0 && count == 3 * (uint64_t)header[0] * header[1];
+	if (valid) {
+		checkpoint.accumulation.resize(count);
+		get(checkpoint.accumulation.data(), count * sizeof(float));
+	}
+	get(&squareCount, sizeof(squareCount));
+	valid = valid && squareCount == count / 3;
+	if (valid) {
+		checkpoint.squares.resize(squareCount);
+		get(checkpoint.squares.data(), squareCount * sizeof(float));
+	}
+	if (hasCounts) {
+		get(&sampleCount, sizeof(sampleCount));
+		valid = valid && sampleCount == squareCount;
+		if (valid) {
+			checkpoint.counts.resize(sampleCount);
+			get(checkpoint.counts.data(), sampleCount * sizeof(int32_t));
+		}
+	}
+	checkpoint.features.clear();
+	if (hasFeatures) {
+		uint32_t featureCount = 0;
+		get(&featureCount, sizeof(featureCount));
+		for (uint32_t i = 0; i < featureCount && valid; i++) {
+			uint32_t nameLength = 0;
+			uint64_t featureSize = 0;
+			get(&nameLength, sizeof(nameLength));
+			valid = valid && nameLength < 256;
+			std::string name(valid ? nameLength : 0, '\0');
+			if (valid) {
+				get(&name[0], nameLength);
+			}
+			get(&featureSize, sizeof(featureSize));
+			// at most 4 channels per pixel
+			valid = valid && featureSize <= 4 * squareCount;
+			if (valid) {
+				std::vector<float>& sums = checkpoint.features[name];
+				sums.resize(featureSize);
+				get(sums.data(), featureSize * sizeof(float));
+			}
+		}
+	}
+
+	uint32_t expected = 0;
+	valid = valid && fread(&expected, sizeof(expected), 1, file) == 1 && expected == hash;
+	fclose(file);
+
+	if (!valid) {
+		CGRA_LOGE("%s is not a valid checkpoint", path.c_str());
+		return false;
+	}
+
+	checkpoint.width = header[0];
+	checkpoint.height = header[1];
+	checkpoint.scene = header[2];
+	checkpoint.samples = header[3];
+	if (!hasCounts) {
+		checkpoint.counts.assign(squareCount, header[3]);
+	}
+	return true;
+}
+
+} // namespace CGRA
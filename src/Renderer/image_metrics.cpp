@@ -0,0 +1,35 @@
+#include "image_metrics.h"
+
+#include <math.h>
+
+namespace CGRA {
+
+double ImageMetrics::rmse(const float* image, const float* reference, size_t count)
+{
+	if (count == 0) {
+		return 0.0;
+	}
+
+	double sum = 0.0;
+	for (size_t i = 0; i < count; i++) {
+		double error = (double)image[i] - reference[i];
+		sum += error * error;
+	}
+	return sqrt(sum / count);
+}
+
+double ImageMetrics::relMse(const float* image, const float* reference, size_t count, double epsilon)
+{
+	if (count == 0) {
+		return 0.0;
+	}
+
+	double sum = 0.0;
+	for (size_t i = 0; i < count; i++) {
+		double error = (double)image[i] - reference[i];
+		sum += error * error / ((double)reference[i] * reference[i] + epsilon);
+	}
+	return sum / count;
+}
+
+} // namespace CGRA
@@ -0,0 +1,163 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace CGRA {
+
+/**
+ * Four-wide bounding volume hierarchy in the layout the kernels traverse.
+ *
+ * A node stores the boxes of its four children quantised to 8 bits per
+ * plane inside its own box: the box's minimum corner, a power-of-two step
+ * per axis, and per child and plane a whole number of steps, rounded
+ * outwards so the quantised box always contains the exact one. The node,
+ * child references included, fits one 64-byte cache line, where the four
+ * float boxes alone would take 96 bytes. A leaf holds up to kWidth
+ * primitives, which the kernels test at once.
+ *
+ * build() splits top-down into a binary tree and then collapses it,
+ * pulling up the grandchildren with the largest boxes until every node has
+ * four children or only leaves below it. BUILD_SAH splits with binned SAH;
+ * BUILD_LBVH sorts the primitives along a Morton curve and splits where
+ * the codes' highest bit changes, which is several times faster but traces
+ * slower, for previews and primitives that change every frame. Both bin or
+ * sort large ranges on every core and build the halves of large nodes as
+ * tasks of the TaskPool, into binary nodes allocated up front.
+ *
+ * When primitives move, refit() keeps the tree and only recomputes its
+ * boxes, which is linear in the nodes but lets the boxes overlap more the
+ * further the primitives move from where the tree was built for.
+ * needsRebuild() tells from the SAH cost when building again pays off.
+ */
+class Bvh
+{
+public:
+	static const int kWidth = 4;
+
+	/**Child reference of an unused slot.*/
+	static const int32_t kEmpty = INT32_MIN;
+
+	/**Times the build's SAH cost past which needsRebuild() is true.*/
+	static constexpr float kRebuildThreshold = 1.5f;
+
+	struct Box {
+		float min[3];
+		float max[3];
+
+		/**The empty box, which grows into the first one added.*/
+		static Box empty();
+
+		void grow(const Box& box);
+
+		float getArea() const;
+	};
+
+	/**Same layout as struct BvhNode in test.cl.*/
+	struct alignas(64) Node {
+		int32_t child[kWidth]; // a node, ~ a leaf for a leaf, kEmpty for none
+		float origin[3];       // minimum corner of the node's box
+		uint8_t exponent[4];   // per axis the step 2^(exponent - 127), a float's biased exponent; the last is unused
+		uint8_t lo[3][kWidth]; // per axis and child, the minimum in steps from origin
+		uint8_t hi[3][kWidth]; // the maximum
+		int32_t padding[2];
+	};
+
+	enum Builder {
+		BUILD_SAH,
+		BUILD_LBVH,
+	};
+
+	/**Builds over the bounds of the primitives, which are referred to by their index in bounds.*/
+	static Bvh build(const std::vector<Box>& bounds, Builder builder = BUILD_SAH);
+
+	/**The root is node 0; a tree over no primitives is a root without children.*/
+	const std::vector<Node>& getNodes() const {
+		return nodes;
+	}
+
+	/**kWidth primitives per leaf, -1 for unused slots.*/
+	const std::vector<int32_t>& getLeaves() const {
+		return leaves;
+	}
+
+	int getLeafCount() const {
+		return (int)leaves.size() / kWidth;
+	}
+
+	/**Levels of nodes, 1 for a root with only leaves below it.*/
+	int getDepth() const {
+		return (int)levels.size();
+	}
+
+	/**
+	 * Entries a depth-first walk's stack of inner nodes can need: every
+	 * level on the way down leaves at most kWidth - 1 siblings behind.
+	 */
+	int getStackSize() const {
+		return (kWidth - 1) * getDepth() + 1;
+	}
+
+	/**Exact box of the whole tree.*/
+	const Box& getBounds() const {
+		return nodeBounds[0];
+	}
+
+	/**
+	 * Recomputes every box for new bounds of the same primitives, leaves
+	 * first and then the nodes a level at a time from the bottom up. Levels
+	 * with many nodes are split over the cores.
+	 */
+	void refit(const std::vector<Box>& bounds);
+
+	/**
+	 * Expected cost of a ray through the tree: the summed surface areas of
+	 * the nodes and leaves, each one box or sphere block test, over the
+	 * root's area.
+	 */
+	float getSahCost() const;
+
+	/**getSahCost() right after the build.*/
+	float getBuildCost() const {
+		return buildCost;
+	}
+
+	/**True once refits have grown the SAH cost past threshold times the build's.*/
+	bool needsRebuild(float threshold = kRebuildThreshold) const {
+		return getSahCost() > threshold * buildCost;
+	}
+
+	/**Quantises boxes, at most kWidth, into node.*/
+	static void setChildBounds(Node& node, const Box* boxes, int count);
+
+private:
+	struct BuildNode;
+	struct BuildArena;
+
+	/**Builds the binary tree over count primitives of order from first on, reordering them; returns its root.*/
+	static int split(const std::vector<Box>& bounds, std::vector<int>& order, int first, int count, BuildArena& arena);
+
+	/**Same over primitives sorted by their Morton codes.*/
+	static int splitMorton(const std::vector<Box>& bounds, const std::vector<uint32_t>& codes, const std::vector<int>& order, int first, int count, BuildArena& arena);
+
+	/**Emits binary node source and what it collapses into at depth, returns the node's index.*/
+	int collapse(const std::vector<BuildNode>& binary, const std::vector<int>& order, int source, int depth);
+
+	/**Sets node's boxes from its children's, which are up to date.*/
+	void refitNode(int node);
+
+	std::vector<Node> nodes;
+	std::vector<int32_t> leaves;
+	std::vector<Box> nodeBounds;          // exact, per node
+	std::vector<Box> leafBounds;          // exact, per leaf
+	std::vector<std::vector<int>> levels; // the nodes at every depth, the root's first
+	float buildCost = 0.0f;
+};
+
+static_assert(sizeof(Bvh::Node) == 64, "a node is one cache line");
+
+} // namespace CGRA
+
+#endif // BVH_H
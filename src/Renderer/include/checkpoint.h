@@ -0,0 +1,45 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace CGRA {
+
+/**
+ * Everything a progressive render needs to continue bit-exactly: the raw
+ * accumulation sums, the per-pixel and overall sample counts, the feature
+ * sums and the state of the host RNG that feeds the kernels.
+ *
+ * File layout, little endian:
+ *   "CGRACKP4", i32 width, i32 height, i32 scene, i32 samples,
+ *   u32 length + RNG state as text, u64 count + RGB sums, u64 count + luminance
+ *   squared sums, u64 count + i32 per-pixel samples, u32 feature count and per
+ *   feature u32 length + name, u64 count + sums, u32 FNV-1a of all before
+ * Version 2 and 3 files are still read, without features; version 2 has no
+ * per-pixel samples either, every pixel then has the overall sample count.
+ */
+struct Checkpoint {
+	int width = 0;
+	int height = 0;
+	int scene = 0;
+	int samples = 0;
+	std::string generator;
+	std::vector<float> accumulation;
+	std::vector<float> squares;
+	std::vector<int32_t> counts;
+	std::map<std::string, std::vector<float>> features; // by Renderer::getAovName()
+
+	/**Writes to path.tmp and renames it over path, so path is always a whole checkpoint.*/
+	static bool write(const std::string& path, const Checkpoint& checkpoint);
+
+	/**Returns false if the file is missing, truncated or corrupt.*/
+	static bool read(const std::string& path, Checkpoint& checkpoint);
+};
+
+} // namespace CGRA
+
+#endif // CHECKPOINT_H
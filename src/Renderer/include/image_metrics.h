@@ -0,0 +1,27 @@
+#ifndef IMAGE_METRICS_H
+#define IMAGE_METRICS_H
+
+#include <stddef.h>
+
+namespace CGRA {
+
+/**
+ * Error of a linear RGB image against a reference of the same size, count
+ * is the number of floats (3 per pixel).
+ */
+class ImageMetrics
+{
+public:
+	/**Root mean squared error over all channels.*/
+	static double rmse(const float* image, const float* reference, size_t count);
+
+	/**
+	 * Relative MSE, the squared error of each channel divided by the squared
+	 * reference plus epsilon, so dark and bright regions weigh the same.
+	 */
+	static double relMse(const float* image, const float* reference, size_t count, double epsilon = 1e-2);
+};
+
+} // namespace CGRA
+
+#endif // IMAGE_METRICS_H
@@ -0,0 +1,79 @@
+#ifndef RENDER_SCHEDULER_H
+#define RENDER_SCHEDULER_H
+
+#include <stdint.h>
+
+namespace CGRA {
+
+/**
+ * Decides how many samples to render next so a progressive render stops
+ * exactly at a budget.
+ *
+ * Any combination of a sample count, a wall clock budget measured from
+ * construction, and a noise threshold on Renderer::estimateNoise() can be
+ * set; the first one reached ends the render. Batches are sized from a
+ * running estimate of the cost per sample: long enough to keep the checks
+ * cheap, and shrinking towards the end so the last one lands on the sample
+ * or time budget instead of overshooting it.
+ */
+class RenderScheduler
+{
+public:
+	struct Budget {
+		int samples = 0;      // 0 for no limit
+		double seconds = 0.0; // 0 for no limit
+		double noise = 0.0;   // 0 for no limit
+	};
+
+	enum Reason {
+		RUNNING,
+		DONE_SAMPLES,
+		DONE_TIME,
+		DONE_NOISE,
+	};
+
+	RenderScheduler(const Budget& budget);
+
+	/**
+	 * Samples to render before the next call, 0 once the render is done.
+	 * noise is the current Renderer::estimateNoise(), only read when a noise
+	 * threshold is set.
+	 */
+	int nextBatch(int samples, double noise);
+
+	/**Reports how long the batch returned by nextBatch() took.*/
+	void finishBatch(int samples, uint64_t nanoseconds);
+
+	/**True when nextBatch() wants a fresh noise estimate.*/
+	bool needsNoise() const {
+		return budget.noise > 0.0;
+	}
+
+	Reason getReason() const {
+		return reason;
+	}
+
+	static const char* getReasonName(Reason reason);
+
+	/**Seconds since construction.*/
+	double getElapsed() const;
+
+	/**Estimated seconds per sample, 0 before the first batch.*/
+	double getSampleCost() const {
+		return sampleCost * 1e-9;
+	}
+
+private:
+	/**Noise below this many samples is too noisy itself to stop on.*/
+	static const int kMinNoiseSamples = 16;
+
+	Budget budget;
+	uint64_t begin;
+	double sampleCost;      // ns, running mean
+	double sampleDeviation; // ns, running mean absolute deviation
+	Reason reason;
+};
+
+} // namespace CGRA
+
+#endif // RENDER_SCHEDULER_H
@@ -0,0 +1,550 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#if defined(__APPLE__) || defined(__MACOSX)
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <stdint.h>
+
+#include <future>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+#include "image_writer.h"
+#include "opencl_task.h"
+#include "scene_description.h"
+
+namespace CGRA {
+
+/**
+ * Progressive path tracer on top of the kernels in src/OpenCL/test.cl.
+ *
+ * step() launches samples for every active pixel and wait() waits for them;
+ * the kernels add their samples to accumulation buffers on the device, which
+ * are only read back when the host asks for the image. Without adaptive
+ * sampling every pixel is active. The kernels build and the skybox decodes in
+ * the background; nothing may be stepped before isReady() returns true.
+ *
+ * Next to the colour the kernels can write arbitrary output variables. The
+ * ones on the device are compiled into the kernels only when requested, so
+ * the ones not asked for cost nothing. Depth, normal and albedo also guide
+ * the optional edge-avoiding a-trous denoiser.
+ *
+ * The camera is set from the host. A move normally restarts the
+ * accumulation; with temporal accumulation on, the samples from before the
+ * move are reprojected onto the new view where they still see the same
+ * surface, so navigation does not start from a single noisy sample. While
+ * the camera moves, setPreview() traces a sparse grid of pixels and fills
+ * the rest from it, which keeps a launch short enough for every frame; the
+ * same grids give setProgressive() a coarse image long before the first
+ * full pass is done.
+ *
+ * Each scene is a SceneDescription. The constructor builds a quantised
+ * four-wide Bvh over the spheres of each of its objects, the bottom level,
+ * and one over its instances, the top level, and uploads them for the
+ * kernels to traverse. Moving an instance only rebuilds the top level.
+ */
+class Renderer : public OpenclTask
+{
+public:
+	enum Scene {
+		SCENE_SPHERES, // "render" kernel
+		SCENE_CUBEMAP, // "demo_cubemap" kernel
+	};
+
+	/**Both kernels run a fixed loop of 40 bounces, every sample traces this many rays.*/
+	static const int kRaysPerSample = 40;
+
+	/**Samples every pixel gets before adaptive sampling may drop it.*/
+	static const int kMinAdaptiveSamples = 16;
+
+	/**Levels of the a-trous filter, its footprint is 4 * 2^levels + 1 pixels wide.*/
+	static const int kDenoiseLevels = 5;
+
+	/**Launches setProgressive() splits the first pass into, each with 4 times the pixels of the one before.*/
+	static const int kProgressiveLevels = 3;
+
+	/**Samples of reprojected history a pixel keeps after a camera move.*/
+	static const int kTemporalHistory = 32;
+
+	/**Entries of the kernels' BVH traversal stack, BVH_STACK_SIZE in test.cl.*/
+	static const int kBvhStackSize = 64;
+
+	/**Thin lens camera with +y up; an aperture of 0 is a pinhole.*/
+	struct Camera {
+		float position[3] = {0.0f, 0.0f, 0.0f};
+		float yaw = 0.0f;           // radians, 0 looks along +z, positive turns towards +x
+		float pitch = 0.0f;         // radians, positive looks up
+		float fov = 90.0f;          // vertical, degrees
+		float aperture = 0.0f;      // lens diameter
+		float focusDistance = 1.0f; // along the view direction
+	};
+
+	/**Arbitrary output variables, combined as a bit mask.*/
+	enum Aov {
+		AOV_DEPTH        = 1 << 0, // distance along the primary ray
+		AOV_NORMAL       = 1 << 1, // first-hit world normal
+		AOV_ALBEDO       = 1 << 2, // first-hit colour, the background for a miss
+		AOV_PRIMITIVE_ID = 1 << 3, // first-hit sphere of the last sample, -1 for a miss
+		AOV_MATERIAL_ID  = 1 << 4, // diffuse 0, mirror 1, light 2, -1 for a miss
+		AOV_DIRECT       = 1 << 5, // light after at most one bounce
+		AOV_INDIRECT     = 1 << 6, // the rest, direct + indirect is the colour
+		AOV_SAMPLE_COUNT = 1 << 7, // from the accumulation, free
+		AOV_VARIANCE     = 1 << 8, // of the luminance mean, from the accumulation, free
+	};
+
+	/**The AOVs written by the kernels, the others come from the accumulation.*/
+	static const unsigned kDeviceAovs = AOV_DEPTH | AOV_NORMAL | AOV_ALBEDO | AOV_PRIMITIVE_ID | AOV_MATERIAL_ID | AOV_DIRECT | AOV_INDIRECT;
+
+	/**The AOVs the denoiser is guided by, compiled in while it is on.*/
+	static const unsigned kDenoiseAovs = AOV_DEPTH | AOV_NORMAL | AOV_ALBEDO;
+
+	/**The AOVs temporal accumulation reprojects and tests disocclusion with, compiled in while it is on.*/
+	static const unsigned kTemporalAovs = AOV_DEPTH | AOV_NORMAL;
+
+	/**aovs is the initial setAovs(), passing it here saves a rebuild.*/
+	Renderer(const char* const kernelFile, const char* const skyboxDirectory, int width, int height, unsigned aovs = 0);
+
+	virtual ~Renderer();
+
+	/**True once the skybox is uploaded and the program is built, never blocks.*/
+	bool isReady();
+
+	/**Blocks until isReady(), with the program built for the AOVs asked for so far; false if it failed to build.*/
+	bool waitUntilReady();
+
+	/**
+	 * Also moves the AOVs to the layout of a swapped in program, which
+	 * resets the accumulation, except right after resume(): then the
+	 * samples stay and only the AOVs new to the layout start from zero.
+	 */
+	virtual bool update() override;
+
+	/**
+	 * Launches count samples per active pixel with a fresh seed. Every
+	 * work-item traces its samples one after another and adds them to the
+	 * accumulation once, so a few samples per launch amortise the launch;
+	 * too many make a single launch long enough to trip the display
+	 * driver's watchdog.
+	 */
+	void step(int count = 1);
+
+	/**Waits for the launched samples to be added to the device accumulation.*/
+	void wait();
+
+	/**Average so far, or the denoised average, gamma corrected and clamped to 8 bit RGB.*/
+	void resolve(uint8_t* rgb);
+
+	/**Average so far in linear float RGB.*/
+	void getAverage(float* rgb);
+
+	/**Denoised average so far in linear float RGB, filtered on the device.*/
+	void getDenoised(float* rgb);
+
+	/**
+	 * Average so far as R, G and B channels, for ImageWriter. With the
+	 * denoiser on R, G and B are denoised and the average is in noisy.R,
+	 * noisy.G and noisy.B. Every AOV asked for and available is added too.
+	 */
+	Image getImage();
+
+	/**
+	 * Selects the AOVs getImage() writes. Device AOVs need the program
+	 * rebuilt; the rebuild runs in the background and update() or
+	 * waitUntilReady() switch to it.
+	 */
+	void setAovs(unsigned aovs);
+
+	unsigned getAovs() const {
+		return outputAovs;
+	}
+
+	/**
+	 * Per-pixel value of aov, getAovChannels() floats per pixel: the mean
+	 * over the samples, the last sample's for the ids. False if the live
+	 * program does not write it (yet).
+	 */
+	bool getAov(Aov aov, float* data);
+
+	/**
+	 * Mean over the pixels of the relative standard error of their luminance,
+	 * from the per-pixel sum of squares. 0 before the second sample.
+	 */
+	double estimateNoise();
+
+	/**
+	 * Adaptive sampling: from minSamples on, step() only traces pixels whose
+	 * relative standard error, or one of their neighbours', is above
+	 * threshold. The active list is compacted on the device before every
+	 * launch. 0 samples every pixel every step, the default.
+	 */
+	void setAdaptive(float threshold, int minSamples = kMinAdaptiveSamples);
+
+	float getAdaptiveThreshold() const {
+		return adaptiveThreshold;
+	}
+
+	/**
+	 * Filters what resolve() and getImage() return with levels of an
+	 * edge-avoiding a-trous wavelet guided by kDenoiseAovs, which it compiles
+	 * in. The accumulation itself stays unfiltered.
+	 */
+	void setDenoiser(bool enabled, int levels = kDenoiseLevels);
+
+	bool isDenoising() const {
+		return denoise;
+	}
+
+	/**
+	 * Moves the camera, which restarts the accumulation. With temporal
+	 * accumulation the next step() brings the old samples along.
+	 */
+	void setCamera(const Camera& camera);
+
+	const Camera& getCamera() const {
+		return camera;
+	}
+
+	/**Where each scene's kernel used to have its camera, setScene() moves back there.*/
+	static Camera getDefaultCamera(Scene scene);
+
+	/**Unit view direction and the unit image right vector of camera.*/
+	static void getCameraAxes(const Camera& camera, float forward[3], float right[3]);
+
+	/**
+	 * From the next step() on, traces only every stride-th pixel of every
+	 * stride-th row, and until the next restart shows every pixel without
+	 * samples as the traced one of its block. The samples are real samples
+	 * of those pixels and stay in the accumulation. 1 traces every pixel.
+	 */
+	void setPreview(int stride);
+
+	int getPreview() const {
+		return previewStride;
+	}
+
+	/**
+	 * Progressive resolution: the first pass after a restart is split into
+	 * kProgressiveLevels launches over disjoint pixel sets, every 4th pixel
+	 * of every 4th row first, then the rest of every 2nd of every 2nd row,
+	 * then the remaining pixels. resolve() shows each level upsampled from
+	 * the nearest traced pixel. No pixel is traced twice, so the levels
+	 * together are exactly one pass; getSampleCount() counts it when the
+	 * last one is done. A restart with history to reproject, or after a
+	 * preview, starts with a full pass instead.
+	 */
+	void setProgressive(bool enabled);
+
+	bool isProgressive() const {
+		return progressive;
+	}
+
+	/**
+	 * Temporal accumulation: after a camera move, the first step() adds the
+	 * samples of the old view, at most maxHistory of them per pixel, to every
+	 * pixel that still sees the same surface. Compiles in kTemporalAovs.
+	 */
+	void setTemporal(bool enabled, int maxHistory = kTemporalHistory);
+
+	bool isTemporal() const {
+		return temporal;
+	}
+
+	/**Pixels the next step() traces, all of them without adaptive sampling.*/
+	int getActivePixels() const {
+		return activePixels;
+	}
+
+	/**True once adaptive sampling has no pixel left above the threshold.*/
+	bool isConverged() const {
+		return adaptiveThreshold > 0.0f && samples >= adaptiveMinSamples && activePixels == 0;
+	}
+
+	void resetAccumulation();
+
+	/**The host RNG that seeds every launch, seeded from std::random_device by default.*/
+	void setSeed(uint32_t seed);
+
+	/**
+	 * Snapshots the accumulation, sample count and RNG state and writes them
+	 * to path on a background thread. Returns false without writing if the
+	 * previous checkpoint is still being written.
+	 */
+	bool saveCheckpoint(const std::string& path);
+
+	/**Blocks until the last checkpoint is on disk, returns whether it was written.*/
+	bool waitForCheckpoint();
+
+	/**
+	 * Continues a render from a checkpoint of the same size, bit-exactly.
+	 * Waits for the program built for the AOVs asked for so far first, so
+	 * the checkpoint's AOVs are restored into the layout that renders on.
+	 */
+	bool resume(const std::string& path);
+
+	void setScene(Scene scene);
+
+	void changeScene();
+
+	Scene getScene() const {
+		return scene;
+	}
+
+	static const char* getSceneName(Scene scene);
+
+	/**The objects, instances and materials of the current scene.*/
+	const SceneDescription& getSceneDescription() const {
+		return scenes[scene].description;
+	}
+
+	/**
+	 * Moves an instance of the current scene, which restarts the
+	 * accumulation. Only the top-level BVH over the instances is rebuilt.
+	 * False for an unknown instance or a singular transform.
+	 */
+	bool setInstanceTransform(int instance, const SceneDescription::Transform& transform);
+
+	/**
+	 * Replaces the spheres of an object of the current scene, which
+	 * restarts the accumulation; for animation. With as many spheres as
+	 * before the object's BVH is refit in place, until refitting has grown
+	 * its SAH cost past Bvh::kRebuildThreshold times the build's; then, or
+	 * when the count changes, that object's BVH alone is rebuilt. The top
+	 * level is rebuilt either way.
+	 */
+	bool setObjectSpheres(int object, const std::vector<SceneDescription::Sphere>& spheres);
+
+	/**The bottom-level BVH of an object of the current scene, as setObjectSpheres() left it.*/
+	const Bvh& getObjectTree(int object) const {
+		return scenes[scene].objectTrees[object];
+	}
+
+	/**
+	 * How the objects' BVHs are built, Bvh::BUILD_SAH by default. Changing
+	 * it rebuilds them in every scene; Bvh::BUILD_LBVH builds several times
+	 * faster for slower tracing, for scenes whose objects are rebuilt often.
+	 * The top level is always built with SAH.
+	 */
+	void setBvhBuilder(Bvh::Builder builder);
+
+	Bvh::Builder getBvhBuilder() const {
+		return bvhBuilder;
+	}
+
+	static const char* getAovName(Aov aov);
+
+	/**Looks an AOV up by getAovName(), false if there is none.*/
+	static bool findAov(const char* const name, Aov& aov);
+
+	static int getAovChannels(Aov aov);
+
+	int getWidth() const {
+		return width;
+	}
+
+	int getHeight() const {
+		return height;
+	}
+
+	/**Passes so far, the most samples any pixel has; see getActivePixels() for adaptive sampling.*/
+	int getSampleCount() const {
+		return samples;
+	}
+
+private:
+	void loadCubemap();
+
+	/**Fills activeBuffer and activePixels for the next launch.*/
+	void compactActivePixels();
+
+	/**Reads the device accumulation into the host copies if a sample was added since.*/
+	void readAccumulation();
+
+	/**Runs the denoiser and reads its output into denoisedColor if a sample was added since.*/
+	void runDenoiser();
+
+	/**Adds the history to the accumulation of the launch just queued, see setTemporal().*/
+	void reprojectHistory();
+
+	/**The camera as the kernels take it, struct Camera in test.cl.*/
+	struct CameraData {
+		cl_float3 position;
+		cl_float3 forward;
+		cl_float3 right;
+		cl_float3 up;
+		cl_float tanHalfFov;
+		cl_float aperture;
+		cl_float focusDistance;
+	};
+
+	static CameraData getCameraData(const Camera& camera);
+
+	/**Four spheres of a BVH leaf as the kernels take them, struct SphereBlock in test.cl.*/
+	struct SphereBlock {
+		cl_float4 x;
+		cl_float4 y;
+		cl_float4 z;
+		cl_float4 radius; // 0 for an unused lane
+	};
+
+	/**struct Material in test.cl.*/
+	struct MaterialData {
+		cl_float3 color;
+		cl_int type;
+	};
+
+	/**An instance as the kernels take it, struct Instance in test.cl.*/
+	struct InstanceData {
+		cl_float4 worldToObject[3]; // rows of the inverse transform
+		cl_int root;                // of its object in nodes, -1 for an unused lane of a leaf
+		cl_int firstSphere;         // of its object, in the numbering of sphereIds
+		cl_int primitiveOffset;     // SceneDescription::getPrimitiveOffsets()
+		cl_int padding;
+	};
+
+	/**A scene on the host and its device copy.*/
+	struct SceneData {
+		SceneDescription description;
+		Bvh::Builder builder;               // of objectTrees
+		std::vector<Bvh> objectTrees;       // the bottom level, in object space
+		std::vector<int> objectRoots;       // into nodes
+		std::vector<int> objectFirstBlock;  // into spheres
+		std::vector<int> objectFirstSphere; // in the numbering of sphereIds
+		cl_mem tlas;      // Bvh::Node over the instances
+		cl_mem instances; // InstanceData, Bvh::kWidth per top-level leaf
+		cl_mem nodes;     // Bvh::Node of every object, one after another
+		cl_mem spheres;   // SphereBlock, one per bottom-level leaf
+		cl_mem sphereIds; // per leaf lane the sphere's index among all objects' spheres, -1 for none
+		cl_mem materials; // MaterialData of every object's spheres
+	};
+
+	/**Builds the bottom level of every object of data's description with data.builder and uploads it, then the top level.*/
+	static void createScene(SceneData& data);
+
+	/**Appends object's nodes, leaf blocks, sphere ids and materials at the place uploadObjects() gave it.*/
+	static void packObject(const SceneData& data, int object, std::vector<Bvh::Node>& nodes, std::vector<SphereBlock>& blocks, std::vector<cl_int>& sphereIds, std::vector<MaterialData>& materials);
+
+	/**Uploads every object's tree one after another, replacing the buffers before.*/
+	static void uploadObjects(SceneData& data);
+
+	/**Builds the top level over data's instances and uploads it, replacing the one before.*/
+	static void uploadInstances(SceneData& data);
+
+	/**False, and logs the object, if a walk of tlas and an object's tree below it could overflow kBvhStackSize.*/
+	static bool checkTraversalStack(const SceneData& data, const Bvh& tlas);
+
+	/**Grid spacing of a setProgressive() level, 1 for the last.*/
+	static int getLevelStride(int level);
+
+	/**The pixel resolve() and getAverage() show for pixel, the nearest traced one if it has no samples.*/
+	size_t getShownPixel(size_t pixel) const;
+
+	/**Device AOVs the program should be built for.*/
+	unsigned getRequestedAovs() const;
+
+	/**-D defines that compile aovs into the kernels, in the layout getAovOffset() assumes.*/
+	static std::string getAovOptions(unsigned aovs);
+
+	/**The device AOVs a program built with options writes.*/
+	static unsigned getAovsFromOptions(const std::string& options);
+
+	/**Offset of aov in a pixel of aovBuffer, -1 if the live program does not write it.*/
+	int getAovOffset(Aov aov) const;
+
+	/**Reallocates aovBuffer for the device AOVs of the live program.*/
+	void setAovLayout(unsigned aovs);
+
+	/**Variance of pixel's luminance mean, 0 below two samples.*/
+	double getMeanVariance(size_t pixel) const;
+
+	Scene scene;
+	int width;
+	int height;
+	int samples;
+	int launchedSamples; // per pixel, by the launch wait() waits for
+
+	float adaptiveThreshold;
+	int adaptiveMinSamples;
+	int activePixels;
+
+	unsigned outputAovs; // asked for by setAovs()
+	unsigned aovs;       // written by the live program, the layout of aovBuffer
+	int aovStride;       // floats per pixel in aovBuffer
+
+	Camera camera;
+	Camera historyCamera;   // the view of the history buffers
+	int historyStride;      // the coveredStride of the history
+	bool temporal;
+	int temporalHistory;
+	bool historyPending;    // the history waits for the first launch after a move
+
+	int previewStride;
+	int previewPixels;      // in previewBuffer
+	int launchedStride;     // by the launch wait() waits for
+	int coveredStride;      // finest stride traced since the restart, 0 before the first launch
+
+	bool progressive;
+	int progressiveLevel;   // the next level step() launches, kProgressiveLevels once the first pass is done
+	int levelPixels[kProgressiveLevels];
+
+	bool denoise;
+	int denoiseLevels;
+	bool denoiseChanged; // denoisedColor is older than the accumulation
+	float* denoisedColor;
+
+	// host copies of the device accumulation, valid unless accumulationChanged
+	float* accumulatedColor;
+	float* accumulatedSquare; // luminance squared, one per pixel
+	int* sampleCount;         // one per pixel
+	std::vector<float> aovSums;
+	bool accumulationChanged;
+	bool resumed;             // the accumulation is a checkpoint's, with no launch since
+
+	cl_mem accumulationBuffer;
+	cl_mem squareBuffer;
+	cl_mem countBuffer;
+	cl_mem aovBuffer;                    // aovStride floats per pixel, never empty so it can always be bound
+	// the accumulation before the last camera move, allocated by setTemporal()
+	cl_mem historyAccumulationBuffer;
+	cl_mem historySquareBuffer;
+	cl_mem historyCountBuffer;
+	cl_mem historyAovBuffer;
+	cl_mem denoiseColorBuffer[2];        // float4 ping-pong, demodulated colour and variance
+	cl_mem denoiseGuideBuffer;           // float4, normal and depth
+	cl_mem denoiseAlbedoBuffer;          // float4
+	cl_mem denoiseOutputBuffer;          // RGB
+	cl_mem allPixelsBuffer; // 0 .. width * height - 1
+	cl_mem activeBuffer;
+	cl_mem activeCountBuffer;
+	cl_mem previewBuffer;   // the pixels setPreview() traces
+	cl_mem levelBuffer[kProgressiveLevels]; // the pixels of each setProgressive() level
+	Bvh::Builder bvhBuilder;
+	SceneData scenes[SCENE_CUBEMAP + 1];
+	cl_event event;
+
+	std::mt19937 generator;
+	std::future<bool> checkpointWritten;
+
+	OpenclKernel* renderKernel;
+	OpenclKernel* cubemapKernel;
+	OpenclKernel* compactKernel;
+	OpenclKernel* reprojectKernel;
+	OpenclKernel* denoisePrepareKernel;
+	OpenclKernel* denoiseAtrousKernel;
+	OpenclKernel* denoiseFinishKernel;
+
+	// top, bottom, left, right, front, back
+	std::string skyboxDirectory;
+	uint8_t* cubemap[6];
+	cl_mem cubemapBuffer[6];
+	std::future<void> cubemapLoaded;
+};
+
+} // namespace CGRA
+
+#endif // RENDERER_H
@@ -0,0 +1,75 @@
+#ifndef SCENE_DESCRIPTION_H
+#define SCENE_DESCRIPTION_H
+
+#include <vector>
+
+namespace CGRA {
+
+/**
+ * The geometry and materials of a scene on the host. Geometry is a set of
+ * objects, each a group of spheres in its own space, placed in the world
+ * by instances; an object can be instanced any number of times and is
+ * stored once. The renderer builds a Bvh over every object and one over
+ * the instances and uploads them; the kernels only see them through their
+ * buffers.
+ */
+struct SceneDescription {
+	/**The MATERIAL_* types in test.cl, also the material_id AOV.*/
+	enum MaterialType {
+		MATERIAL_DIFFUSE = 0,
+		MATERIAL_MIRROR = 1,
+		MATERIAL_LIGHT = 2,
+	};
+
+	struct Material {
+		float color[3];
+		MaterialType type;
+	};
+
+	struct Sphere {
+		float center[3];
+		float radius;
+		int material; // into materials
+	};
+
+	struct Object {
+		std::vector<Sphere> spheres;
+	};
+
+	/**An affine object to world transform, the rows of a 3x4 matrix.*/
+	struct Transform {
+		float m[3][4] = {{1.0f, 0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 1.0f, 0.0f}};
+
+		static Transform translation(float x, float y, float z);
+
+		/**False and no change to inverse if the transform is singular.*/
+		bool invert(Transform& inverse) const;
+
+		void apply(const float point[3], float result[3]) const;
+	};
+
+	struct Instance {
+		int object; // into objects
+		Transform transform;
+	};
+
+	std::vector<Object> objects;
+	std::vector<Instance> instances;
+	std::vector<Material> materials;
+
+	/**
+	 * Per instance the primitive_id AOV of its first sphere: the spheres of
+	 * the instances before it, so every placed sphere has its own id.
+	 */
+	std::vector<int> getPrimitiveOffsets() const;
+
+	/**A light, a mirror and a diffuse sphere in a box of huge spheres, the "render" kernel's.*/
+	static SceneDescription getSpheres();
+
+	/**Two instances of a mirror sphere under the skybox, the "demo_cubemap" kernel's.*/
+	static SceneDescription getCubemap();
+};
+
+} // namespace CGRA
+
+#endif // SCENE_DESCRIPTION_H
@@ -0,0 +1,104 @@
+#include "render_scheduler.h"
+
+#include "timer.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+namespace CGRA {
+
+/**Between two checks of the budget when nothing else limits the batch.*/
+static const double kCheckInterval = 0.25e9;
+
+/**Weight of the newest batch in the running cost estimate.*/
+static const double kCostWeight = 0.25;
+
+RenderScheduler::RenderScheduler(const Budget& budget)
+	: budget(budget)
+	, begin(UTILITY::Clock::now())
+	, sampleCost(0.0)
+	, sampleDeviation(0.0)
+	, reason(RUNNING)
+{
+
+}
+
+int RenderScheduler::nextBatch(int samples, double noise)
+{
+	if (reason != RUNNING) {
+		return 0;
+	}
+
+	if (budget.samples > 0 && samples >= budget.samples) {
+		reason = DONE_SAMPLES;
+		return 0;
+	}
+
+	if (budget.noise > 0.0 && samples >= kMinNoiseSamples && noise <= budget.noise) {
+		reason = DONE_NOISE;
+		return 0;
+	}
+
+	// one sample at a time until the cost is known
+	if (sampleCost <= 0.0) {
+		return 1;
+	}
+
+	double batch = std::max(1.0, floor(kCheckInterval / sampleCost));
+	if (budget.samples > 0) {
+		batch = std::min(batch, (double)(budget.samples - samples));
+	}
+
+	if (budget.seconds > 0.0) {
+		// plan with a pessimistic cost so the last batch ends before the budget, not after
+		const double remaining = budget.seconds * 1e9 - (double)(UTILITY::Clock::now() - begin);
+		const double fit = floor(remaining / (sampleCost + 2.0 * sampleDeviation));
+		if (fit < 1.0) {
+			reason = DONE_TIME;
+			return 0;
+		}
+		batch = std::min(batch, fit);
+	}
+
+	return (int)batch;
+}
+
+void RenderScheduler::finishBatch(int samples, uint64_t nanoseconds)
+{
+	if (samples <= 0) {
+		return;
+	}
+
+	const double cost = (double)nanoseconds / samples;
+	if (sampleCost <= 0.0) {
+		sampleCost = cost;
+		sampleDeviation = cost * 0.5;
+		return;
+	}
+
+	sampleDeviation += kCostWeight * (fabs(cost - sampleCost) - sampleDeviation);
+	sampleCost += kCostWeight * (cost - sampleCost);
+}
+
+double RenderScheduler::getElapsed() const
+{
+	return (UTILITY::Clock::now() - begin) * 1e-9;
+}
+
+const char* RenderScheduler::getReasonName(Reason reason)
+{
+	switch (reason) {
+	case RUNNING:
+		return "running";
+	case DONE_SAMPLES:
+		return "sample budget";
+	case DONE_TIME:
+		return "time budget";
+	case DONE_NOISE:
+		return "noise threshold";
+	}
+	return "unknown";
+}
+
+} // namespace CGRA
@@ -0,0 +1,1437 @@
+#include "renderer.h"
+
+#include "bvh.h"
+#include "checkpoint.h"
+#include "opencl_manager.h"
+#include "opencl_profiler.h"
+#include "trace.h"
+#include "log.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+namespace CGRA {
+
+static const char* const kCubemapFaces[6] = {"top.jpg", "bottom.jpg", "left.jpg", "right.jpg", "front.jpg", "back.jpg"};
+
+struct AovInfo {
+	Renderer::Aov aov;
+	const char* name;
+	const char* define; // in test.cl
+	int channels;
+	const char* channelNames[3];
+};
+
+// in the order the kernels lay them out
+static const AovInfo kAovs[] = {
+	{Renderer::AOV_DEPTH, "depth", "AOV_DEPTH", 1, {"Z"}},
+	{Renderer::AOV_NORMAL, "normal", "AOV_NORMAL", 3, {"N.X", "N.Y", "N.Z"}},
+	{Renderer::AOV_ALBEDO, "albedo", "AOV_ALBEDO", 3, {"albedo.R", "albedo.G", "albedo.B"}},
+	{Renderer::AOV_PRIMITIVE_ID, "primitive_id", "AOV_PRIMITIVE_ID", 1, {"primitive_id"}},
+	{Renderer::AOV_MATERIAL_ID, "material_id", "AOV_MATERIAL_ID", 1, {"material_id"}},
+	{Renderer::AOV_DIRECT, "direct", "AOV_DIRECT", 3, {"direct.R", "direct.G", "direct.B"}},
+	{Renderer::AOV_INDIRECT, "indirect", "AOV_INDIRECT", 3, {"indirect.R", "indirect.G", "indirect.B"}},
+	{Renderer::AOV_SAMPLE_COUNT, "samples", nullptr, 1, {"samples"}},
+	{Renderer::AOV_VARIANCE, "variance", nullptr, 1, {"variance"}},
+};
+
+Renderer::Renderer(const char* const kernelFile, const char* const skyboxDirectory, int width, int height, unsigned aovs)
+	: OpenclTask(kernelFile, getAovOptions(aovs & kDeviceAovs))
+	, scene(SCENE_CUBEMAP)
+	, width(width)
+	, height(height)
+	, samples(0)
+	, launchedSamples(0)
+	, adaptiveThreshold(0.0f)
+	, adaptiveMinSamples(kMinAdaptiveSamples)
+	, activePixels(width * height)
+	, outputAovs(aovs)
+	, aovs(0)
+	, aovStride(0)
+	, camera(getDefaultCamera(SCENE_CUBEMAP))
+	, historyCamera(camera)
+	, historyStride(1)
+	, temporal(false)
+	, temporalHistory(kTemporalHistory)
+	, historyPending(false)
+	, previewStride(1)
+	, previewPixels(0)
+	, launchedStride(1)
+	, coveredStride(0)
+	, progressive(false)
+	, progressiveLevel(kProgressiveLevels)
+	, levelPixels()
+	, denoise(false)
+	, denoiseLevels(kDenoiseLevels)
+	, denoiseChanged(false)
+	, denoisedColor(nullptr)
+	, accumulatedColor(nullptr)
+	, accumulatedSquare(nullptr)
+	, sampleCount(nullptr)
+	, aovSums()
+	, accumulationChanged(false)
+	, resumed(false)
+	, accumulationBuffer(nullptr)
+	, squareBuffer(nullptr)
+	, countBuffer(nullptr)
+	, aovBuffer(nullptr)
+	, historyAccumulationBuffer(nullptr)
+	, historySquareBuffer(nullptr)
+	, historyCountBuffer(nullptr)
+	, historyAovBuffer(nullptr)
+	, denoiseColorBuffer()
+	, denoiseGuideBuffer(nullptr)
+	, denoiseAlbedoBuffer(nullptr)
+	, denoiseOutputBuffer(nullptr)
+	, allPixelsBuffer(nullptr)
+	, activeBuffer(nullptr)
+	, activeCountBuffer(nullptr)
+	, previewBuffer(nullptr)
+	, levelBuffer()
+	, bvhBuilder(Bvh::BUILD_SAH)
+	, event(nullptr)
+	, generator(std::random_device{}())
+	, checkpointWritten()
+	, renderKernel(nullptr)
+	, cubemapKernel(nullptr)
+	, compactKernel(nullptr)
+	, reprojectKernel(nullptr)
+	, denoisePrepareKernel(nullptr)
+	, denoiseAtrousKernel(nullptr)
+	, denoiseFinishKernel(nullptr)
+	, skyboxDirectory(skyboxDirectory)
+	, cubemap()
+	, cubemapBuffer()
+	, cubemapLoaded()
+{
+	const size_t pixels = (size_t)width * height;
+
+	accumulatedColor = (float*)malloc(3 * pixels * sizeof(float));
+	accumulatedSquare = (float*)malloc(pixels * sizeof(float));
+	sampleCount = (int*)malloc(pixels * sizeof(int));
+	denoisedColor = (float*)malloc(3 * pixels * sizeof(float));
+
+	memset(accumulatedColor, 0, 3 * pixels * sizeof(float));
+	memset(accumulatedSquare, 0, pixels * sizeof(float));
+	memset(sampleCount, 0, pixels * sizeof(int));
+	memset(denoisedColor, 0, 3 * pixels * sizeof(float));
+
+	std::vector<cl_int> allPixels(pixels);
+	for (size_t i = 0; i < pixels; i++) {
+		allPixels[i] = (cl_int)i;
+	}
+
+	// the per-frame buffers live as long as the renderer so the bound kernel arguments stay valid
+	cl_context context = OpenclManager::getInstance()->getContent();
+	accumulationBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 3 * pixels * sizeof(float), accumulatedColor, NULL);
+	squareBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, pixels * sizeof(float), accumulatedSquare, NULL);
+	countBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, pixels * sizeof(cl_int), sampleCount, NULL);
+	allPixelsBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, pixels * sizeof(cl_int), allPixels.data(), NULL);
+	activeBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, pixels * sizeof(cl_int), NULL, NULL);
+	activeCountBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int), NULL, NULL);
+	previewBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY, pixels * sizeof(cl_int), NULL, NULL);
+
+	// a pixel belongs to the coarsest level whose grid it is on
+	std::vector<cl_int> levels[kProgressiveLevels];
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			int level = 0;
+			while (level < kProgressiveLevels - 1 && (x % getLevelStride(level) != 0 || y % getLevelStride(level) != 0)) {
+				level++;
+			}
+			levels[level].push_back(y * width + x);
+		}
+	}
+	for (int i = 0; i < kProgressiveLevels; i++) {
+		levelPixels[i] = (int)levels[i].size();
+		levelBuffer[i] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, std::max<size_t>(1, levels[i].size()) * sizeof(cl_int), levels[i].data(), NULL);
+	}
+
+	setAovLayout(aovs & kDeviceAovs);
+	for (int i = 0; i < 2; i++) {
+		denoiseColorBuffer[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, pixels * sizeof(cl_float4), NULL, NULL);
+	}
+	denoiseGuideBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, pixels * sizeof(cl_float4), NULL, NULL);
+	denoiseAlbedoBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, pixels * sizeof(cl_float4), NULL, NULL);
+	denoiseOutputBuffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, 3 * pixels * sizeof(float), NULL, NULL);
+
+	scenes[SCENE_SPHERES].description = SceneDescription::getSpheres();
+	scenes[SCENE_CUBEMAP].description = SceneDescription::getCubemap();
+	for (SceneData& data : scenes) {
+		data.builder = bvhBuilder;
+		createScene(data);
+	}
+
+	// decode the skybox while the program builds and the caller sets up
+	cubemapLoaded = std::async(std::launch::async, [this]() { loadCubemap(); });
+}
+
+Renderer::~Renderer()
+{
+	cubemapLoaded.wait();
+	waitForCheckpoint();
+
+	if (event != nullptr) {
+		clWaitForEvents(1, &event);
+		clReleaseEvent(event);
+	}
+
+	free(accumulatedColor);
+	free(accumulatedSquare);
+	free(sampleCount);
+	free(denoisedColor);
+
+	clReleaseMemObject(accumulationBuffer);
+	clReleaseMemObject(squareBuffer);
+	clReleaseMemObject(countBuffer);
+	clReleaseMemObject(allPixelsBuffer);
+	clReleaseMemObject(activeBuffer);
+	clReleaseMemObject(activeCountBuffer);
+	clReleaseMemObject(previewBuffer);
+	for (int i = 0; i < kProgressiveLevels; i++) {
+		clReleaseMemObject(levelBuffer[i]);
+	}
+	clReleaseMemObject(aovBuffer);
+	if (historyAccumulationBuffer != nullptr) {
+		clReleaseMemObject(historyAccumulationBuffer);
+		clReleaseMemObject(historySquareBuffer);
+		clReleaseMemObject(historyCountBuffer);
+		clReleaseMemObject(historyAovBuffer);
+	}
+	for (int i = 0; i < 2; i++) {
+		clReleaseMemObject(denoiseColorBuffer[i]);
+	}
+	clReleaseMemObject(denoiseGuideBuffer);
+	clReleaseMemObject(denoiseAlbedoBuffer);
+	clReleaseMemObject(denoiseOutputBuffer);
+	for (const SceneData& data : scenes) {
+		clReleaseMemObject(data.tlas);
+		clReleaseMemObject(data.instances);
+		clReleaseMemObject(data.nodes);
+		clReleaseMemObject(data.spheres);
+		clReleaseMemObject(data.sphereIds);
+		clReleaseMemObject(data.materials);
+	}
+
+	for (int i = 0; i < 6; i++) {
+		if (cubemap[i] != nullptr) {
+			stbi_image_free(cubemap[i]);
+		}
+		if (cubemapBuffer[i] != nullptr) {
+			clReleaseMemObject(cubemapBuffer[i]);
+		}
+	}
+}
+
+static std::vector<Bvh::Box> getSphereBounds(const std::vector<SceneDescription::Sphere>& spheres)
+{
+	std::vector<Bvh::Box> bounds(spheres.size());
+	for (size_t i = 0; i < bounds.size(); i++) {
+		for (int axis = 0; axis < 3; axis++) {
+			bounds[i].min[axis] = spheres[i].center[axis] - spheres[i].radius;
+			bounds[i].max[axis] = spheres[i].center[axis] + spheres[i].radius;
+		}
+	}
+	return bounds;
+}
+
+void Renderer::createScene(SceneData& data)
+{
+	data.objectTrees.clear();
+	for (const SceneDescription::Object& object : data.description.objects) {
+		data.objectTrees.push_back(Bvh::build(getSphereBounds(object.spheres), data.builder));
+	}
+	data.nodes = nullptr;
+	data.tlas = nullptr;
+	uploadObjects(data);
+	uploadInstances(data);
+}
+
+void Renderer::packObject(const SceneData& data, int object, std::vector<Bvh::Node>& nodes, std::vector<SphereBlock>& blocks, std::vector<cl_int>& sphereIds, std::vector<MaterialData>& materials)
+{
+	const std::vector<SceneDescription::Sphere>& spheres = data.description.objects[object].spheres;
+	const Bvh& bvh = data.objectTrees[object];
+
+	// references moved past the objects before
+	const int firstSphere = data.objectFirstSphere[object];
+	const int nodeBase = data.objectRoots[object];
+	const int blockBase = data.objectFirstBlock[object];
+	for (Bvh::Node node : bvh.getNodes()) {
+		for (int i = 0; i < Bvh::kWidth; i++) {
+			if (node.child[i] != Bvh::kEmpty) {
+				node.child[i] = node.child[i] >= 0 ? node.child[i] + nodeBase : ~(~node.child[i] + blockBase);
+			}
+		}
+		nodes.push_back(node);
+	}
+
+	// every leaf is one block, so a leaf's spheres are tested together
+	const std::vector<int32_t>& leaves = bvh.getLeaves();
+	const size_t first = blocks.size();
+	blocks.resize(first + bvh.getLeafCount());
+	for (size_t i = 0; i < leaves.size(); i++) {
+		SphereBlock& block = blocks[first + i / Bvh::kWidth];
+		const int lane = (int)(i % Bvh::kWidth);
+		if (leaves[i] < 0) {
+			block.x.s[lane] = block.y.s[lane] = block.z.s[lane] = block.radius.s[lane] = 0.0f;
+			sphereIds.push_back(-1);
+			continue;
+		}
+		const SceneDescription::Sphere& sphere = spheres[leaves[i]];
+		block.x.s[lane] = sphere.center[0];
+		block.y.s[lane] = sphere.center[1];
+		block.z.s[lane] = sphere.center[2];
+		block.radius.s[lane] = sphere.radius;
+		sphereIds.push_back(firstSphere + leaves[i]);
+	}
+
+	// the kernels look materials up by sphere
+	for (const SceneDescription::Sphere& sphere : spheres) {
+		const SceneDescription::Material& material = data.description.materials[sphere.material];
+		MaterialData materialData;
+		materialData.color = {{material.color[0], material.color[1], material.color[2]}};
+		materialData.type = material.type;
+		materials.push_back(materialData);
+	}
+}
+
+void Renderer::uploadObjects(SceneData& data)
+{
+	const size_t objects = data.objectTrees.size();
+	data.objectRoots.resize(objects);
+	data.objectFirstBlock.resize(objects);
+	data.objectFirstSphere.resize(objects);
+
+	// the objects' trees one after another
+	std::vector<Bvh::Node> nodes;
+	std::vector<SphereBlock> blocks;
+	std::vector<cl_int> sphereIds;
+	std::vector<MaterialData> materials;
+	for (size_t object = 0; object < objects; object++) {
+		data.objectRoots[object] = (int)nodes.size();
+		data.objectFirstBlock[object] = (int)blocks.size();
+		data.objectFirstSphere[object] = (int)materials.size();
+		packObject(data, (int)object, nodes, blocks, sphereIds, materials);
+	}
+	if (nodes.empty()) {
+		nodes = Bvh::build({}).getNodes();
+	}
+	blocks.resize(std::max<size_t>(1, blocks.size()));
+	sphereIds.resize(blocks.size() * Bvh::kWidth, -1);
+	materials.resize(std::max<size_t>(1, materials.size()));
+
+	// create the new buffers before releasing the old ones, so the handles differ for the kernel argument cache
+	cl_context context = OpenclManager::getInstance()->getContent();
+	cl_mem nodeBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, nodes.size() * sizeof(Bvh::Node), nodes.data(), NULL);
+	cl_mem sphereBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, blocks.size() * sizeof(SphereBlock), blocks.data(), NULL);
+	cl_mem sphereIdBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sphereIds.size() * sizeof(cl_int), sphereIds.data(), NULL);
+	cl_mem materialBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, materials.size() * sizeof(MaterialData), materials.data(), NULL);
+	if (data.nodes != nullptr) {
+		// a launch still using them keeps them alive until it is done
+		clReleaseMemObject(data.nodes);
+		clReleaseMemObject(data.spheres);
+		clReleaseMemObject(data.sphereIds);
+		clReleaseMemObject(data.materials);
+	}
+	data.nodes = nodeBuffer;
+	data.spheres = sphereBuffer;
+	data.sphereIds = sphereIdBuffer;
+	data.materials = materialBuffer;
+	CGRA_LOGD("%zu objects, %zu spheres in %zu bottom-level BVH nodes", objects, materials.size(), nodes.size());
+}
+
+void Renderer::uploadInstances(SceneData& data)
+{
+	const SceneDescription& description = data.description;
+
+	// world bounds of the instances from the corners of their objects' boxes
+	std::vector<Bvh::Box> bounds(description.instances.size(), Bvh::Box::empty());
+	for (size_t i = 0; i < bounds.size(); i++) {
+		const SceneDescription::Instance& instance = description.instances[i];
+		const Bvh::Box& box = data.objectTrees[instance.object].getBounds();
+		if (description.objects[instance.object].spheres.empty()) {
+			continue;
+		}
+		for (int corner = 0; corner < 8; corner++) {
+			const float point[3] = {corner & 1 ? box.max[0] : box.min[0], corner & 2 ? box.max[1] : box.min[1], corner & 4 ? box.max[2] : box.min[2]};
+			Bvh::Box world;
+			instance.transform.apply(point, world.min);
+			memcpy(world.max, world.min, sizeof(world.max));
+			bounds[i].grow(world);
+		}
+	}
+	const Bvh bvh = Bvh::build(bounds);
+	checkTraversalStack(data, bvh);
+
+	// instances in leaf order, so a top-level leaf is its kWidth instances
+	const std::vector<int32_t>& leaves = bvh.getLeaves();
+	std::vector<InstanceData> instances(std::max<size_t>(1, leaves.size()));
+	const std::vector<int> primitiveOffsets = description.getPrimitiveOffsets();
+	for (size_t i = 0; i < instances.size(); i++) {
+		InstanceData& lane = instances[i];
+		memset(&lane, 0, sizeof(lane));
+		lane.root = -1;
+		if (i >= leaves.size() || leaves[i] < 0) {
+			continue;
+		}
+		const SceneDescription::Instance& instance = description.instances[leaves[i]];
+		SceneDescription::Transform inverse;
+		if (!instance.transform.invert(inverse)) {
+			// left out rather than drawn with some other transform
+			CGRA_LOGE("instance %d has a singular transform, it is not drawn", leaves[i]);
+			continue;
+		}
+		for (int row = 0; row < 3; row++) {
+			lane.worldToObject[row] = {{inverse.m[row][0], inverse.m[row][1], inverse.m[row][2], inverse.m[row][3]}};
+		}
+		lane.root = data.objectRoots[instance.object];
+		lane.firstSphere = data.objectFirstSphere[instance.object];
+		lane.primitiveOffset = primitiveOffsets[leaves[i]];
+	}
+
+	// create the new buffers before releasing the old ones, so the handles differ for the kernel argument cache
+	cl_context context = OpenclManager::getInstance()->getContent();
+	const std::vector<Bvh::Node>& nodes = bvh.getNodes();
+	cl_mem tlas = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, nodes.size() * sizeof(Bvh::Node), (void*)nodes.data(), NULL);
+	cl_mem instanceBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, instances.size() * sizeof(InstanceData), instances.data(), NULL);
+	if (data.tlas != nullptr) {
+		// a launch still using them keeps them alive until it is done
+		clReleaseMemObject(data.tlas);
+		clReleaseMemObject(data.instances);
+	}
+	data.tlas = tlas;
+	data.instances = instanceBuffer;
+}
+
+bool Renderer::checkTraversalStack(const SceneData& data, const Bvh& tlas)
+{
+	// an object's walk goes on the stack above the top level's, and the kernels drop the
+	// nodes that do not fit, so geometry would go missing without a trace
+	bool fits = true;
+	for (size_t object = 0; object < data.objectTrees.size(); object++) {
+		const Bvh& bvh = data.objectTrees[object];
+		const int needed = tlas.getStackSize() + bvh.getStackSize();
+		if (needed > kBvhStackSize) {
+			CGRA_LOGE("BVH of object %zu of %d levels under a top level of %d needs %d stack entries, the kernels have %d",
+				object, bvh.getDepth(), tlas.getDepth(), needed, kBvhStackSize);
+			fits = false;
+		}
+	}
+	return fits;
+}
+
+void Renderer::loadCubemap()
+{
+	int faceWidth[6], faceHeight[6], channels[6];
+	std::future<void> decoded[6];
+	for (int i = 0; i < 6; i++) {
+		decoded[i] = std::async(std::launch::async, [&, i]() {
+			const std::string path = skyboxDirectory + kCubemapFaces[i];
+			cubemap[i] = stbi_load(path.c_str(), &faceWidth[i], &faceHeight[i], &channels[i], 3);
+			if (cubemap[i] == nullptr) {
+				CGRA_LOGE("cannot load %s", path.c_str());
+			}
+		});
+	}
+
+	for (int i = 0; i < 6; i++) {
+		decoded[i].wait();
+		if (cubemap[i] != nullptr) {
+			cubemapBuffer[i] = clCreateBuffer(OpenclManager::getInstance()->getContent(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 3 * faceWidth[i] * faceHeight[i] * sizeof(uint8_t), (void*)cubemap[i], NULL);
+		}
+	}
+}
+
+bool Renderer::isReady()
+{
+	if (cubemapKernel != nullptr) {
+		return true;
+	}
+
+	if (cubemapLoaded.wait_for(std::chrono::seconds(0)) != std::future_status::ready || !isBuilt()) {
+		return false;
+	}
+
+	renderKernel = getKernel("render");
+	cubemapKernel = getKernel("demo_cubemap");
+	compactKernel = getKernel("compact_active");
+	reprojectKernel = getKernel("reproject_history");
+	denoisePrepareKernel = getKernel("denoise_prepare");
+	denoiseAtrousKernel = getKernel("denoise_atrous");
+	denoiseFinishKernel = getKernel("denoise_finish");
+	return true;
+}
+
+bool Renderer::waitUntilReady()
+{
+	cubemapLoaded.wait();
+	if (!waitForBuild()) {
+		return false;
+	}
+
+	// AOVs asked for after construction
+	waitForRebuild();
+	update();
+
+	return isReady() && renderKernel->isValid() && cubemapKernel->isValid() && compactKernel->isValid() && reprojectKernel->isValid()
+		&& denoisePrepareKernel->isValid() && denoiseAtrousKernel->isValid() && denoiseFinishKernel->isValid();
+}
+
+bool Renderer::update()
+{
+	if (!OpenclTask::update()) {
+		return false;
+	}
+
+	// the program may be built for an older request than the last one, its defines decide the layout
+	const unsigned built = getAovsFromOptions(getProgramOptions());
+	if (built == aovs) {
+		return true;
+	}
+	if (!resumed) {
+		setAovLayout(built);
+		resetAccumulation();
+		return true;
+	}
+
+	// a resumed render keeps its samples, the AOVs in both layouts their sums
+	const std::vector<float> oldSums = aovSums;
+	const int oldStride = aovStride;
+	std::vector<int> oldOffsets;
+	for (const AovInfo& info : kAovs) {
+		oldOffsets.push_back(getAovOffset(info.aov));
+	}
+	setAovLayout(built);
+	const size_t pixels = (size_t)width * height;
+	for (size_t a = 0; a < oldOffsets.size(); a++) {
+		const int offset = getAovOffset(kAovs[a].aov);
+		if (offset < 0 || oldOffsets[a] < 0) {
+			continue;
+		}
+		for (size_t i = 0; i < pixels; i++) {
+			for (int k = 0; k < kAovs[a].channels; k++) {
+				aovSums[aovStride * i + offset + k] = oldSums[oldStride * i + oldOffsets[a] + k];
+			}
+		}
+	}
+	if (aovStride > 0) {
+		clEnqueueWriteBuffer(OpenclManager::getInstance()->getCommandQueue(), aovBuffer, CL_TRUE, 0, aovSums.size() * sizeof(float), aovSums.data(), 0, NULL, NULL);
+	}
+	denoiseChanged = true;
+	return true;
+}
+
+void Renderer::compactActivePixels()
+{
+	const int pixels = width * height;
+
+	// below the minimum every pixel is active, and the counts are not worth reading yet
+	if (adaptiveThreshold <= 0.0f || samples < adaptiveMinSamples) {
+		activePixels = pixels;
+		return;
+	}
+
+	CGRA_TRACE_SCOPE("compact active");
+	cl_command_queue queue = OpenclManager::getInstance()->getCommandQueue();
+	const cl_int zero = 0;
+	clEnqueueFillBuffer(queue, activeCountBuffer, &zero, sizeof(zero), 0, sizeof(zero), 0, NULL, NULL);
+
+	compactKernel->setArg(0, accumulationBuffer);
+	compactKernel->setArg(1, squareBuffer);
+	compactKernel->setArg(2, countBuffer);
+	compactKernel->setArg(3, width);
+	compactKernel->setArg(4, height);
+	compactKernel->setArg(5, adaptiveThreshold);
+	compactKernel->setArg(6, adaptiveMinSamples);
+	compactKernel->setArg(7, activeBuffer);
+	compactKernel->setArg(8, activeCountBuffer);
+
+	cl_event compactEvent = NULL;
+	if (compactKernel->run(pixels, &compactEvent) != CL_SUCCESS) {
+		activePixels = pixels;
+		return;
+	}
+	OpenclProfiler::getInstance()->record("compact_active", compactEvent);
+	clReleaseEvent(compactEvent);
+
+	// the launch size is needed on the host, this 4 byte read is the only sync
+	cl_int count = pixels;
+	clEnqueueReadBuffer(queue, activeCountBuffer, CL_TRUE, 0, sizeof(count), &count, 0, NULL, NULL);
+	activePixels = std::clamp((int)count, 0, pixels);
+}
+
+void Renderer::step(int count)
+{
+	const size_t pixels = (size_t)width * height;
+
+	if (count <= 0) {
+		return;
+	}
+
+	// a preview traces its grid whatever adaptive sampling would pick, and makes the levels redundant
+	int launchPixels = previewPixels;
+	cl_mem activeList = previewBuffer;
+	int stride = previewStride;
+	bool wholePass = true;
+	if (previewStride > 1 || historyPending) {
+		progressiveLevel = kProgressiveLevels;
+	}
+	if (previewStride == 1 && progressiveLevel < kProgressiveLevels) {
+		launchPixels = levelPixels[progressiveLevel];
+		activeList = levelBuffer[progressiveLevel];
+		stride = getLevelStride(progressiveLevel);
+		progressiveLevel++;
+		wholePass = progressiveLevel == kProgressiveLevels;
+	}
+	else if (previewStride == 1) {
+		compactActivePixels();
+		launchPixels = activePixels;
+		activeList = activePixels == (int)pixels ? allPixelsBuffer : activeBuffer;
+	}
+	if (launchPixels == 0) {
+		return;
+	}
+
+	CGRA_TRACE_SCOPE("kernel setup");
+	// one seed per launch, the kernel hashes it with the pixel index, so a level or preview costs its pixels only
+	const cl_uint seed = (cl_uint)generator();
+
+	OpenclKernel* kernel = scene == SCENE_SPHERES ? renderKernel : cubemapKernel;
+	kernel->setArg(0, accumulationBuffer);
+	kernel->setArg(1, squareBuffer);
+	kernel->setArg(2, countBuffer);
+	kernel->setArg(3, aovBuffer);
+	kernel->setArg(4, activeList);
+	kernel->setArg(5, width);
+	kernel->setArg(6, height);
+	kernel->setArg(7, count);
+	kernel->setArg(8, seed);
+	kernel->setArg(9, getCameraData(camera));
+	kernel->setArg(10, scenes[scene].tlas);
+	kernel->setArg(11, scenes[scene].instances);
+	kernel->setArg(12, scenes[scene].nodes);
+	kernel->setArg(13, scenes[scene].spheres);
+	kernel->setArg(14, scenes[scene].sphereIds);
+	kernel->setArg(15, scenes[scene].materials);
+	if (scene == SCENE_CUBEMAP) {
+		for (int i = 0; i < 6; i++) {
+			kernel->setArg(16 + i, cubemapBuffer[i]);
+		}
+	}
+
+	launchedSamples = wholePass ? count : 0;
+	launchedStride = stride;
+	resumed = false;
+	kernel->run(launchPixels, &event);
+	OpenclProfiler::getInstance()->record(getSceneName(scene), event);
+
+	if (historyPending) {
+		reprojectHistory();
+	}
+}
+
+void Renderer::reprojectHistory()
+{
+	CGRA_TRACE_SCOPE("reproject");
+	historyPending = false;
+
+	reprojectKernel->setArg(0, accumulationBuffer);
+	reprojectKernel->setArg(1, squareBuffer);
+	reprojectKernel->setArg(2, countBuffer);
+	reprojectKernel->setArg(3, aovBuffer);
+	reprojectKernel->setArg(4, historyAccumulationBuffer);
+	reprojectKernel->setArg(5, historySquareBuffer);
+	reprojectKernel->setArg(6, historyCountBuffer);
+	reprojectKernel->setArg(7, historyAovBuffer);
+	reprojectKernel->setArg(8, width);
+	reprojectKernel->setArg(9, height);
+	reprojectKernel->setArg(10, getCameraData(camera));
+	reprojectKernel->setArg(11, getCameraData(historyCamera));
+	reprojectKernel->setArg(12, historyStride);
+	reprojectKernel->setArg(13, temporalHistory);
+
+	// the queue runs it after the launch, so wait() waits for it instead
+	cl_event reprojectEvent = NULL;
+	if (reprojectKernel->run(width * height, &reprojectEvent) != CL_SUCCESS) {
+		return;
+	}
+	OpenclProfiler::getInstance()->record("reproject_history", reprojectEvent);
+	if (event != nullptr) {
+		clReleaseEvent(event);
+	}
+	event = reprojectEvent;
+}
+
+void Renderer::wait()
+{
+	if (event == nullptr) {
+		// nothing active, or the launch failed and run() already logged why
+		return;
+	}
+
+	CGRA_TRACE_SCOPE("wait kernel");
+	clWaitForEvents(1, &event);
+	clReleaseEvent(event);
+	event = nullptr;
+
+	samples += launchedSamples;
+	coveredStride = coveredStride == 0 ? launchedStride : std::min(coveredStride, launchedStride);
+	accumulationChanged = true;
+	denoiseChanged = true;
+}
+
+void Renderer::readAccumulation()
+{
+	if (!accumulationChanged) {
+		return;
+	}
+
+	CGRA_TRACE_SCOPE("readback");
+	const size_t pixels = (size_t)width * height;
+	cl_command_queue queue = OpenclManager::getInstance()->getCommandQueue();
+	cl_event readEvent = NULL;
+	clEnqueueReadBuffer(queue, accumulationBuffer, CL_FALSE, 0, 3 * pixels * sizeof(float), accumulatedColor, 0, NULL, &readEvent);
+	clEnqueueReadBuffer(queue, squareBuffer, CL_FALSE, 0, pixels * sizeof(float), accumulatedSquare, 0, NULL, NULL);
+	if (aovStride > 0) {
+		clEnqueueReadBuffer(queue, aovBuffer, CL_FALSE, 0, aovSums.size() * sizeof(float), aovSums.data(), 0, NULL, NULL);
+	}
+	clEnqueueReadBuffer(queue, countBuffer, CL_TRUE, 0, pixels * sizeof(cl_int), sampleCount, 0, NULL, NULL);
+	OpenclProfiler::getInstance()->record("read image", readEvent);
+	if (readEvent != NULL) {
+		clReleaseEvent(readEvent);
+	}
+	accumulationChanged = false;
+}
+
+void Renderer::runDenoiser()
+{
+	if (!denoiseChanged) {
+		return;
+	}
+
+	CGRA_TRACE_SCOPE("denoise");
+	const int pixels = width * height;
+
+	denoisePrepareKernel->setArg(0, accumulationBuffer);
+	denoisePrepareKernel->setArg(1, squareBuffer);
+	denoisePrepareKernel->setArg(2, countBuffer);
+	denoisePrepareKernel->setArg(3, aovBuffer);
+	denoisePrepareKernel->setArg(4, width);
+	denoisePrepareKernel->setArg(5, height);
+	denoisePrepareKernel->setArg(6, denoiseColorBuffer[0]);
+	denoisePrepareKernel->setArg(7, denoiseGuideBuffer);
+	denoisePrepareKernel->setArg(8, denoiseAlbedoBuffer);
+
+	cl_event stageEvent = NULL;
+	denoisePrepareKernel->run(pixels, &stageEvent);
+	OpenclProfiler::getInstance()->record("denoise_prepare", stageEvent);
+	if (stageEvent != NULL) {
+		clReleaseEvent(stageEvent);
+	}
+
+	// colour and normal widths as in SVGF; depth differences are relative to the centre depth and step
+	const float sigmaColor = 4.0f;
+	const float sigmaNormal = 128.0f;
+	const float sigmaDepth = 0.1f;
+
+	int current = 0;
+	for (int level = 0; level < denoiseLevels; level++) {
+		denoiseAtrousKernel->setArg(0, denoiseColorBuffer[current]);
+		denoiseAtrousKernel->setArg(1, denoiseGuideBuffer);
+		denoiseAtrousKernel->setArg(2, width);
+		denoiseAtrousKernel->setArg(3, height);
+		denoiseAtrousKernel->setArg(4, 1 << level);
+		denoiseAtrousKernel->setArg(5, sigmaColor);
+		denoiseAtrousKernel->setArg(6, sigmaNormal);
+		denoiseAtrousKernel->setArg(7, sigmaDepth);
+		denoiseAtrousKernel->setArg(8, denoiseColorBuffer[1 - current]);
+
+		denoiseAtrousKernel->run(pixels, &stageEvent);
+		OpenclProfiler::getInstance()->record("denoise_atrous", stageEvent);
+		if (stageEvent != NULL) {
+			clReleaseEvent(stageEvent);
+		}
+		current = 1 - current;
+	}
+
+	denoiseFinishKernel->setArg(0, denoiseColorBuffer[current]);
+	denoiseFinishKernel->setArg(1, denoiseAlbedoBuffer);
+	denoiseFinishKernel->setArg(2, width);
+	denoiseFinishKernel->setArg(3, height);
+	denoiseFinishKernel->setArg(4, denoiseOutputBuffer);
+	denoiseFinishKernel->run(pixels, &stageEvent);
+	OpenclProfiler::getInstance()->record("denoise_finish", stageEvent);
+	if (stageEvent != NULL) {
+		clReleaseEvent(stageEvent);
+	}
+
+	cl_event readEvent = NULL;
+	clEnqueueReadBuffer(OpenclManager::getInstance()->getCommandQueue(), denoiseOutputBuffer, CL_TRUE, 0, 3 * (size_t)pixels * sizeof(float), denoisedColor, 0, NULL, &readEvent);
+	OpenclProfiler::getInstance()->record("read denoised", readEvent);
+	if (readEvent != NULL) {
+		clReleaseEvent(readEvent);
+	}
+	denoiseChanged = false;
+}
+
+void Renderer::resolve(uint8_t* rgb)
+{
+	const size_t pixels = (size_t)width * height;
+
+	if (coveredStride == 0) {
+		memset(rgb, 0, 3 * pixels);
+		return;
+	}
+
+	// the guides of a sparse preview are full of holes, it is shown noisy
+	if (denoise && coveredStride == 1) {
+		runDenoiser();
+		for (size_t i = 0; i < 3 * pixels; i++) {
+			// gamma 2
+			float value = sqrtf(std::max(denoisedColor[i], 0.0f));
+			rgb[i] = (uint8_t)(std::clamp(value, 0.0f, 1.0f) * 255);
+		}
+		return;
+	}
+
+	readAccumulation();
+	for (size_t i = 0; i < pixels; i++) {
+		const size_t shown = getShownPixel(i);
+		const float scale = sampleCount[shown] == 0 ? 0.0f : 1.0f / sampleCount[shown];
+		for (int k = 0; k < 3; k++) {
+			// gamma 2
+			float value = sqrtf(accumulatedColor[3 * shown + k] * scale);
+			rgb[3 * i + k] = (uint8_t)(std::clamp(value, 0.0f, 1.0f) * 255);
+		}
+	}
+}
+
+void Renderer::getAverage(float* rgb)
+{
+	const size_t pixels = (size_t)width * height;
+	readAccumulation();
+	for (size_t i = 0; i < pixels; i++) {
+		const size_t shown = getShownPixel(i);
+		const float scale = sampleCount[shown] == 0 ? 0.0f : 1.0f / sampleCount[shown];
+		rgb[3 * i + 0] = accumulatedColor[3 * shown + 0] * scale;
+		rgb[3 * i + 1] = accumulatedColor[3 * shown + 1] * scale;
+		rgb[3 * i + 2] = accumulatedColor[3 * shown + 2] * scale;
+	}
+}
+
+void Renderer::getDenoised(float* rgb)
+{
+	runDenoiser();
+	memcpy(rgb, denoisedColor, 3 * (size_t)width * height * sizeof(float));
+}
+
+Image Renderer::getImage()
+{
+	std::vector<float> rgb(3 * (size_t)width * height);
+	getAverage(rgb.data());
+
+	Image image(width, height);
+	if (denoise) {
+		image.addChannels({"noisy.R", "noisy.G", "noisy.B"}, rgb.data());
+		getDenoised(rgb.data());
+	}
+	image.addChannels({"R", "G", "B"}, rgb.data());
+
+	std::vector<float> data(3 * (size_t)width * height);
+	for (const AovInfo& info : kAovs) {
+		if ((outputAovs & info.aov) != 0 && getAov(info.aov, data.data())) {
+			image.addChannels(std::vector<std::string>(info.channelNames, info.channelNames + info.channels), data.data());
+		}
+	}
+	return image;
+}
+
+bool Renderer::getAov(Aov aov, float* data)
+{
+	const size_t pixels = (size_t)width * height;
+
+	if (aov == AOV_SAMPLE_COUNT || aov == AOV_VARIANCE) {
+		readAccumulation();
+		for (size_t i = 0; i < pixels; i++) {
+			data[i] = aov == AOV_SAMPLE_COUNT ? (float)sampleCount[i] : (float)getMeanVariance(i);
+		}
+		return true;
+	}
+
+	const int offset = getAovOffset(aov);
+	if (offset < 0) {
+		return false;
+	}
+
+	readAccumulation();
+	const int channels = getAovChannels(aov);
+	// ids are not summed, the kernels keep the last sample's
+	const bool summed = aov != AOV_PRIMITIVE_ID && aov != AOV_MATERIAL_ID;
+	for (size_t i = 0; i < pixels; i++) {
+		const float scale = !summed ? 1.0f : sampleCount[i] == 0 ? 0.0f : 1.0f / sampleCount[i];
+		for (int k = 0; k < channels; k++) {
+			data[channels * i + k] = aovSums[aovStride * i + offset + k] * scale;
+		}
+	}
+	return true;
+}
+
+void Renderer::setAovs(unsigned newAovs)
+{
+	outputAovs = newAovs;
+	setBuildOptions(getAovOptions(getRequestedAovs()));
+}
+
+unsigned Renderer::getRequestedAovs() const
+{
+	return (outputAovs | (denoise ? kDenoiseAovs : 0) | (temporal ? kTemporalAovs : 0)) & kDeviceAovs;
+}
+
+std::string Renderer::getAovOptions(unsigned aovs)
+{
+	std::string options;
+	int stride = 0;
+	for (const AovInfo& info : kAovs) {
+		if ((aovs & info.aov) != 0 && info.define != nullptr) {
+			options += std::string(" -D") + info.define + "=" + std::to_string(stride);
+			stride += info.channels;
+		}
+	}
+	return stride == 0 ? std::string() : "-DAOV_STRIDE=" + std::to_string(stride) + options;
+}
+
+unsigned Renderer::getAovsFromOptions(const std::string& options)
+{
+	unsigned aovs = 0;
+	for (const AovInfo& info : kAovs) {
+		if (info.define != nullptr && options.find(std::string("-D") + info.define + "=") != std::string::npos) {
+			aovs |= info.aov;
+		}
+	}
+	return aovs;
+}
+
+int Renderer::getAovOffset(Aov aov) const
+{
+	int offset = 0;
+	for (const AovInfo& info : kAovs) {
+		if ((aovs & info.aov) == 0) {
+			continue;
+		}
+		if (info.aov == aov) {
+			return offset;
+		}
+		offset += info.channels;
+	}
+	return -1;
+}
+
+void Renderer::setAovLayout(unsigned newAovs)
+{
+	const size_t pixels = (size_t)width * height;
+	aovs = newAovs;
+	aovStride = 0;
+	for (const AovInfo& info : kAovs) {
+		if ((aovs & info.aov) != 0) {
+			aovStride += info.channels;
+		}
+	}
+	aovSums.assign(aovStride * pixels, 0.0f);
+
+	// create the new buffer before releasing the old one, so the handles differ for the kernel argument cache
+	const size_t size = std::max<size_t>(1, aovSums.size()) * sizeof(float);
+	cl_mem newBuffer = clCreateBuffer(OpenclManager::getInstance()->getContent(), CL_MEM_READ_WRITE, size, NULL, NULL);
+	const cl_int zero = 0;
+	clEnqueueFillBuffer(OpenclManager::getInstance()->getCommandQueue(), newBuffer, &zero, sizeof(zero), 0, size, 0, NULL, NULL);
+	if (aovBuffer != nullptr) {
+		clReleaseMemObject(aovBuffer);
+	}
+	aovBuffer = newBuffer;
+
+	if (historyAovBuffer != nullptr) {
+		clReleaseMemObject(historyAovBuffer);
+		historyAovBuffer = clCreateBuffer(OpenclManager::getInstance()->getContent(), CL_MEM_READ_WRITE, size, NULL, NULL);
+	}
+}
+
+double Renderer::getMeanVariance(size_t pixel) const
+{
+	if (sampleCount[pixel] < 2) {
+		return 0.0;
+	}
+
+	const double n = sampleCount[pixel];
+	const float* color = accumulatedColor + 3 * pixel;
+	const double mean = (0.2126 * color[0] + 0.7152 * color[1] + 0.0722 * color[2]) / n;
+	const double variance = std::max(0.0, (accumulatedSquare[pixel] / n - mean * mean) * n / (n - 1));
+	return variance / n;
+}
+
+double Renderer::estimateNoise()
+{
+	if (samples < 2) {
+		return 0.0;
+	}
+
+	readAccumulation();
+	const size_t pixels = (size_t)width * height;
+	double sum = 0.0;
+	for (size_t i = 0; i < pixels; i++) {
+		if (sampleCount[i] < 2) {
+			continue;
+		}
+		const float* color = accumulatedColor + 3 * i;
+		const double mean = (0.2126 * color[0] + 0.7152 * color[1] + 0.0722 * color[2]) / sampleCount[i];
+		// standard error of the mean, relative, with an epsilon so black pixels do not dominate
+		sum += sqrt(getMeanVariance(i)) / (mean + 1e-2);
+	}
+	return sum / pixels;
+}
+
+void Renderer::resetAccumulation()
+{
+	const size_t pixels = (size_t)width * height;
+	samples = 0;
+	resumed = false;
+	activePixels = (int)pixels;
+	historyPending = false;
+	coveredStride = 0;
+	progressiveLevel = progressive ? 0 : kProgressiveLevels;
+	accumulationChanged = false;
+	denoiseChanged = false;
+	memset(denoisedColor, 0, 3 * pixels * sizeof(float));
+	memset(accumulatedColor, 0, 3 * pixels * sizeof(float));
+	memset(accumulatedSquare, 0, pixels * sizeof(float));
+	memset(sampleCount, 0, pixels * sizeof(int));
+
+	// queued behind any launch still in flight, so no sample of the old image lands after it
+	cl_command_queue queue = OpenclManager::getInstance()->getCommandQueue();
+	const cl_int zero = 0;
+	clEnqueueFillBuffer(queue, accumulationBuffer, &zero, sizeof(zero), 0, 3 * pixels * sizeof(float), 0, NULL, NULL);
+	clEnqueueFillBuffer(queue, squareBuffer, &zero, sizeof(zero), 0, pixels * sizeof(float), 0, NULL, NULL);
+	clEnqueueFillBuffer(queue, countBuffer, &zero, sizeof(zero), 0, pixels * sizeof(cl_int), 0, NULL, NULL);
+	if (aovStride > 0) {
+		std::fill(aovSums.begin(), aovSums.end(), 0.0f);
+		clEnqueueFillBuffer(queue, aovBuffer, &zero, sizeof(zero), 0, aovSums.size() * sizeof(float), 0, NULL, NULL);
+	}
+}
+
+void Renderer::setDenoiser(bool enabled, int levels)
+{
+	denoise = enabled;
+	denoiseLevels = std::max(1, levels);
+	denoiseChanged = samples > 0;
+	setBuildOptions(getAovOptions(getRequestedAovs()));
+}
+
+void Renderer::setCamera(const Camera& newCamera)
+{
+	if (memcmp(&camera, &newCamera, sizeof(Camera)) == 0) {
+		return;
+	}
+
+	// several moves between two steps reproject from the view the history was rendered from
+	bool keepHistory = historyPending;
+	if (temporal && samples > 0 && getAovOffset(AOV_DEPTH) >= 0) {
+		CGRA_TRACE_SCOPE("save history");
+		const size_t pixels = (size_t)width * height;
+		cl_command_queue queue = OpenclManager::getInstance()->getCommandQueue();
+		clEnqueueCopyBuffer(queue, accumulationBuffer, historyAccumulationBuffer, 0, 0, 3 * pixels * sizeof(float), 0, NULL, NULL);
+		clEnqueueCopyBuffer(queue, squareBuffer, historySquareBuffer, 0, 0, pixels * sizeof(float), 0, NULL, NULL);
+		clEnqueueCopyBuffer(queue, countBuffer, historyCountBuffer, 0, 0, pixels * sizeof(cl_int), 0, NULL, NULL);
+		clEnqueueCopyBuffer(queue, aovBuffer, historyAovBuffer, 0, 0, aovSums.size() * sizeof(float), 0, NULL, NULL);
+		historyCamera = camera;
+		historyStride = std::max(1, coveredStride);
+		keepHistory = true;
+	}
+
+	camera = newCamera;
+	resetAccumulation();
+	historyPending = keepHistory;
+}
+
+Renderer::Camera Renderer::getDefaultCamera(Scene scene)
+{
+	Camera camera;
+	if (scene == SCENE_SPHERES) {
+		camera.position[0] = -1.5f;
+		camera.position[2] = -1.0f;
+	}
+	return camera;
+}
+
+void Renderer::getCameraAxes(const Camera& camera, float forward[3], float right[3])
+{
+	forward[0] = sinf(camera.yaw) * cosf(camera.pitch);
+	forward[1] = sinf(camera.pitch);
+	forward[2] = cosf(camera.yaw) * cosf(camera.pitch);
+
+	// up x forward, level whatever the pitch
+	right[0] = cosf(camera.yaw);
+	right[1] = 0.0f;
+	right[2] = -sinf(camera.yaw);
+}
+
+Renderer::CameraData Renderer::getCameraData(const Camera& camera)
+{
+	float forward[3], right[3];
+	getCameraAxes(camera, forward, right);
+
+	CameraData data = {};
+	for (int k = 0; k < 3; k++) {
+		data.position.s[k] = camera.position[k];
+		data.forward.s[k] = forward[k];
+		data.right.s[k] = right[k];
+	}
+	// forward x right
+	data.up.s[0] = forward[1] * right[2] - forward[2] * right[1];
+	data.up.s[1] = forward[2] * right[0] - forward[0] * right[2];
+	data.up.s[2] = forward[0] * right[1] - forward[1] * right[0];
+	// half the fov, in radians
+	data.tanHalfFov = tanf(camera.fov * (3.14159265f / 360.0f));
+	data.aperture = std::max(0.0f, camera.aperture);
+	data.focusDistance = std::max(1e-3f, camera.focusDistance);
+	return data;
+}
+
+void Renderer::setPreview(int stride)
+{
+	stride = std::max(1, stride);
+	if (stride == previewStride) {
+		return;
+	}
+
+	previewStride = stride;
+	if (previewStride == 1) {
+		return;
+	}
+
+	std::vector<cl_int> grid;
+	for (int y = 0; y < height; y += previewStride) {
+		for (int x = 0; x < width; x += previewStride) {
+			grid.push_back(y * width + x);
+		}
+	}
+	previewPixels = (int)grid.size();
+	clEnqueueWriteBuffer(OpenclManager::getInstance()->getCommandQueue(), previewBuffer, CL_TRUE, 0, grid.size() * sizeof(cl_int), grid.data(), 0, NULL, NULL);
+}
+
+size_t Renderer::getShownPixel(size_t pixel) const
+{
+	if (coveredStride <= 1 || sampleCount[pixel] > 0) {
+		return pixel;
+	}
+
+	// the nearest grid point, every one of them inside the image is traced
+	const int x = (int)(pixel % width);
+	const int y = (int)(pixel / width);
+	const int gridX = std::min((x + coveredStride / 2) / coveredStride, (width - 1) / coveredStride) * coveredStride;
+	const int gridY = std::min((y + coveredStride / 2) / coveredStride, (height - 1) / coveredStride) * coveredStride;
+	return (size_t)gridY * width + gridX;
+}
+
+void Renderer::setProgressive(bool enabled)
+{
+	progressive = enabled;
+	progressiveLevel = progressive && coveredStride == 0 ? 0 : kProgressiveLevels;
+}
+
+int Renderer::getLevelStride(int level)
+{
+	return 1 << (kProgressiveLevels - 1 - level);
+}
+
+void Renderer::setTemporal(bool enabled, int maxHistory)
+{
+	temporal = enabled;
+	temporalHistory = std::max(1, maxHistory);
+	if (!temporal) {
+		historyPending = false;
+	}
+	else if (historyAccumulationBuffer == nullptr) {
+		const size_t pixels = (size_t)width * height;
+		cl_context context = OpenclManager::getInstance()->getContent();
+		historyAccumulationBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, 3 * pixels * sizeof(float), NULL, NULL);
+		historySquareBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, pixels * sizeof(float), NULL, NULL);
+		historyCountBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, pixels * sizeof(cl_int), NULL, NULL);
+		historyAovBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, std::max<size_t>(1, aovSums.size()) * sizeof(float), NULL, NULL);
+	}
+	setBuildOptions(getAovOptions(getRequestedAovs()));
+}
+
+void Renderer::setAdaptive(float threshold, int minSamples)
+{
+	adaptiveThreshold = std::max(0.0f, threshold);
+	adaptiveMinSamples = std::max(2, minSamples);
+}
+
+void Renderer::setSeed(uint32_t seed)
+{
+	generator.seed(seed);
+}
+
+bool Renderer::saveCheckpoint(const std::string& path)
+{
+	if (checkpointWritten.valid() && checkpointWritten.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+		CGRA_LOGW("previous checkpoint still being written, skipping");
+		return false;
+	}
+	waitForCheckpoint();
+
+	CGRA_TRACE_SCOPE("checkpoint snapshot");
+	readAccumulation();
+	Checkpoint checkpoint;
+	checkpoint.width = width;
+	checkpoint.height = height;
+	checkpoint.scene = scene;
+	checkpoint.samples = samples;
+	std::ostringstream state;
+	state << generator;
+	checkpoint.generator = state.str();
+	checkpoint.accumulation.assign(accumulatedColor, accumulatedColor + 3 * (size_t)width * height);
+	checkpoint.squares.assign(accumulatedSquare, accumulatedSquare + (size_t)width * height);
+	checkpoint.counts.assign(sampleCount, sampleCount + (size_t)width * height);
+	for (const AovInfo& info : kAovs) {
+		const int offset = getAovOffset(info.aov);
+		if (offset < 0) {
+			continue;
+		}
+		std::vector<float>& sums = checkpoint.features[info.name];
+		sums.resize(info.channels * (size_t)width * height);
+		for (size_t i = 0; i < (size_t)width * height; i++) {
+			for (int k = 0; k < info.channels; k++) {
+				sums[info.channels * i + k] = aovSums[aovStride * i + offset + k];
+			}
+		}
+	}
+
+	checkpointWritten = std::async(std::launch::async, [path, checkpoint = std::move(checkpoint)]() {
+		CGRA_TRACE_SCOPE("checkpoint write");
+		return Checkpoint::write(path, checkpoint);
+	});
+	return true;
+}
+
+bool Renderer::waitForCheckpoint()
+{
+	if (!checkpointWritten.valid()) {
+		return true;
+	}
+	return checkpointWritten.get();
+}
+
+bool Renderer::resume(const std::string& path)
+{
+	Checkpoint checkpoint;
+	if (!Checkpoint::read(path, checkpoint)) {
+		return false;
+	}
+
+	if (checkpoint.width != width || checkpoint.height != height) {
+		CGRA_LOGE("%s is %dx%d, the renderer %dx%d", path.c_str(), checkpoint.width, checkpoint.height, width, height);
+		return false;
+	}
+	if (checkpoint.scene != SCENE_SPHERES && checkpoint.scene != SCENE_CUBEMAP) {
+		CGRA_LOGE("%s has unknown scene %d", path.c_str(), checkpoint.scene);
+		return false;
+	}
+
+	std::istringstream state(checkpoint.generator);
+	std::mt19937 restored;
+	state >> restored;
+	if (state.fail()) {
+		CGRA_LOGE("%s has a broken RNG state", path.c_str());
+		return false;
+	}
+
+	// a rebuild for AOVs asked for before, such as the denoiser's, would reset the samples if it landed after them
+	if (waitForBuild()) {
+		waitForRebuild();
+		update();
+	}
+
+	scene = (Scene)checkpoint.scene;
+	camera = getDefaultCamera(scene);
+	historyPending = false;
+	samples = checkpoint.samples;
+	coveredStride = samples > 0 ? 1 : 0;
+	progressiveLevel = progressive && samples == 0 ? 0 : kProgressiveLevels;
+	generator = restored;
+	memcpy(accumulatedColor, checkpoint.accumulation.data(), checkpoint.accumulation.size() * sizeof(float));
+	memcpy(accumulatedSquare, checkpoint.squares.data(), checkpoint.squares.size() * sizeof(float));
+	memcpy(sampleCount, checkpoint.counts.data(), checkpoint.counts.size() * sizeof(int));
+	accumulationChanged = false;
+
+	const size_t pixels = (size_t)width * height;
+	cl_command_queue queue = OpenclManager::getInstance()->getCommandQueue();
+	clEnqueueWriteBuffer(queue, accumulationBuffer, CL_FALSE, 0, 3 * pixels * sizeof(float), accumulatedColor, 0, NULL, NULL);
+	clEnqueueWriteBuffer(queue, squareBuffer, CL_FALSE, 0, pixels * sizeof(float), accumulatedSquare, 0, NULL, NULL);
+	clEnqueueWriteBuffer(queue, countBuffer, CL_TRUE, 0, pixels * sizeof(cl_int), sampleCount, 0, NULL, NULL);
+
+	// AOVs the checkpoint does not have start from zero, they are off by the samples before the resume
+	std::fill(aovSums.begin(), aovSums.end(), 0.0f);
+	for (const AovInfo& info : kAovs) {
+		const int offset = getAovOffset(info.aov);
+		auto sums = checkpoint.features.find(info.name);
+		if (offset < 0 || sums == checkpoint.features.end() || sums->second.size() != info.channels * pixels) {
+			continue;
+		}
+		for (size_t i = 0; i < pixels; i++) {
+			for (int k = 0; k < info.channels; k++) {
+				aovSums[aovStride * i + offset + k] = sums->second[info.channels * i + k];
+			}
+		}
+	}
+	if (aovStride > 0) {
+		clEnqueueWriteBuffer(queue, aovBuffer, CL_TRUE, 0, aovSums.size() * sizeof(float), aovSums.data(), 0, NULL, NULL);
+	}
+	denoiseChanged = true;
+	resumed = true;
+	CGRA_LOGD("resumed %s at %d spp", path.c_str(), samples);
+	return true;
+}
+
+void Renderer::setScene(Scene newScene)
+{
+	if (scene != newScene) {
+		scene = newScene;
+		camera = getDefaultCamera(scene);
+		resetAccumulation();
+	}
+}
+
+bool Renderer::setInstanceTransform(int instance, const SceneDescription::Transform& transform)
+{
+	SceneData& data = scenes[scene];
+	SceneDescription::Transform inverse;
+	if (instance < 0 || instance >= (int)data.description.instances.size() || !transform.invert(inverse)) {
+		CGRA_LOGE("cannot move instance %d", instance);
+		return false;
+	}
+
+	data.description.instances[instance].transform = transform;
+	uploadInstances(data);
+	resetAccumulation();
+	return true;
+}
+
+bool Renderer::setObjectSpheres(int object, const std::vector<SceneDescription::Sphere>& spheres)
+{
+	SceneData& data = scenes[scene];
+	if (object < 0 || object >= (int)data.description.objects.size()) {
+		CGRA_LOGE("no object %d", object);
+		return false;
+	}
+	for (const SceneDescription::Sphere& sphere : spheres) {
+		if (sphere.material < 0 || sphere.material >= (int)data.description.materials.size()) {
+			CGRA_LOGE("no material %d", sphere.material);
+			return false;
+		}
+	}
+
+	std::vector<SceneDescription::Sphere>& current = data.description.objects[object].spheres;
+	const bool sameCount = current.size() == spheres.size();
+	current = spheres;
+	Bvh& bvh = data.objectTrees[object];
+	if (sameCount) {
+		bvh.refit(getSphereBounds(spheres));
+	}
+	if (!sameCount || bvh.needsRebuild()) {
+		// only this object is rebuilt, but its tree may change size and move the ones after it
+		bvh = Bvh::build(getSphereBounds(spheres), data.builder);
+		uploadObjects(data);
+	}
+	else {
+		// in place, queued behind any launch still reading the old one
+		std::vector<Bvh::Node> nodes;
+		std::vector<SphereBlock> blocks;
+		std::vector<cl_int> sphereIds;
+		std::vector<MaterialData> materials;
+		packObject(data, object, nodes, blocks, sphereIds, materials);
+		cl_command_queue queue = OpenclManager::getInstance()->getCommandQueue();
+		clEnqueueWriteBuffer(queue, data.nodes, CL_TRUE, data.objectRoots[object] * sizeof(Bvh::Node), nodes.size() * sizeof(Bvh::Node), nodes.data(), 0, NULL, NULL);
+		if (!blocks.empty()) {
+			clEnqueueWriteBuffer(queue, data.spheres, CL_TRUE, data.objectFirstBlock[object] * sizeof(SphereBlock), blocks.size() * sizeof(SphereBlock), blocks.data(), 0, NULL, NULL);
+			clEnqueueWriteBuffer(queue, data.materials, CL_TRUE, data.objectFirstSphere[object] * sizeof(MaterialData), materials.size() * sizeof(MaterialData), materials.data(), 0, NULL, NULL);
+		}
+	}
+	uploadInstances(data);
+	resetAccumulation();
+	return true;
+}
+
+void Renderer::setBvhBuilder(Bvh::Builder builder)
+{
+	if (builder == bvhBuilder) {
+		return;
+	}
+
+	bvhBuilder = builder;
+	for (SceneData& data : scenes) {
+		data.builder = builder;
+		for (size_t object = 0; object < data.objectTrees.size(); object++) {
+			data.objectTrees[object] = Bvh::build(getSphereBounds(data.description.objects[object].spheres), builder);
+		}
+		uploadObjects(data);
+		uploadInstances(data);
+	}
+	resetAccumulation();
+}
+
+void Renderer::changeScene()
+{
+	setScene(scene == SCENE_SPHERES ? SCENE_CUBEMAP : SCENE_SPHERES);
+}
+
+const char* Renderer::getAovName(Aov aov)
+{
+	for (const AovInfo& info : kAovs) {
+		if (info.aov == aov) {
+			return info.name;
+		}
+	}
+	return "unknown";
+}
+
+bool Renderer::findAov(const char* const name, Aov& aov)
+{
+	for (const AovInfo& info : kAovs) {
+		if (strcmp(info.name, name) == 0) {
+			aov = info.aov;
+			return true;
+		}
+	}
+	return false;
+}
+
+int Renderer::getAovChannels(Aov aov)
+{
+	for (const AovInfo& info : kAovs) {
+		if (info.aov == aov) {
+			return info.channels;
+		}
+	}
+	return 0;
+}
+
+const char* Renderer::getSceneName(Scene scene)
+{
+	switch (scene) {
+	case SCENE_SPHERES:
+		return "render";
+	case SCENE_CUBEMAP:
+		return "demo_cubemap";
+	}
+	return "unknown";
+}
+
+} // namespace CGRA
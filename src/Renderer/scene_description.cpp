@@ -0,0 +1,110 @@
+#include "scene_description.h"
+
+#include <math.h>
+
+namespace CGRA {
+
+SceneDescription::Transform SceneDescription::Transform::translation(float x, float y, float z)
+{
+	Transform transform;
+	transform.m[0][3] = x;
+	transform.m[1][3] = y;
+	transform.m[2][3] = z;
+	return transform;
+}
+
+bool SceneDescription::Transform::invert(Transform& inverse) const
+{
+	// the inverse of the linear part from its cofactors, then the translation undone
+	const float (*a)[4] = m;
+	const float c00 = a[1][1] * a[2][2] - a[1][2] * a[2][1];
+	const float c01 = a[1][2] * a[2][0] - a[1][0] * a[2][2];
+	const float c02 = a[1][0] * a[2][1] - a[1][1] * a[2][0];
+	const float determinant = a[0][0] * c00 + a[0][1] * c01 + a[0][2] * c02;
+	if (fabsf(determinant) < 1e-12f) {
+		return false;
+	}
+
+	const float s = 1.0f / determinant;
+	Transform result;
+	result.m[0][0] = c00 * s;
+	result.m[0][1] = (a[0][2] * a[2][1] - a[0][1] * a[2][2]) * s;
+	result.m[0][2] = (a[0][1] * a[1][2] - a[0][2] * a[1][1]) * s;
+	result.m[1][0] = c01 * s;
+	result.m[1][1] = (a[0][0] * a[2][2] - a[0][2] * a[2][0]) * s;
+	result.m[1][2] = (a[0][2] * a[1][0] - a[0][0] * a[1][2]) * s;
+	result.m[2][0] = c02 * s;
+	result.m[2][1] = (a[0][1] * a[2][0] - a[0][0] * a[2][1]) * s;
+	result.m[2][2] = (a[0][0] * a[1][1] - a[0][1] * a[1][0]) * s;
+	for (int row = 0; row < 3; row++) {
+		result.m[row][3] = -(result.m[row][0] * a[0][3] + result.m[row][1] * a[1][3] + result.m[row][2] * a[2][3]);
+	}
+	inverse = result;
+	return true;
+}
+
+void SceneDescription::Transform::apply(const float point[3], float result[3]) const
+{
+	for (int row = 0; row < 3; row++) {
+		result[row] = m[row][0] * point[0] + m[row][1] * point[1] + m[row][2] * point[2] + m[row][3];
+	}
+}
+
+std::vector<int> SceneDescription::getPrimitiveOffsets() const
+{
+	std::vector<int> offsets(instances.size());
+	int offset = 0;
+	for (size_t i = 0; i < instances.size(); i++) {
+		offsets[i] = offset;
+		offset += (int)objects[instances[i].object].spheres.size();
+	}
+	return offsets;
+}
+
+SceneDescription SceneDescription::getSpheres()
+{
+	SceneDescription scene;
+	scene.materials = {
+		{{1.0f, 1.0f, 1.0f}, MATERIAL_LIGHT},
+		{{1.0f, 1.0f, 1.0f}, MATERIAL_MIRROR},
+		{{0.9f, 0.9f, 0.9f}, MATERIAL_DIFFUSE},
+		{{1.0f, 0.0f, 0.0f}, MATERIAL_DIFFUSE},
+		{{0.0f, 0.0f, 1.0f}, MATERIAL_DIFFUSE},
+		{{1.0f, 1.0f, 0.0f}, MATERIAL_DIFFUSE},
+		{{0.0f, 1.0f, 0.0f}, MATERIAL_DIFFUSE},
+		{{0.0f, 1.0f, 1.0f}, MATERIAL_DIFFUSE},
+	};
+	Object room;
+	room.spheres = {
+		{{-1.4f, 1.5f, 0.2f}, 0.5f, 0},
+		{{-1.3f, 0.0f, 0.2f}, 0.5f, 1},
+		{{0.0f, -10002.0f, 0.0f}, 10000.0f, 2},
+		{{-10002.0f, 0.0f, 0.0f}, 10000.0f, 3},
+		{{10002.0f, 0.0f, 0.0f}, 10000.0f, 4},
+		{{0.0f, 10002.0f, 0.0f}, 10000.0f, 2},
+		{{0.0f, 0.0f, -10002.0f}, 10000.0f, 5},
+		{{0.0f, 0.0f, 10002.0f}, 10000.0f, 6},
+		{{0.0f, 0.0f, 1.5f}, 0.5f, 7},
+	};
+	scene.objects.push_back(room);
+	scene.instances.push_back({0, Transform()});
+	return scene;
+}
+
+SceneDescription SceneDescription::getCubemap()
+{
+	SceneDescription scene;
+	scene.materials = {
+		{{1.0f, 1.0f, 1.0f}, MATERIAL_MIRROR},
+	};
+	Object mirror;
+	mirror.spheres = {
+		{{0.0f, 0.0f, 0.0f}, 0.5f, 0},
+	};
+	scene.objects.push_back(mirror);
+	scene.instances.push_back({0, Transform::translation(0.0f, 0.0f, 2.0f)});
+	scene.instances.push_back({0, Transform::translation(-1.5f, 0.0f, 2.0f)});
+	return scene;
+}
+
+} // namespace CGRA
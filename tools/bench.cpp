@@ -0,0 +1,618 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "image_metrics.h"
+#include "log.h"
+#include "opencl_manager.h"
+#include "opencl_profiler.h"
+#include "renderer.h"
+#include "timer.h"
+
+// Headless benchmark of the OpenCL renderer.
+// usage: bench [--scene name]... [--spp n] [--samples-per-launch n] [--warmup n] [--out file.json]
+//              [--baseline file.json] [--tolerance fraction] [--kernel file.cl] [--skybox dir/]
+// Renders every scene to n samples per pixel, in launches of --samples-per-launch
+// samples (default 1), and writes the throughput as JSON, by default to
+// LOCAL_LOG_DIR/bench.json.
+// With --baseline, exits with 1 when a scene's samples/s drops more than the
+// tolerance (default 0.05) below the baseline, 2 on any other failure.
+//
+// bench --convergence [--reference-spp n] [--budget seconds] measures quality
+// against time instead: each scene is rendered once to the reference spp
+// (cached in LOCAL_LOG_DIR, delete the reference_*.bin files after changing
+// what the kernels converge to), then progressively until the time budget runs
+// out, recording RMSE and relMSE against the reference at every power of two
+// spp. The curves go to LOCAL_LOG_DIR/convergence.json by default. --adaptive
+// threshold renders the progressive pass with adaptive sampling and --denoise
+// measures the denoised image instead of the average; the reference uses
+// neither.
+//
+// bench --animate [--spheres n] [--frames n] measures scene updates instead:
+// n small spheres (100000 by default) are added to the room of the "render"
+// scenes and turned around the y axis, faster the further out they are, for
+// --frames frames (120 by default) of one sample each. Every frame replaces
+// the spheres through Renderer::setObjectSpheres(), which refits the room's
+// BVH in place until its SAH cost degrades and then rebuilds it. The mean
+// update time of refit and of rebuilt frames and the SAH cost over the build's
+// go to LOCAL_LOG_DIR/animation.json by default.
+
+using namespace CGRA;
+
+struct BenchScene {
+    const char* name;
+    Renderer::Scene scene;
+    int width;
+    int height;
+};
+
+// the two kernels at the viewer resolution, then at stress resolutions
+static const BenchScene kScenes[] = {
+    {"render", Renderer::SCENE_SPHERES, 640, 480},
+    {"demo_cubemap", Renderer::SCENE_CUBEMAP, 640, 480},
+    {"render_1080p", Renderer::SCENE_SPHERES, 1920, 1080},
+    {"demo_cubemap_1080p", Renderer::SCENE_CUBEMAP, 1920, 1080},
+    {"render_4k", Renderer::SCENE_SPHERES, 3840, 2160},
+};
+
+struct BenchResult {
+    std::string name;
+    int width;
+    int height;
+    int spp;
+    int samplesPerLaunch;
+    double startupMs;
+    double seconds;
+    double samplesPerSecond;
+    double mraysPerSecond;
+    UTILITY::Histogram frames;
+    std::vector<OpenclProfiler::Stage> stages;
+};
+
+static bool run_scene(const BenchScene& scene, const std::string& kernel, const std::string& skybox, int spp, int samplesPerLaunch, int warmup, BenchResult& result)
+{
+    result.name = scene.name;
+    result.width = scene.width;
+    result.height = scene.height;
+    result.spp = spp;
+    result.samplesPerLaunch = samplesPerLaunch;
+
+    uint64_t begin = UTILITY::Clock::now();
+    Renderer renderer(kernel.c_str(), skybox.c_str(), scene.width, scene.height);
+    renderer.setScene(scene.scene);
+    if (!renderer.waitUntilReady()) {
+        CGRA_LOGE("%s: %s", scene.name, renderer.getBuildLog().c_str());
+        return false;
+    }
+
+    // the first launches pay for lazy driver work, keep them out of the numbers
+    for (int i = 0; i < warmup; i++) {
+        renderer.step(samplesPerLaunch);
+        renderer.wait();
+    }
+    result.startupMs = (UTILITY::Clock::now() - begin) * 1e-6;
+
+    renderer.resetAccumulation();
+    OpenclProfiler* profiler = OpenclProfiler::getInstance();
+    profiler->collect();
+    profiler->reset();
+
+    // frames are launches, the last one short if spp is not a multiple
+    begin = UTILITY::Clock::now();
+    for (int i = 0; i < spp; i += samplesPerLaunch) {
+        UTILITY::ScopedTimer timer(&result.frames);
+        renderer.step(std::min(samplesPerLaunch, spp - i));
+        renderer.wait();
+    }
+    const uint64_t elapsed = UTILITY::Clock::now() - begin;
+
+    profiler->collect();
+    result.stages = profiler->getStages();
+
+    if (renderer.getSampleCount() != spp) {
+        CGRA_LOGE("%s: %d of %d samples rendered", scene.name, renderer.getSampleCount(), spp);
+        return false;
+    }
+
+    const double samples = (double)scene.width * scene.height * spp;
+    result.seconds = elapsed * 1e-9;
+    result.samplesPerSecond = samples / result.seconds;
+    result.mraysPerSecond = samples * Renderer::kRaysPerSample / result.seconds * 1e-6;
+    return true;
+}
+
+static std::string device_name()
+{
+    char name[256] = {0};
+    clGetDeviceInfo(*OpenclManager::getInstance()->getDevices(), CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+    return name;
+}
+
+struct ConvergencePoint {
+    int spp;
+    double ms;
+    double rmse;
+    double relMse;
+};
+
+struct ConvergenceResult {
+    std::string name;
+    int referenceSpp;
+    float adaptive;
+    bool denoise;
+    std::vector<ConvergencePoint> points;
+};
+
+static const char kReferenceMagic[8] = {'C', 'G', 'R', 'A', 'R', 'E', 'F', '1'};
+
+// magic, width, height, spp, then the linear RGB floats
+static bool load_reference(const std::string& path, int width, int height, int spp, std::vector<float>& reference)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+
+    char magic[8];
+    int header[3];
+    reference.resize(3 * (size_t)width * height);
+    bool valid = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, kReferenceMagic, sizeof(magic)) == 0
+        && fread(header, sizeof(header), 1, file) == 1 && header[0] == width && header[1] == height && header[2] >= spp
+        && fread(reference.data(), sizeof(float), reference.size(), file) == reference.size();
+    fclose(file);
+    return valid;
+}
+
+static bool save_reference(const std::string& path, int width, int height, int spp, const std::vector<float>& reference)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        CGRA_LOGE("cannot open %s", path.c_str());
+        return false;
+    }
+
+    const int header[3] = {width, height, spp};
+    bool written = fwrite(kReferenceMagic, sizeof(kReferenceMagic), 1, file) == 1 && fwrite(header, sizeof(header), 1, file) == 1
+        && fwrite(reference.data(), sizeof(float), reference.size(), file) == reference.size();
+    fclose(file);
+    return written;
+}
+
+static bool run_convergence(const BenchScene& scene, const std::string& kernel, const std::string& skybox, int referenceSpp, double budget, float adaptive, bool denoise, ConvergenceResult& result)
+{
+    result.name = scene.name;
+    result.referenceSpp = referenceSpp;
+    result.adaptive = adaptive;
+    result.denoise = denoise;
+
+    Renderer renderer(kernel.c_str(), skybox.c_str(), scene.width, scene.height);
+    renderer.setScene(scene.scene);
+    if (!renderer.waitUntilReady()) {
+        CGRA_LOGE("%s: %s", scene.name, renderer.getBuildLog().c_str());
+        return false;
+    }
+
+    const size_t count = 3 * (size_t)scene.width * scene.height;
+    const std::string referencePath = std::string(LOCAL_LOG_DIR) + "reference_" + scene.name + ".bin";
+    std::vector<float> reference;
+    if (load_reference(referencePath, scene.width, scene.height, referenceSpp, reference)) {
+        CGRA_LOGD("%s: using the reference in %s", scene.name, referencePath.c_str());
+    }
+    else {
+        CGRA_LOGD("%s: rendering a %d spp reference", scene.name, referenceSpp);
+        for (int i = 0; i < referenceSpp; i++) {
+            renderer.step();
+            renderer.wait();
+        }
+        reference.resize(count);
+        renderer.getAverage(reference.data());
+        std::error_code error;
+        std::filesystem::create_directories(LOCAL_LOG_DIR, error);
+        save_reference(referencePath, scene.width, scene.height, referenceSpp, reference);
+        renderer.resetAccumulation();
+    }
+    renderer.setAdaptive(adaptive);
+
+    // only the rendering counts against the budget, not the error evaluation
+    std::vector<float> image(count);
+    uint64_t rendering = 0;
+    int next = 1;
+    while (rendering * 1e-9 < budget && renderer.getSampleCount() < referenceSpp && !renderer.isConverged()) {
+        {
+            UTILITY::ScopedTimer timer(nullptr, &rendering);
+            renderer.step();
+            renderer.wait();
+        }
+
+        if (renderer.getSampleCount() == next || rendering * 1e-9 >= budget || renderer.isConverged()) {
+            if (denoise) {
+                renderer.getDenoised(image.data());
+            }
+            else {
+                renderer.getAverage(image.data());
+            }
+            result.points.push_back({renderer.getSampleCount(), rendering * 1e-6,
+                ImageMetrics::rmse(image.data(), reference.data(), count), ImageMetrics::relMse(image.data(), reference.data(), count)});
+            next *= 2;
+        }
+    }
+    return true;
+}
+
+struct AnimationResult {
+    std::string name;
+    int spheres;
+    int frames;
+    int refits;
+    int rebuilds;
+    double refitMs;   // mean setObjectSpheres() time of the frames that refit
+    double rebuildMs; // of the frames that rebuilt
+    double maxCostRatio;
+    double finalCostRatio;
+};
+
+// the white diffuse of the spheres scene
+static const int kCloudMaterial = 2;
+
+static bool run_animation(const BenchScene& scene, const std::string& kernel, const std::string& skybox, int cloudSpheres, int frames, AnimationResult& result)
+{
+    result.name = scene.name;
+    result.spheres = cloudSpheres;
+    result.frames = frames;
+    result.refits = 0;
+    result.rebuilds = 0;
+    result.maxCostRatio = 1.0;
+    result.finalCostRatio = 1.0;
+
+    Renderer renderer(kernel.c_str(), skybox.c_str(), scene.width, scene.height);
+    renderer.setScene(scene.scene);
+    if (!renderer.waitUntilReady()) {
+        CGRA_LOGE("%s: %s", scene.name, renderer.getBuildLog().c_str());
+        return false;
+    }
+
+    // the cloud goes after the room's own spheres in object 0
+    std::vector<SceneDescription::Sphere> spheres = renderer.getSceneDescription().objects[0].spheres;
+    const size_t first = spheres.size();
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> position(-1.5f, 1.5f);
+    for (int i = 0; i < cloudSpheres; i++) {
+        spheres.push_back({{position(generator), position(generator), position(generator)}, 0.01f, kCloudMaterial});
+    }
+    const std::vector<SceneDescription::Sphere> start = spheres;
+    if (!renderer.setObjectSpheres(0, spheres)) {
+        return false;
+    }
+
+    uint64_t refitTime = 0;
+    uint64_t rebuildTime = 0;
+    float buildCost = renderer.getObjectTree(0).getBuildCost();
+    for (int frame = 1; frame <= frames; frame++) {
+        for (size_t i = first; i < spheres.size(); i++) {
+            const float x = start[i].center[0];
+            const float z = start[i].center[2];
+            const float angle = 0.02f * frame * (1.0f + sqrtf(x * x + z * z));
+            spheres[i].center[0] = x * cosf(angle) - z * sinf(angle);
+            spheres[i].center[2] = x * sinf(angle) + z * cosf(angle);
+        }
+
+        const uint64_t begin = UTILITY::Clock::now();
+        if (!renderer.setObjectSpheres(0, spheres)) {
+            return false;
+        }
+        const uint64_t elapsed = UTILITY::Clock::now() - begin;
+
+        // only a rebuild sets a new build cost
+        const Bvh& tree = renderer.getObjectTree(0);
+        if (tree.getBuildCost() != buildCost) {
+            result.rebuilds++;
+            rebuildTime += elapsed;
+        }
+        else {
+            result.refits++;
+            refitTime += elapsed;
+        }
+        buildCost = tree.getBuildCost();
+        result.finalCostRatio = tree.getSahCost() / tree.getBuildCost();
+        result.maxCostRatio = std::max(result.maxCostRatio, result.finalCostRatio);
+
+        // trace the moved spheres, so the updated buffers are read before the next update
+        renderer.step();
+        renderer.wait();
+    }
+    result.refitMs = result.refits == 0 ? 0.0 : refitTime * 1e-6 / result.refits;
+    result.rebuildMs = result.rebuilds == 0 ? 0.0 : rebuildTime * 1e-6 / result.rebuilds;
+    return true;
+}
+
+static void write_animation_json(FILE* out, const std::vector<AnimationResult>& results)
+{
+    fprintf(out, "{\n  \"version\": 1,\n  \"device\": \"%s\",\n  \"animations\": [\n", device_name().c_str());
+    for (size_t i = 0; i < results.size(); i++) {
+        const AnimationResult& result = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"spheres\": %d, \"frames\": %d, \"refits\": %d, \"rebuilds\": %d, \"refit_mean_ms\": %.3f, \"rebuild_mean_ms\": %.3f, "
+            "\"sah_cost_ratio_max\": %.3f, \"sah_cost_ratio_final\": %.3f}%s\n",
+            result.name.c_str(), result.spheres, result.frames, result.refits, result.rebuilds, result.refitMs, result.rebuildMs,
+            result.maxCostRatio, result.finalCostRatio, i + 1 == results.size() ? "" : ",");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+static void write_convergence_json(FILE* out, const std::vector<ConvergenceResult>& results)
+{
+    fprintf(out, "{\n  \"version\": 1,\n  \"device\": \"%s\",\n  \"curves\": [\n", device_name().c_str());
+    for (size_t i = 0; i < results.size(); i++) {
+        const ConvergenceResult& result = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"reference_spp\": %d, \"adaptive\": %g, \"denoise\": %s, \"points\": [", result.name.c_str(), result.referenceSpp, result.adaptive,
+            result.denoise ? "true" : "false");
+        for (size_t j = 0; j < result.points.size(); j++) {
+            const ConvergencePoint& point = result.points[j];
+            fprintf(out, "%s{\"spp\": %d, \"ms\": %.3f, \"rmse\": %.6g, \"relmse\": %.6g}", j == 0 ? "" : ", ", point.spp, point.ms, point.rmse, point.relMse);
+        }
+        fprintf(out, "]}%s\n", i + 1 == results.size() ? "" : ",");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+// one scene per line, so read_baseline() can get away without a JSON parser
+static void write_json(FILE* out, const std::vector<BenchResult>& results)
+{
+    fprintf(out, "{\n  \"version\": 1,\n  \"device\": \"%s\",\n  \"scenes\": [\n", device_name().c_str());
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& result = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"width\": %d, \"height\": %d, \"spp\": %d, \"samples_per_launch\": %d, \"startup_ms\": %.3f, \"time_to_spp_ms\": %.3f, "
+            "\"samples_per_second\": %.1f, \"mrays_per_second\": %.3f, \"frame_mean_ms\": %.3f, \"frame_p50_ms\": %.3f, \"frame_p99_ms\": %.3f, \"stages\": {",
+            result.name.c_str(), result.width, result.height, result.spp, result.samplesPerLaunch, result.startupMs, result.seconds * 1e3,
+            result.samplesPerSecond, result.mraysPerSecond, result.frames.getMean() * 1e-6, result.frames.percentile(50) * 1e-6, result.frames.percentile(99) * 1e-6);
+        for (size_t j = 0; j < result.stages.size(); j++) {
+            const OpenclProfiler::Stage& stage = result.stages[j];
+            fprintf(out, "%s\"%s\": {\"count\": %lu, \"mean_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f}", j == 0 ? "" : ", ",
+                stage.name.c_str(), stage.count, stage.totalExecute * 1e-6 / stage.count, stage.minExecute * 1e-6, stage.maxExecute * 1e-6);
+        }
+        fprintf(out, "}}%s\n", i + 1 == results.size() ? "" : ",");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+static FILE* open_output(const std::string& path)
+{
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        CGRA_LOGE("cannot open %s", path.c_str());
+    }
+    return file;
+}
+
+static bool read_baseline(const char* const path, std::map<std::string, double>& samplesPerSecond)
+{
+    FILE* file = fopen(path, "r");
+    if (file == nullptr) {
+        CGRA_LOGE("cannot open %s", path);
+        return false;
+    }
+
+    char line[4096];
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        const char* name = strstr(line, "\"name\": \"");
+        const char* rate = strstr(line, "\"samples_per_second\": ");
+        if (name == nullptr || rate == nullptr) {
+            continue;
+        }
+        name += strlen("\"name\": \"");
+        const char* end = strchr(name, '"');
+        if (end != nullptr) {
+            samplesPerSecond[std::string(name, end)] = atof(rate + strlen("\"samples_per_second\": "));
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    std::string kernel = std::string(PROJECT_ROOT_DIR) + "src/OpenCL/test.cl";
+    std::string skybox = std::string(PROJECT_ROOT_DIR) + "skybox/";
+    std::vector<std::string> selected;
+    std::string out;
+    const char* baseline = nullptr;
+    double tolerance = 0.05;
+    int spp = 64;
+    int samplesPerLaunch = 1;
+    int warmup = 4;
+    bool convergence = false;
+    int referenceSpp = 4096;
+    double budget = 10.0;
+    double adaptive = 0.0;
+    bool denoise = false;
+    bool animate = false;
+    int cloudSpheres = 100000;
+    int frames = 120;
+
+    for (int i = 1; i < argc; i++) {
+        const bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--scene") == 0 && hasValue) {
+            selected.push_back(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--spp") == 0 && hasValue) {
+            spp = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--samples-per-launch") == 0 && hasValue) {
+            samplesPerLaunch = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--warmup") == 0 && hasValue) {
+            warmup = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--out") == 0 && hasValue) {
+            out = argv[++i];
+        }
+        else if (strcmp(argv[i], "--baseline") == 0 && hasValue) {
+            baseline = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tolerance") == 0 && hasValue) {
+            tolerance = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--convergence") == 0) {
+            convergence = true;
+        }
+        else if (strcmp(argv[i], "--reference-spp") == 0 && hasValue) {
+            referenceSpp = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--budget") == 0 && hasValue) {
+            budget = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--adaptive") == 0 && hasValue) {
+            adaptive = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--denoise") == 0) {
+            denoise = true;
+        }
+        else if (strcmp(argv[i], "--animate") == 0) {
+            animate = true;
+        }
+        else if (strcmp(argv[i], "--spheres") == 0 && hasValue) {
+            cloudSpheres = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && hasValue) {
+            frames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--kernel") == 0 && hasValue) {
+            kernel = argv[++i];
+        }
+        else if (strcmp(argv[i], "--skybox") == 0 && hasValue) {
+            skybox = argv[++i];
+        }
+        else {
+            fprintf(stderr, "usage: %s [--scene name]... [--spp n] [--samples-per-launch n] [--warmup n] [--out file.json] [--baseline file.json] [--tolerance fraction] [--kernel file.cl] [--skybox dir/]\n", argv[0]);
+            fprintf(stderr, "       %s --convergence [--scene name]... [--reference-spp n] [--budget seconds] [--adaptive threshold] [--denoise] [--out file.json]\n", argv[0]);
+            fprintf(stderr, "       %s --animate [--scene name]... [--spheres n] [--frames n] [--out file.json]\n", argv[0]);
+            fprintf(stderr, "scenes:");
+            for (const BenchScene& scene : kScenes) {
+                fprintf(stderr, " %s", scene.name);
+            }
+            fprintf(stderr, "\n");
+            return 2;
+        }
+    }
+
+    if (spp <= 0 || referenceSpp <= 0 || samplesPerLaunch <= 0 || cloudSpheres < 0 || frames <= 0) {
+        CGRA_LOGE("--spp, --samples-per-launch, --reference-spp and --frames must be positive, --spheres not negative");
+        return 2;
+    }
+
+    std::vector<const BenchScene*> scenes;
+    for (const BenchScene& scene : kScenes) {
+        bool wanted = selected.empty();
+        for (const std::string& name : selected) {
+            wanted = wanted || name == scene.name;
+        }
+        // the cloud needs the room and its materials
+        if (wanted && (!animate || scene.scene == Renderer::SCENE_SPHERES)) {
+            scenes.push_back(&scene);
+        }
+    }
+
+    if (scenes.empty()) {
+        CGRA_LOGE("no scene matches");
+        return 2;
+    }
+
+    // the device and context before any renderer, whose buffers and background build share them
+    OpenclManager::getInstance();
+
+    if (animate) {
+        std::vector<AnimationResult> animations;
+        for (const BenchScene* scene : scenes) {
+            animations.emplace_back();
+            if (!run_animation(*scene, kernel, skybox, cloudSpheres, frames, animations.back())) {
+                return 2;
+            }
+            const AnimationResult& result = animations.back();
+            CGRA_LOGD("%s: %d refits of %.3f ms, %d rebuilds of %.3f ms, SAH cost up to %.2f times the build's", scene->name,
+                result.refits, result.refitMs, result.rebuilds, result.rebuildMs, result.maxCostRatio);
+        }
+
+        FILE* file = open_output(out.empty() ? std::string(LOCAL_LOG_DIR) + "animation.json" : out);
+        if (file == nullptr) {
+            return 2;
+        }
+        write_animation_json(file, animations);
+        fclose(file);
+        return 0;
+    }
+
+    if (convergence) {
+        std::vector<ConvergenceResult> curves;
+        for (const BenchScene* scene : scenes) {
+            curves.emplace_back();
+            if (!run_convergence(*scene, kernel, skybox, referenceSpp, budget, (float)adaptive, denoise, curves.back())) {
+                return 2;
+            }
+        }
+
+        FILE* file = open_output(out.empty() ? std::string(LOCAL_LOG_DIR) + "convergence.json" : out);
+        if (file == nullptr) {
+            return 2;
+        }
+        write_convergence_json(file, curves);
+        fclose(file);
+        return 0;
+    }
+
+    std::vector<BenchResult> results;
+    for (const BenchScene* pointer : scenes) {
+        const BenchScene& scene = *pointer;
+        results.emplace_back();
+        if (!run_scene(scene, kernel, skybox, spp, samplesPerLaunch, warmup, results.back())) {
+            return 2;
+        }
+        CGRA_LOGD("%s: %.1f Msamples/s, %.1f Mrays/s, %d spp in %.1f ms", scene.name,
+            results.back().samplesPerSecond * 1e-6, results.back().mraysPerSecond, spp, results.back().seconds * 1e3);
+    }
+
+    FILE* file = open_output(out.empty() ? std::string(LOCAL_LOG_DIR) + "bench.json" : out);
+    if (file == nullptr) {
+        return 2;
+    }
+    write_json(file, results);
+    fclose(file);
+
+    if (baseline == nullptr) {
+        return 0;
+    }
+
+    std::map<std::string, double> expected;
+    if (!read_baseline(baseline, expected)) {
+        return 2;
+    }
+
+    int regressions = 0;
+    for (const BenchResult& result : results) {
+        auto it = expected.find(result.name);
+        if (it == expected.end()) {
+            CGRA_LOGW("%s: not in the baseline", result.name.c_str());
+            continue;
+        }
+
+        const double change = result.samplesPerSecond / it->second - 1.0;
+        if (change < -tolerance) {
+            CGRA_LOGE("%s: %.1f%% slower than the baseline", result.name.c_str(), -change * 100);
+            regressions++;
+        }
+        else {
+            CGRA_LOGD("%s: %+.1f%% against the baseline", result.name.c_str(), change * 100);
+        }
+    }
+
+    UTILITY::Logger::flush();
+    return regressions == 0 ? 0 : 1;
+}
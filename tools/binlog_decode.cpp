@@ -0,0 +1,52 @@
+#include <stdio.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "binary_log.h"
+
+// Turns the files written by UTILITY::BinaryLog back into text.
+// usage: binlog_decode <file or directory>...
+// A directory decodes every binlog_*.bin in it, oldest first.
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file or directory>...\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++) {
+        std::error_code error;
+        if (std::filesystem::is_directory(argv[i], error)) {
+            std::vector<std::filesystem::directory_entry> entries;
+            for (const auto& entry : std::filesystem::directory_iterator(argv[i])) {
+                const std::string name = entry.path().filename().string();
+                if (name.rfind("binlog_", 0) == 0 && entry.path().extension() == ".bin") {
+                    entries.push_back(entry);
+                }
+            }
+            std::sort(entries.begin(), entries.end(), [](const std::filesystem::directory_entry& a, const std::filesystem::directory_entry& b) {
+                return a.last_write_time() < b.last_write_time();
+            });
+            for (const auto& entry : entries) {
+                paths.push_back(entry.path().string());
+            }
+        }
+        else {
+            paths.push_back(argv[i]);
+        }
+    }
+
+    int failed = 0;
+    for (const std::string& path : paths) {
+        if (!UTILITY::BinaryLog::decode(path.c_str(), stdout)) {
+            failed++;
+        }
+    }
+
+    return failed == 0 ? 0 : 1;
+}